@@ -0,0 +1,624 @@
+/*  Copyright 2026 Alain Knaff.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Write-behind layer for image files and block devices. Writes are
+ * copied into one of <depth> slots and handed to the kernel (io_uring)
+ * or to a small pool of worker threads, so that the caller may continue
+ * while earlier writes are still in flight. Reads overlapping a pending
+ * write, flushes and close wait for the outstanding writes. Errors of
+ * deferred writes are reported at flush time.
+ */
+
+#include "sysincludes.h"
+#include "mtools.h"
+#include "plain_io.h"
+#include "async_io.h"
+
+#if defined HAVE_LINUX_IO_URING_H && defined HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#if defined __NR_io_uring_setup && defined __NR_io_uring_enter
+#define USE_IO_URING
+#endif
+#endif
+
+#if defined HAVE_PTHREAD_H && defined HAVE_LIBPTHREAD
+#include <pthread.h>
+#define USE_ASYNC_THREADS
+#endif
+
+#if defined HAVE_PWRITE && (defined USE_IO_URING || defined USE_ASYNC_THREADS)
+
+#define ASYNC_MAX_THREADS 4
+
+typedef enum {
+	SLOT_FREE,
+	SLOT_QUEUED,	/* waiting for submission / for a worker */
+	SLOT_BUSY	/* handed to the kernel / being written by a worker */
+} slotState_t;
+
+typedef struct AsyncSlot_t {
+	slotState_t state;
+	char *buf;
+	size_t size;	/* allocated size of buf */
+	size_t len;
+	mt_off_t where;
+#ifdef USE_IO_URING
+	struct iovec iov;
+#endif
+} AsyncSlot_t;
+
+typedef struct AsyncIo_t {
+	struct Stream_t head;
+
+	int fd;
+	unsigned int depth;
+	AsyncSlot_t *slots;
+	unsigned int inFlight;	/* slots not SLOT_FREE */
+	int error;		/* errno of first failed deferred write */
+
+	int useUring;
+#ifdef USE_IO_URING
+	int ringFd;
+	unsigned int toSubmit;
+	void *sqPtr;
+	size_t sqSize;
+	void *cqPtr;
+	size_t cqSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+	unsigned int *sqTail;
+	unsigned int *sqMask;
+	unsigned int *sqArray;
+	unsigned int *cqHead;
+	unsigned int *cqTail;
+	unsigned int *cqMask;
+	struct io_uring_cqe *cqes;
+#endif
+
+#ifdef USE_ASYNC_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	pthread_t threads[ASYNC_MAX_THREADS];
+	unsigned int nrThreads;
+	int stop;
+#endif
+} AsyncIo_t;
+
+/* Synchronously write out remaining part of a slot, after a short write */
+static int write_rest(int fd, char *buf, mt_off_t where, size_t len)
+{
+	while(len) {
+		ssize_t ret = pwrite(fd, buf, len, (off_t) where);
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			return errno;
+		}
+		if(ret == 0)
+			return ENOSPC;
+		buf += ret;
+		where += (mt_off_t) ret;
+		len -= (size_t) ret;
+	}
+	return 0;
+}
+
+static void slot_done(AsyncIo_t *This, AsyncSlot_t *slot, int err)
+{
+	if(err && !This->error)
+		This->error = err;
+	slot->state = SLOT_FREE;
+	This->inFlight--;
+}
+
+#ifdef USE_IO_URING
+
+static int uring_setup(AsyncIo_t *This)
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = (int) syscall(__NR_io_uring_setup, This->depth, &p);
+	if(fd < 0)
+		return -1;
+	This->ringFd = fd;
+
+	This->sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	This->cqSize = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(This->cqSize > This->sqSize)
+			This->sqSize = This->cqSize;
+		This->cqSize = 0;
+	}
+#endif
+
+	This->sqPtr = mmap(0, This->sqSize, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(This->sqPtr == MAP_FAILED)
+		goto exit_0;
+
+	if(This->cqSize) {
+		This->cqPtr = mmap(0, This->cqSize, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, fd,
+				   IORING_OFF_CQ_RING);
+		if(This->cqPtr == MAP_FAILED)
+			goto exit_1;
+	} else
+		This->cqPtr = This->sqPtr;
+
+	This->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	This->sqes = mmap(0, This->sqesSize, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(This->sqes == MAP_FAILED)
+		goto exit_2;
+
+	This->sqTail = (unsigned int *)
+		((char *)This->sqPtr + p.sq_off.tail);
+	This->sqMask = (unsigned int *)
+		((char *)This->sqPtr + p.sq_off.ring_mask);
+	This->sqArray = (unsigned int *)
+		((char *)This->sqPtr + p.sq_off.array);
+	This->cqHead = (unsigned int *)
+		((char *)This->cqPtr + p.cq_off.head);
+	This->cqTail = (unsigned int *)
+		((char *)This->cqPtr + p.cq_off.tail);
+	This->cqMask = (unsigned int *)
+		((char *)This->cqPtr + p.cq_off.ring_mask);
+	This->cqes = (struct io_uring_cqe *)
+		((char *)This->cqPtr + p.cq_off.cqes);
+	This->toSubmit = 0;
+	return 0;
+
+ exit_2:
+	if(This->cqSize)
+		munmap(This->cqPtr, This->cqSize);
+ exit_1:
+	munmap(This->sqPtr, This->sqSize);
+ exit_0:
+	close(fd);
+	return -1;
+}
+
+static void uring_release(AsyncIo_t *This)
+{
+	munmap(This->sqes, This->sqesSize);
+	if(This->cqSize)
+		munmap(This->cqPtr, This->cqSize);
+	munmap(This->sqPtr, This->sqSize);
+	close(This->ringFd);
+}
+
+/* Put slot into the submission ring. Does not enter the kernel yet */
+static void uring_queue(AsyncIo_t *This, unsigned int i)
+{
+	AsyncSlot_t *slot = &This->slots[i];
+	unsigned int tail = *This->sqTail;
+	unsigned int idx = tail & *This->sqMask;
+	struct io_uring_sqe *sqe = &This->sqes[idx];
+
+	slot->iov.iov_base = slot->buf;
+	slot->iov.iov_len = slot->len;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = This->fd;
+	sqe->addr = (unsigned long) &slot->iov;
+	sqe->len = 1;
+	sqe->off = (uint64_t) slot->where;
+	sqe->user_data = i;
+	This->sqArray[idx] = idx;
+	__atomic_store_n(This->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	slot->state = SLOT_BUSY;
+	This->toSubmit++;
+}
+
+static void uring_reap(AsyncIo_t *This)
+{
+	unsigned int head = *This->cqHead;
+	unsigned int tail = __atomic_load_n(This->cqTail, __ATOMIC_ACQUIRE);
+
+	while(head != tail) {
+		struct io_uring_cqe *cqe = &This->cqes[head & *This->cqMask];
+		AsyncSlot_t *slot = &This->slots[cqe->user_data];
+		int err = 0;
+
+		if(cqe->res < 0)
+			err = -cqe->res;
+		else if((size_t) cqe->res < slot->len)
+			err = write_rest(This->fd, slot->buf + cqe->res,
+					 slot->where + cqe->res,
+					 slot->len - (size_t) cqe->res);
+		slot_done(This, slot, err);
+		head++;
+	}
+	__atomic_store_n(This->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/* Submit queued entries, and wait until at least min slots are free */
+static int uring_enter(AsyncIo_t *This, unsigned int minComplete)
+{
+	while(1) {
+		int ret;
+		unsigned int wait = 0;
+
+		uring_reap(This);
+		if(This->depth - This->inFlight >= minComplete) {
+			if(!This->toSubmit)
+				return 0;
+		} else
+			wait = 1;
+		ret = (int) syscall(__NR_io_uring_enter, This->ringFd,
+				    This->toSubmit, wait,
+				    wait ? IORING_ENTER_GETEVENTS : 0,
+				    NULL, 0);
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		This->toSubmit -= (unsigned int) ret;
+	}
+}
+
+#endif
+
+#ifdef USE_ASYNC_THREADS
+
+static void *worker(void *arg)
+{
+	AsyncIo_t *This = (AsyncIo_t *) arg;
+	unsigned int i;
+
+	pthread_mutex_lock(&This->lock);
+	while(1) {
+		AsyncSlot_t *slot = 0;
+		int err;
+
+		for(i=0; i < This->depth; i++)
+			if(This->slots[i].state == SLOT_QUEUED) {
+				slot = &This->slots[i];
+				break;
+			}
+		if(!slot) {
+			if(This->stop)
+				break;
+			pthread_cond_wait(&This->work, &This->lock);
+			continue;
+		}
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&This->lock);
+		err = write_rest(This->fd, slot->buf, slot->where, slot->len);
+		pthread_mutex_lock(&This->lock);
+		slot_done(This, slot, err);
+		pthread_cond_broadcast(&This->done);
+	}
+	pthread_mutex_unlock(&This->lock);
+	return 0;
+}
+
+static int threads_setup(AsyncIo_t *This)
+{
+	unsigned int n = This->depth;
+	if(n > ASYNC_MAX_THREADS)
+		n = ASYNC_MAX_THREADS;
+
+	if(pthread_mutex_init(&This->lock, 0))
+		return -1;
+	pthread_cond_init(&This->work, 0);
+	pthread_cond_init(&This->done, 0);
+	This->stop = 0;
+	for(This->nrThreads=0; This->nrThreads < n; This->nrThreads++)
+		if(pthread_create(&This->threads[This->nrThreads], 0,
+				  worker, This))
+			break;
+	if(This->nrThreads == 0) {
+		pthread_cond_destroy(&This->done);
+		pthread_cond_destroy(&This->work);
+		pthread_mutex_destroy(&This->lock);
+		return -1;
+	}
+	return 0;
+}
+
+static void threads_release(AsyncIo_t *This)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&This->lock);
+	This->stop = 1;
+	pthread_cond_broadcast(&This->work);
+	pthread_mutex_unlock(&This->lock);
+	for(i=0; i < This->nrThreads; i++)
+		pthread_join(This->threads[i], 0);
+	pthread_cond_destroy(&This->done);
+	pthread_cond_destroy(&This->work);
+	pthread_mutex_destroy(&This->lock);
+}
+
+#endif
+
+/* Wait until at least min slots are free. min == depth drains all */
+static int async_wait(AsyncIo_t *This, unsigned int min)
+{
+#ifdef USE_IO_URING
+	if(This->useUring)
+		return uring_enter(This, min);
+#endif
+#ifdef USE_ASYNC_THREADS
+	pthread_mutex_lock(&This->lock);
+	while(This->depth - This->inFlight < min)
+		pthread_cond_wait(&This->done, &This->lock);
+	pthread_mutex_unlock(&This->lock);
+#endif
+	return 0;
+}
+
+static int async_drain(AsyncIo_t *This)
+{
+	int ret = async_wait(This, This->depth);
+	if(ret < 0) {
+		perror("async io");
+		return -1;
+	}
+	return 0;
+}
+
+/* Does the range [where,where+len[ overlap any pending write? */
+static int overlaps(AsyncIo_t *This, mt_off_t where, size_t len)
+{
+	unsigned int i;
+	int ret = 0;
+
+#ifdef USE_ASYNC_THREADS
+	if(!This->useUring)
+		pthread_mutex_lock(&This->lock);
+#endif
+	/* inFlight is decremented by the completion thread: only look at
+	 * it under the lock */
+	for(i=0; This->inFlight && i < This->depth; i++) {
+		AsyncSlot_t *slot = &This->slots[i];
+		if(slot->state != SLOT_FREE &&
+		   where < slot->where + (mt_off_t) slot->len &&
+		   slot->where < where + (mt_off_t) len) {
+			ret = 1;
+			break;
+		}
+	}
+#ifdef USE_ASYNC_THREADS
+	if(!This->useUring)
+		pthread_mutex_unlock(&This->lock);
+#endif
+	return ret;
+}
+
+static ssize_t async_pread(Stream_t *Stream, char *buf,
+			   mt_off_t where, size_t len)
+{
+	DeclareThis(AsyncIo_t);
+
+	if(overlaps(This, where, len) && async_drain(This) < 0)
+		return -1;
+	return PREADS(This->head.Next, buf, where, len);
+}
+
+static ssize_t async_pwrite(Stream_t *Stream, char *buf,
+			    mt_off_t where, size_t len)
+{
+	DeclareThis(AsyncIo_t);
+	AsyncSlot_t *slot;
+	unsigned int i;
+
+	if(This->error) {
+		errno = This->error;
+		return -1;
+	}
+
+	/* a pending write to the same place may not be reordered with
+	 * this one */
+	if(overlaps(This, where, len) && async_drain(This) < 0)
+		return -1;
+
+	if(async_wait(This, 1) < 0)
+		return -1;
+
+#ifdef USE_ASYNC_THREADS
+	if(!This->useUring)
+		pthread_mutex_lock(&This->lock);
+#endif
+	for(i=0; i < This->depth; i++)
+		if(This->slots[i].state == SLOT_FREE)
+			break;
+	slot = &This->slots[i];
+	if(slot->size < len) {
+		char *newBuf = realloc(slot->buf, len);
+		if(!newBuf) {
+#ifdef USE_ASYNC_THREADS
+			if(!This->useUring)
+				pthread_mutex_unlock(&This->lock);
+#endif
+			printOom();
+			return -1;
+		}
+		slot->buf = newBuf;
+		slot->size = len;
+	}
+	memcpy(slot->buf, buf, len);
+	slot->len = len;
+	slot->where = where;
+	slot->state = SLOT_QUEUED;
+	This->inFlight++;
+
+#ifdef USE_IO_URING
+	if(This->useUring) {
+		uring_queue(This, i);
+		/* enter the kernel once a full batch is ready */
+		if(This->inFlight == This->depth &&
+		   uring_enter(This, 0) < 0)
+			return -1;
+	}
+#endif
+#ifdef USE_ASYNC_THREADS
+	if(!This->useUring) {
+		pthread_cond_signal(&This->work);
+		pthread_mutex_unlock(&This->lock);
+	}
+#endif
+	return (ssize_t) len;
+}
+
+static int async_flush(Stream_t *Stream)
+{
+	DeclareThis(AsyncIo_t);
+
+	if(async_drain(This) < 0)
+		return -1;
+	if(This->error) {
+		errno = This->error;
+		This->error = 0;
+		perror("async write");
+		return -1;
+	}
+	return 0;
+}
+
+static int async_free(Stream_t *Stream)
+{
+	DeclareThis(AsyncIo_t);
+	unsigned int i;
+	int ret;
+
+	ret = async_flush(Stream);
+#ifdef USE_IO_URING
+	if(This->useUring)
+		uring_release(This);
+#endif
+#ifdef USE_ASYNC_THREADS
+	if(!This->useUring)
+		threads_release(This);
+#endif
+	for(i=0; i < This->depth; i++)
+		if(This->slots[i].buf)
+			free(This->slots[i].buf);
+	free(This->slots);
+	return ret;
+}
+
+static int async_discard(Stream_t *Stream)
+{
+	DeclareThis(AsyncIo_t);
+
+	if(async_drain(This) < 0)
+		return -1;
+	if(This->head.Next->Class->discard)
+		return DISCARD(This->head.Next);
+	return 0;
+}
+
+static Class_t AsyncIoClass = {
+	0,
+	0,
+	async_pread,
+	async_pwrite,
+	async_flush,
+	async_free,
+	set_geom_pass_through,
+	get_data_pass_through,
+	0, /* pre_allocate */
+	get_dosConvert_pass_through,
+	async_discard
+};
+
+/*
+ * Push a write-behind layer with depth slots on top of Next. Returns NULL
+ * (and leaves Next alone) if Next is not a plain file or block device, or
+ * if no asynchronous backend could be set up; the caller should then
+ * just continue with synchronous I/O
+ */
+Stream_t *OpenAsyncIo(Stream_t *Next, unsigned int depth)
+{
+	AsyncIo_t *This;
+	struct MT_STAT statbuf;
+	int fd;
+
+	fd = get_fd(Next);
+	if(fd < 0 || MT_FSTAT(fd, &statbuf) < 0)
+		return NULL;
+	if(!S_ISREG(statbuf.st_mode) && !S_ISBLK(statbuf.st_mode))
+		return NULL;
+
+	This = New(AsyncIo_t);
+	if (!This){
+		printOom();
+		return NULL;
+	}
+	This->fd = fd;
+	This->depth = depth;
+	This->slots = NewArray(depth, AsyncSlot_t);
+	if(!This->slots) {
+		printOom();
+		goto exit_0;
+	}
+
+	This->useUring = 0;
+#ifdef USE_IO_URING
+	if(uring_setup(This) == 0)
+		This->useUring = 1;
+#endif
+	if(!This->useUring) {
+#ifdef USE_ASYNC_THREADS
+		if(threads_setup(This) < 0)
+#endif
+			goto exit_1;
+	}
+
+	init_head(&This->head, &AsyncIoClass, Next);
+	return &This->head;
+ exit_1:
+	free(This->slots);
+ exit_0:
+	Free(This);
+	return NULL;
+}
+
+/* Skip over a write-behind layer, for code looking for the file below */
+Stream_t *async_io_skip(Stream_t *Stream)
+{
+	if(Stream && Stream->Class == &AsyncIoClass)
+		return Stream->Next;
+	return Stream;
+}
+
+#else
+
+Stream_t *OpenAsyncIo(Stream_t *Next UNUSEDP, unsigned int depth UNUSEDP)
+{
+	return NULL;
+}
+
+Stream_t *async_io_skip(Stream_t *Stream)
+{
+	return Stream;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef MTOOLS_ASYNCIO_H
+#define MTOOLS_ASYNCIO_H
+
+/*  Copyright 2026 Alain Knaff.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stream.h"
+
+Stream_t *OpenAsyncIo(Stream_t *Next, unsigned int depth);
+Stream_t *async_io_skip(Stream_t *Stream);
+
+#endif
@@ -0,0 +1,138 @@
+/*  Copyright 2026 Alain Knaff.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Runs one command of the benchmark (scripts/benchmark), and prints one
+ * JSON record with its wall and CPU time, peak memory, throughput and
+ * number of device I/O calls.
+ *
+ * benchtime label fs bytes command [args...]
+ *
+ * The command's standard output is discarded. The I/O calls are counted
+ * by the command itself, through MTOOLS_TRACE_IO=device
+ */
+
+#include "sysincludes.h"
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+
+static double now(void)
+{
+#if defined HAVE_CLOCK_GETTIME && defined CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#else
+	return (double) time(NULL);
+#endif
+}
+
+/* Sum of all "calls" counters of the trace file */
+static unsigned long long countCalls(const char *traceFile)
+{
+	static const char key[] = "\"calls\":";
+	char line[4096];
+	unsigned long long calls = 0;
+	FILE *f;
+
+	f = fopen(traceFile, "r");
+	if(!f)
+		return 0;
+	while(fgets(line, sizeof(line), f)) {
+		char *p;
+		for(p = strstr(line, key); p; p = strstr(p, key)) {
+			p += sizeof(key) - 1;
+			calls += strtoull(p, &p, 10);
+		}
+	}
+	fclose(f);
+	return calls;
+}
+
+int main(int argc, char **argv)
+{
+	double start, wall;
+	unsigned long long bytes;
+	char traceFile[] = "/tmp/benchtime.XXXXXX";
+	int status;
+	int fd;
+	pid_t pid;
+
+	if(argc < 5) {
+		fprintf(stderr,
+			"Usage: %s label fs bytes command [args...]\n",
+			argv[0]);
+		return 1;
+	}
+	bytes = strtoull(argv[3], NULL, 0);
+
+	/* the command reopens the file by name: create it ourselves, so
+	 * that it cannot be a link planted by someone else */
+	fd = mkstemp(traceFile);
+	if(fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	setenv("MTOOLS_TRACE_IO", "device", 1);
+	setenv("MTOOLS_TRACE_FILE", traceFile, 1);
+
+	start = now();
+	pid = fork();
+	if(pid < 0) {
+		perror("fork");
+		unlink(traceFile);
+		return 1;
+	}
+	if(pid == 0) {
+		/* listings are not part of the record */
+		fd = open("/dev/null", O_WRONLY);
+		if(fd >= 0)
+			dup2(fd, 1);
+		execvp(argv[4], argv+4);
+		perror(argv[4]);
+		_exit(127);
+	}
+	if(waitpid(pid, &status, 0) < 0) {
+		perror("waitpid");
+		unlink(traceFile);
+		return 1;
+	}
+	wall = now() - start;
+
+	printf("{\"op\":\"%s\",\"fs\":\"%s\",\"wall_s\":%.6f",
+	       argv[1], argv[2], wall);
+#ifdef HAVE_SYS_RESOURCE_H
+	{
+		struct rusage ru;
+		getrusage(RUSAGE_CHILDREN, &ru);
+		printf(",\"user_s\":%.6f,\"sys_s\":%.6f,\"maxrss_kb\":%ld",
+		       (double) ru.ru_utime.tv_sec +
+		       (double) ru.ru_utime.tv_usec / 1e6,
+		       (double) ru.ru_stime.tv_sec +
+		       (double) ru.ru_stime.tv_usec / 1e6,
+		       (long) ru.ru_maxrss);
+	}
+#endif
+	printf(",\"bytes\":%llu,\"mb_per_s\":%.3f,\"io_calls\":%llu"
+	       ",\"exit\":%d}\n",
+	       bytes, wall > 0 ? (double) bytes / wall / 1048576 : 0.0,
+	       countCalls(traceFile),
+	       WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+	unlink(traceFile);
+	return 0;
+}
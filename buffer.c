@@ -399,3 +399,22 @@ Stream_t *buf_init(Stream_t *Next, size_t size,
 	return &Buffer->head;
 }
 
+/*
+ * The stream below a buffer, for callers doing large transfers of their
+ * own. The buffer is written back and emptied first. Data written below
+ * it is not seen by the buffer, so callers should only go through the
+ * buffer again for areas they did not touch. Other streams are returned
+ * as is
+ */
+Stream_t *buf_bypass(Stream_t *Stream)
+{
+	Buffer_t *Buffer = (Buffer_t *) Stream;
+
+	if(!Stream || Stream->Class != &BufferClass)
+		return Stream;
+	if(_buf_flush(Buffer) < 0)
+		return NULL;
+	Buffer->cur_size = 0;
+	return Stream->Next;
+}
+
@@ -24,5 +24,6 @@ Stream_t *buf_init(Stream_t *Next,
 		   size_t size,
 		   size_t cylinderSize,
 		   size_t sectorSize);
+Stream_t *buf_bypass(Stream_t *Stream);
 
 #endif
@@ -64,6 +64,13 @@ unsigned int mtools_numeric_tail=1;
 unsigned int mtools_dotted_dir=0;
 unsigned int mtools_twenty_four_hour_clock=1;
 unsigned int mtools_lock_timeout=30;
+unsigned int mtools_io_queue_depth=0;
+const char *mtools_server=NULL;
+unsigned int mtools_fat_snapshot=0;
+unsigned int mtools_fat_resident=0;
+unsigned int mtools_deterministic=0;
+const char *mtools_trace_io=NULL;
+const char *mtools_trace_file=NULL;
 unsigned int mtools_default_codepage=850;
 const char *mtools_date_string="yyyy-mm-dd";
 
@@ -94,6 +101,13 @@ static switches_t global_switches[] = {
     { "MTOOLS_DATE_STRING",
       (caddr_t) &mtools_date_string, T_STRING },
     { "MTOOLS_LOCK_TIMEOUT", (caddr_t) &mtools_lock_timeout, T_UINT },
+    { "MTOOLS_IO_QUEUE_DEPTH", (caddr_t) &mtools_io_queue_depth, T_UINT },
+    { "MTOOLS_SERVER", (caddr_t) &mtools_server, T_STRING },
+    { "MTOOLS_FAT_SNAPSHOT", (caddr_t) &mtools_fat_snapshot, T_UINT },
+    { "MTOOLS_FAT_RESIDENT", (caddr_t) &mtools_fat_resident, T_UINT },
+    { "MTOOLS_DETERMINISTIC", (caddr_t) &mtools_deterministic, T_UINT },
+    { "MTOOLS_TRACE_IO", (caddr_t) &mtools_trace_io, T_STRING },
+    { "MTOOLS_TRACE_FILE", (caddr_t) &mtools_trace_file, T_STRING },
     { "DEFAULT_CODEPAGE", (caddr_t) &mtools_default_codepage, T_UINT }
 };
 
@@ -615,8 +629,19 @@ static int set_def_format(struct device *dev)
 static void parse_all(int privilege);
 
 void set_cmd_line_image(char *img) {
+  static char *cmd_line_image;
   char *ofsp;
 
+  if(cmd_line_image) {
+    /* Set a second time: this happens in commands run by mserver, which
+     * may already have the image open */
+    if(!strcmp(cmd_line_image, img))
+      return;
+    uncache_drive(':');
+    free(cmd_line_image);
+  }
+  cmd_line_image = strdup(img);
+
   prepend();
   devices[cur_dev].drive = ':';
   default_drive = ':';
@@ -1,4 +1,4 @@
-/*  Copyright 1998,2001-2003,2007-2009 Alain Knaff.
+/*  Copyright 1998,2001-2003,2007-2009,2026 Alain Knaff.
  *  This file is part of mtools.
  *
  *  Mtools is free software: you can redistribute it and/or modify
@@ -18,10 +18,9 @@
 #include "mtoolsDirentry.h"
 #include "dirCache.h"
 #include "dirCacheP.h"
+#include "htable.h"
 #include <assert.h>
 
-#define BITS_PER_INT (sizeof(unsigned int) * 8)
-
 
 static inline uint32_t rol(uint32_t arg, int shift)
 {
@@ -30,7 +29,7 @@ static inline uint32_t rol(uint32_t arg, int shift)
 }
 
 
-static uint32_t calcHash(wchar_t *name)
+static uint32_t calcHash(const wchar_t *name)
 {
 	uint32_t hash;
 	unsigned int i;
@@ -59,53 +58,108 @@ static uint32_t calcHash(wchar_t *name)
 	return hash;
 }
 
-static unsigned int addBit(unsigned int *bitmap,
-			   unsigned int hash, int checkOnly)
+static uint32_t keyHash(void *p)
 {
-	unsigned int bit;
-	int entry;
+	return ((dcName_t *) p)->hash;
+}
 
-	bit = 1u << (hash % BITS_PER_INT);
-	entry = (hash / BITS_PER_INT) % DC_BITMAP_SIZE;
+/* names are compared case-insensitively, like patterns match them */
+static int keyComp(void *p1, void *p2)
+{
+	const wchar_t *a = ((dcName_t *) p1)->name;
+	const wchar_t *b = ((dcName_t *) p2)->name;
 
-	if(checkOnly)
-		return bitmap[entry] & bit;
-	else {
-		bitmap[entry] |= bit;
-		return 1;
+	while(*a && towupper((wint_t)*a) == towupper((wint_t)*b)) {
+		a++;
+		b++;
 	}
+	return towupper((wint_t)*a) != towupper((wint_t)*b);
 }
 
-static int _addHash(dirCache_t *cache, unsigned int hash, int checkOnly)
+static dcName_t *lookupKey(dirCache_t *cache, const wchar_t *name)
 {
-	return
-		addBit(cache->bm0, hash, checkOnly) &&
-		addBit(cache->bm1, rol(hash,12), checkOnly) &&
-		addBit(cache->bm2, rol(hash,24), checkOnly);
+	dcName_t probe;
+	void *found;
+
+	probe.name = (wchar_t *) name;
+	probe.hash = calcHash(name);
+	if(hash_lookup(cache->names, &probe, &found, 0))
+		return 0;
+	return (dcName_t *) found;
 }
 
+static void addKey(dirCache_t *cache, dirCacheEntry_t *dce,
+		   dcName_t *key, wchar_t *name)
+{
+	dcName_t *other;
 
-static void addNameToHash(dirCache_t *cache, wchar_t *name)
+	key->name = name;
+	key->dce = dce;
+	key->indexed = 0;
+	if(!name || !*name)
+		return;
+	key->hash = calcHash(name);
+	other = lookupKey(cache, name);
+	if(other) {
+		if(other->dce == dce)
+			return; /* long name same as short name */
+		cache->nrDups++;
+	}
+	if(hash_add(cache->names, key, &key->hint)) {
+		fprintf(stderr, "Out of memory error in directory cache\n");
+		exit(1);
+	}
+	key->indexed = 1;
+}
+
+static void removeKey(dirCache_t *cache, dcName_t *key)
 {
-	_addHash(cache, calcHash(name), 0);
+	if(key->indexed)
+		hash_remove(cache->names, key, key->hint);
+	key->indexed = 0;
 }
 
 static void hashDce(dirCache_t *cache, dirCacheEntry_t *dce)
 {
-	if(dce->beginSlot != cache->nrHashed)
-		return;
-	cache->nrHashed = dce->endSlot;
-	if(dce->longName)
-		addNameToHash(cache, dce->longName);
-	addNameToHash(cache, dce->shortName);
+	addKey(cache, dce, &dce->keys[0], dce->shortName);
+	addKey(cache, dce, &dce->keys[1], dce->longName);
+	if(dce->beginSlot == cache->nrHashed)
+		cache->nrHashed = dce->endSlot;
+}
+
+/* Whether a cached entry has this name, as short or long name */
+int isHashed(dirCache_t *cache, const wchar_t *name)
+{
+	return lookupKey(cache, name) != 0;
 }
 
-int isHashed(dirCache_t *cache, wchar_t *name)
+/*
+ * The cached entry with this name, if there is exactly one. Returns
+ * NULL if there is none, or if names in this directory have been
+ * shared by several entries, in which case the first of these can only
+ * be found by scanning
+ */
+dirCacheEntry_t *findInDirCache(dirCache_t *cache, const wchar_t *name)
 {
-	int ret;
+	dcName_t *key;
 
-	ret =  _addHash(cache, calcHash(name), 1);
-	return ret;
+	if(cache->nrDups)
+		return 0;
+	key = lookupKey(cache, name);
+	return key ? key->dce : 0;
+}
+
+/* Same as findInDirCache, but only if name is the entry's short name */
+dirCacheEntry_t *findShortInDirCache(dirCache_t *cache, const wchar_t *name)
+{
+	dcName_t *key;
+
+	if(cache->nrDups)
+		return 0;
+	key = lookupKey(cache, name);
+	if(!key || key != &key->dce->keys[0])
+		return 0;
+	return key->dce;
 }
 
 int growDirCache(dirCache_t *cache, unsigned int slot)
@@ -151,10 +205,16 @@ dirCache_t *allocDirCache(Stream_t *Stream, unsigned int slot)
 			return 0;
 		}
 		(*dcp)->nr_entries = (slot+1) * 2;
-		memset( (*dcp)->bm0, 0, sizeof((*dcp)->bm0));
-		memset( (*dcp)->bm1, 0, sizeof((*dcp)->bm1));
-		memset( (*dcp)->bm2, 0, sizeof((*dcp)->bm1));
+		if(make_ht(keyHash, keyComp, 2 * slot, &(*dcp)->names)) {
+			free((*dcp)->entries);
+			free(*dcp);
+			*dcp = 0;
+			return 0;
+		}
 		(*dcp)->nrHashed = 0;
+		(*dcp)->nrCached = 0;
+		(*dcp)->nrDups = 0;
+		(*dcp)->complete = 0;
 	} else
 		if(growDirCache(*dcp, slot) < 0)
 			return 0;
@@ -212,6 +272,11 @@ static int freeDirCacheRange(dirCache_t *cache,
 			   entry->endMarkPos < (int) beginSlot)
 				needWriteEnd = 1;
 
+			if(entry->type == DCET_USED) {
+				removeKey(cache, &entry->keys[0]);
+				removeKey(cache, &entry->keys[1]);
+			} else if(entry->type == DCET_END)
+				cache->complete = 0;
 			if(entry->longName)
 				free(entry->longName);
 			if(entry->shortName)
@@ -244,6 +309,7 @@ static dirCacheEntry_t *allocDirCacheEntry(dirCache_t *cache,
 	entry->type = type;
 	entry->longName = 0;
 	entry->shortName = 0;
+	entry->keys[0].indexed = entry->keys[1].indexed = 0;
 	entry->beginSlot = beginSlot;
 	entry->endSlot = endSlot;
 	entry->endMarkPos = -1;
@@ -252,6 +318,8 @@ static dirCacheEntry_t *allocDirCacheEntry(dirCache_t *cache,
 	for(i=beginSlot; i<endSlot; i++) {
 		cache->entries[i] = entry;
 	}
+	if(endSlot > cache->nrCached)
+		cache->nrCached = endSlot;
 	return entry;
 }
 
@@ -346,7 +414,12 @@ dirCacheEntry_t *addFreeEntry(dirCache_t *cache,
 
 dirCacheEntry_t *addEndEntry(dirCache_t *cache, unsigned int pos)
 {
-	return allocDirCacheEntry(cache, pos, pos+1u, DCET_END);
+	dirCacheEntry_t *entry;
+
+	entry = allocDirCacheEntry(cache, pos, pos+1u, DCET_END);
+	if(entry)
+		cache->complete = 1;
+	return entry;
 }
 
 dirCacheEntry_t *lookupInDircache(dirCache_t *cache, unsigned int pos)
@@ -367,6 +440,8 @@ void freeDirCache(Stream_t *Stream)
 		n=freeDirCacheRange(cache, 0, cache->nr_entries);
 		if(n >= 0)
 			low_level_dir_write_end(Stream, n);
+		free_ht(cache->names, 0);
+		free(cache->entries);
 		free(cache);
 		*dcp = 0;
 	}
@@ -1,7 +1,7 @@
 #ifndef MTOOLS_DIRCACHE_H
 #define MTOOLS_DIRCACHE_H
 
-/*  Copyright 1997,1999,2001-2003,2008,2009 Alain Knaff.
+/*  Copyright 1997,1999,2001-2003,2008,2009,2026 Alain Knaff.
  *  This file is part of mtools.
  *
  *  Mtools is free software: you can redistribute it and/or modify
@@ -25,17 +25,16 @@ typedef enum {
 	DCET_END
 } dirCacheEntryType_t;
 
-#define DC_BITMAP_SIZE 128
-
 typedef struct dirCacheEntry_t dirCacheEntry_t;
 
 typedef struct dirCache_t {
 	struct dirCacheEntry_t **entries;
 	unsigned int nr_entries;
-	unsigned int nrHashed;
-	unsigned int bm0[DC_BITMAP_SIZE];
-	unsigned int bm1[DC_BITMAP_SIZE];
-	unsigned int bm2[DC_BITMAP_SIZE];
+	unsigned int nrHashed; /* used entries from the start, without gaps */
+	unsigned int nrCached; /* slots cached from the start */
+	struct hashtable *names; /* all cached used entries, by name */
+	unsigned int nrDups; /* names which were shared by several entries */
+	int complete; /* all entries up to the end are cached */
 } dirCache_t;
 
 int growDirCache(dirCache_t *cache, unsigned int slot);
@@ -1,6 +1,15 @@
 #ifndef DIRCACHEP_H
 #define DIRCACHEP_H
 
+/* a name of a cached entry, as stored in the cache's name index */
+typedef struct dcName_t {
+	wchar_t *name;
+	uint32_t hash;
+	dirCacheEntry_t *dce;
+	size_t hint;
+	int indexed;
+} dcName_t;
+
 struct dirCacheEntry_t {
 	dirCacheEntryType_t type;
 	unsigned int beginSlot;
@@ -9,9 +18,12 @@ struct dirCacheEntry_t {
 	wchar_t *longName;
 	struct directory dir;
 	int endMarkPos;
+	dcName_t keys[2]; /* short name and long name */
 } ;
 
-int isHashed(dirCache_t *cache, wchar_t *name);
+int isHashed(dirCache_t *cache, const wchar_t *name);
+dirCacheEntry_t *findInDirCache(dirCache_t *cache, const wchar_t *name);
+dirCacheEntry_t *findShortInDirCache(dirCache_t *cache, const wchar_t *name);
 dirCacheEntry_t *addUsedEntry(dirCache_t *Stream,
 			      unsigned int begin,
 			      unsigned int end,
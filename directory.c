@@ -1,5 +1,5 @@
 /*  Copyright 1995 David C. Niemi
- *  Copyright 1996-2002,2008,2009 Alain Knaff.
+ *  Copyright 1996-2002,2008,2009,2026 Alain Knaff.
  *  This file is part of mtools.
  *
  *  Mtools is free software: you can redistribute it and/or modify
@@ -89,14 +89,10 @@ void low_level_dir_write_end(Stream_t *Dir, int entry)
 }
 
 /*
- * Make a directory entry.  Builds a directory entry based on the
- * name, attribute, starting cluster number, and size.  Returns a pointer
- * to a static directory structure.
+ * Sets the creation, access and modification stamps of a directory
+ * entry to the given time
  */
-
-struct directory *mk_entry(const dos_name_t *dn, unsigned char attr,
-			   unsigned int fat, uint32_t size, time_t date,
-			   struct directory *ndir)
+void set_entry_time(struct directory *ndir, time_t date)
 {
 	struct tm *now;
 	time_t date2 = date;
@@ -104,8 +100,6 @@ struct directory *mk_entry(const dos_name_t *dn, unsigned char attr,
 	uint8_t year, month_hi, month_low, day;
 
 	now = localtime(&date2);
-	dosnameToDirentry(dn, ndir);
-	ndir->attr = attr;
 	ndir->ctime_ms = 0;
 	hour = (uint8_t) (now->tm_hour << 3);
 	min_hi = (uint8_t) (now->tm_min >> 3);
@@ -119,7 +113,45 @@ struct directory *mk_entry(const dos_name_t *dn, unsigned char attr,
 	day = (uint8_t) (now->tm_mday);
 	ndir -> adate[1] = ndir->cdate[1] = ndir->date[1] = year + month_hi;
 	ndir -> adate[0] = ndir->cdate[0] = ndir->date[0] = month_low + day;
+}
 
+/*
+ * In deterministic mode, no time stamp is later than the build time
+ * (SOURCE_DATE_EPOCH), nor earlier than what a directory entry can hold
+ */
+static time_t clamp_time(time_t date)
+{
+	struct tm dosEpoch;
+	time_t limit;
+
+	getTimeNow(&limit);
+	if(date > limit)
+		date = limit;
+	memset(&dosEpoch, 0, sizeof(dosEpoch));
+	dosEpoch.tm_year = 80;
+	dosEpoch.tm_mday = 1;
+	dosEpoch.tm_isdst = -1;
+	limit = mktime(&dosEpoch);
+	if(limit != (time_t) -1 && date < limit)
+		date = limit;
+	return date;
+}
+
+/*
+ * Make a directory entry.  Builds a directory entry based on the
+ * name, attribute, starting cluster number, and size.  Returns a pointer
+ * to a static directory structure.
+ */
+
+struct directory *mk_entry(const dos_name_t *dn, unsigned char attr,
+			   unsigned int fat, uint32_t size, time_t date,
+			   struct directory *ndir)
+{
+	dosnameToDirentry(dn, ndir);
+	ndir->attr = attr;
+	if(mtools_deterministic)
+		date = clamp_time(date);
+	set_entry_time(ndir, date);
 	set_word(ndir->start, fat & 0xffff);
 	set_word(ndir->startHi, fat >> 16);
 	set_dword(ndir->size, size);
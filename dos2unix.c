@@ -1,4 +1,4 @@
-/*  Copyright 1996,1997,1999,2001-2003,2008,2009,2021 Alain Knaff.
+/*  Copyright 1996,1997,1999,2001-2003,2008,2009,2021,2026 Alain Knaff.
  *  This file is part of mtools.
  *
  *  Mtools is free software: you can redistribute it and/or modify
@@ -30,27 +30,31 @@ typedef struct Filter_t {
 static ssize_t read_filter(Stream_t *Stream, char *buf, size_t len)
 {
 	DeclareThis(Filter_t);
-	size_t i,j;
+	size_t i,j,n,span;
 	ssize_t ret;
-	char newchar;
+	char *p;
 
 	ret = READS(This->head.Next, buf, len);
 	if ( ret < 0 )
 		return ret;
 
-	j = 0;
-	for (i=0; i< (size_t) ret; i++){
-		if ( buf[i] == '\r' )
-			continue;
-		if (buf[i] == 0x1a)
-			break;
-		newchar = buf[i];
-		/*
-		if (This->convertCharset) newchar = contents_to_unix(newchar);
-		*/
-		buf[j++] = newchar;
-	}
+	/* everything starting at the 0x1a is dropped */
+	n = (size_t) ret;
+	p = memchr(buf, 0x1a, n);
+	if(p)
+		n = ptrdiff(p, buf);
 
+	/* squeeze out the CRs, moving the text between them in bulk */
+	p = memchr(buf, '\r', n);
+	if(!p)
+		return (ssize_t) n;
+	j = ptrdiff(p, buf);
+	for (i=j+1; i < n; i += span + 1){
+		p = memchr(buf+i, '\r', n-i);
+		span = p ? ptrdiff(p, buf+i) : n-i;
+		memmove(buf+j, buf+i, span);
+		j += span;
+	}
 	return (ssize_t) j;
 }
 
@@ -22,6 +22,8 @@
 #include "mtools.h"
 #include "fsP.h"
 #include "file_name.h"
+#include "buffer.h"
+#include "trace_io.h"
 
 #if defined HAVE_LONG_LONG && defined __STDC_VERSION__
 typedef long long fatBitMask;
@@ -83,6 +85,57 @@ static FatMap_t *GetFatMap(Fs_t *Stream)
 	return map;
 }
 
+/* Number of sectors read at once when loading a resident FAT */
+#define RESIDENT_CHUNK 2048
+
+/*
+ * Read the whole FAT into one contiguous array, with a few large
+ * sequential reads, and make the FatMap slots point into it. All
+ * sectors are then valid, and getAddress is plain pointer arithmetic.
+ * Returns -1 if some part could not be read from any of the FAT
+ * copies, in which case sectors are loaded one by one as usual
+ */
+static int loadWholeFat(Fs_t *This)
+{
+	unsigned char *data;
+	size_t nr_entries, i;
+	unsigned int done, n, dupe;
+
+	data = malloc((size_t) This->fat_len << This->sectorShift);
+	if(!data)
+		return -1;
+
+	for(done = 0; done < This->fat_len; done += n) {
+		n = This->fat_len - done;
+		if(n > RESIDENT_CHUNK)
+			n = RESIDENT_CHUNK;
+		for(dupe = 0; dupe < This->num_fat; dupe++) {
+			unsigned int fat = (dupe + This->primaryFat) %
+				This->num_fat;
+			if(forceReadSector(This,
+					   (char *) data +
+					   ((size_t) done << This->sectorShift),
+					   This->fat_start +
+					   This->fat_len * fat + done, n) ==
+			   (ssize_t) ((size_t) n << This->sectorShift))
+				break;
+		}
+		if(dupe == This->num_fat) {
+			free(data);
+			return -1;
+		}
+	}
+
+	nr_entries = (This->fat_len + SECT_PER_ENTRY - 1) / SECT_PER_ENTRY;
+	for(i=0; i < nr_entries; i++) {
+		This->FatMap[i].data = data +
+			((i * SECT_PER_ENTRY) << This->sectorShift);
+		This->FatMap[i].valid = ~(fatBitMask) 0;
+	}
+	This->fatData = data;
+	return 0;
+}
+
 static inline int locate(Fs_t *Stream, uint32_t offset,
 			     uint32_t *slot, uint32_t *bit)
 {
@@ -136,24 +189,27 @@ static inline ssize_t fatReadSector(Fs_t *This,
 }
 
 
-static ssize_t fatWriteSector(Fs_t *This,
-			      unsigned int sector,
-			      unsigned int slot,
-			      unsigned int bit,
-			      unsigned int dupe)
+/* Write nsect consecutive sectors of one FatMap slot in a single
+ * request. Returns the number of bytes written */
+static ssize_t fatWriteSectors(Fs_t *This,
+			       unsigned int sector,
+			       unsigned int slot,
+			       unsigned int bit,
+			       unsigned int nsect,
+			       unsigned int dupe)
 {
 	unsigned int fat_start;
 
 	dupe = (dupe + This->primaryFat) % This->num_fat;
 	if(dupe && !This->writeAllFats)
-		return This->sector_size;
+		return (ssize_t) (nsect << This->sectorShift);
 
 	fat_start = This->fat_start + This->fat_len * dupe;
 
 	return forceWriteSector(This,
 				(char *)
 				(This->FatMap[slot].data + bit * This->sector_size),
-				fat_start+sector, 1);
+				fat_start+sector, nsect);
 }
 
 static unsigned char *loadSector(Fs_t *This,
@@ -239,7 +295,21 @@ static unsigned char *getAddress(Fs_t *Stream,
 	unsigned int sector;
 	unsigned int offset;
 
+	if(mode == FAT_ACCESS_WRITE && Stream->chainLen)
+		fatDropChainLengths(Stream);
+
 	sector = num >> Stream->sectorShift;
+	if(Stream->fatData) {
+		if(sector >= Stream->fat_len)
+			return 0;
+		if(mode == FAT_ACCESS_WRITE) {
+			Stream->FatMap[sector / SECT_PER_ENTRY].dirty |=
+				ONE << (sector % SECT_PER_ENTRY);
+			Stream->fat_dirty = 1;
+		}
+		return Stream->fatData + num;
+	}
+
 	ret = 0;
 	if(sector == Stream->lastFatSectorNr &&
 	   Stream->lastFatAccessMode >= mode)
@@ -442,7 +512,7 @@ static void fast_fat32_encode(Fs_t *Stream, unsigned int num, unsigned int code)
 
 void fat_write(Fs_t *This)
 {
-	unsigned int i, j, dups, bit, slot;
+	unsigned int i, j, dups, bit, slot, n;
 	ssize_t ret;
 
 	/*fprintf(stderr, "Fat write\n");*/
@@ -464,11 +534,19 @@ void fat_write(Fs_t *This)
 			}
 			for(bit=0;
 			    bit < SECT_PER_ENTRY && j<This->fat_len;
-			    bit++,j++) {
+			    bit += n, j += n) {
+				n = 1;
 				if(!(This->FatMap[slot].dirty & (ONE << bit)))
 					continue;
-				ret = fatWriteSector(This,j,slot, bit, i);
-				if (ret < (int) This->sector_size){
+				/* coalesce a run of dirty sectors into one
+				 * write */
+				while(bit + n < SECT_PER_ENTRY &&
+				      j + n < This->fat_len &&
+				      (This->FatMap[slot].dirty &
+				       (ONE << (bit + n))))
+					n++;
+				ret = fatWriteSectors(This,j,slot, bit, n, i);
+				if (ret < (ssize_t) (n << This->sectorShift)){
 					if (ret < 0 ){
 						perror("error in fat_write");
 						exit(1);
@@ -479,8 +557,12 @@ void fat_write(Fs_t *This)
 					}
 				}
 				/* if last dupe, zero it out */
-				if(i==dups-1)
-					This->FatMap[slot].dirty &= ~(ONE<<bit);
+				if(i==dups-1) {
+					unsigned int k;
+					for(k=0; k<n; k++)
+						This->FatMap[slot].dirty &=
+							~(ONE<<(bit+k));
+				}
 			}
 		}
 	}
@@ -512,6 +594,22 @@ void fat_write(Fs_t *This)
 
 
 
+/*
+ * Mark the whole FAT dirty, so that fat_write rewrites all of its
+ * copies from the primary one. Returns -1 if some sector could not be
+ * read from any copy
+ */
+int fatMarkAllDirty(Fs_t *This)
+{
+	unsigned int i;
+
+	for(i=0; i < This->fat_len; i++)
+		if(!loadSector(This, i, FAT_ACCESS_WRITE, 1))
+			return -1;
+	return 0;
+}
+
+
 /*
  * Zero-Fat
  * Used by mformat.
@@ -682,6 +780,13 @@ static int check_media_type(Fs_t *This, union bootsector *boot)
 		return -1;
 	}
 
+	if(mtools_fat_resident &&
+	   ((mt_off_t) This->fat_len << This->sectorShift) <=
+	   (mt_off_t) mtools_fat_resident * 1024)
+		/* on failure, we just fall back to loading sectors on
+		 * demand */
+		loadWholeFat(This);
+
 	address = getAddress(This, 0, FAT_ACCESS_READ);
 	if(!address) {
 		fprintf(stderr,
@@ -737,7 +842,11 @@ static int fat_32_read(Fs_t *This, union bootsector *boot)
 		   DWORD(infoSector->signature1) == INFOSECT_SIGNATURE1 &&
 		   DWORD(infoSector->signature2) == INFOSECT_SIGNATURE2) {
 			This->freeSpace = DWORD(infoSector->count);
-			This->last = DWORD(infoSector->pos);
+			/* in deterministic mode, where files go only
+			 * depends on which clusters are free, not on
+			 * where the previous run stopped */
+			if(!mtools_deterministic)
+				This->last = DWORD(infoSector->pos);
 		}
 		free(infoSector);
 	}
@@ -788,11 +897,9 @@ int fat_read(Fs_t *This, union bootsector *boot, int nodups)
 }
 
 
-unsigned int fatDecode(Fs_t *This, unsigned int pos)
+static inline unsigned int checkEntry(Fs_t *This, unsigned int pos,
+				      unsigned int ret)
 {
-	unsigned int ret;
-
-	ret = This->fat_decode(This, pos);
 	if(ret && (ret < 2 || ret > This->num_clus+1) && ret < This->last_fat) {
 		fprintf(stderr, "Bad FAT entry %d at %d\n", ret, pos);
 		This->fat_error++;
@@ -800,6 +907,371 @@ unsigned int fatDecode(Fs_t *This, unsigned int pos)
 	return ret;
 }
 
+unsigned int fatDecode(Fs_t *This, unsigned int pos)
+{
+	return checkEntry(This, pos, This->fat_decode(This, pos));
+}
+
+/*
+ * Chain walking loops, instantiated once per FAT width so that the
+ * decoding is inlined rather than called through fat_decode at each
+ * step. The width is dispatched once per chain
+ */
+#define CHAIN_OPS(bits)							\
+static unsigned int countChain##bits(Fs_t *This, unsigned int block)	\
+{									\
+	unsigned int blocks = 0;					\
+	unsigned int rel = 0, oldabs = 0, oldrel = 0;			\
+									\
+	while (block <= This->last_fat && block != 1 && block) {	\
+		blocks++;						\
+		block = checkEntry(This, block,				\
+				   fat##bits##_decode(This, block));	\
+		rel++;							\
+		if(_loopDetect(&oldrel, rel, &oldabs, block) < 0)	\
+			block = 1;					\
+	}								\
+	return blocks;							\
+}									\
+									\
+static void freeChain##bits(Fs_t *This, unsigned int fat)		\
+{									\
+	unsigned int next;						\
+									\
+	while (!This->fat_error) {					\
+		/* get next cluster number */				\
+		next = checkEntry(This, fat,				\
+				  fat##bits##_decode(This, fat));	\
+		/* mark current cluster as empty */			\
+		fatDeallocate(This, fat);				\
+		if (next >= This->last_fat)				\
+			break;						\
+		fat = next;						\
+	}								\
+}
+
+CHAIN_OPS(12)
+CHAIN_OPS(16)
+CHAIN_OPS(32)
+
+/*
+ * Chain length table: for each cluster, the length of the chain from there
+ * on, tagged as resolved. Clusters whose chain runs into a loop or a bad
+ * entry are tagged as unknown, and still walked by countChain, which then
+ * prints the same diagnostics as without the table
+ */
+#define CHAIN_RESOLVED 0x80000000u
+#define CHAIN_VISITING 0x40000000u /* on the path being followed */
+#define CHAIN_UNKNOWN (CHAIN_RESOLVED | CHAIN_VISITING)
+#define CHAIN_LEN_MASK 0x0fffffffu
+
+/* Number of clusters in the chain starting at block */
+unsigned int fatCountChain(Fs_t *This, unsigned int block)
+{
+	if(This->chainLen && block >= 2 && block <= This->num_clus + 1 &&
+	   (This->chainLen[block] & CHAIN_UNKNOWN) == CHAIN_RESOLVED)
+		return This->chainLen[block] & CHAIN_LEN_MASK;
+
+	switch(This->fat_bits) {
+	case 12:
+		return countChain12(This, block);
+	case 16:
+		return countChain16(This, block);
+	default:
+		return countChain32(This, block);
+	}
+}
+
+/* Free the chain starting at fat */
+void fatFreeChain(Fs_t *This, unsigned int fat)
+{
+	switch(This->fat_bits) {
+	case 12:
+		freeChain12(This, fat);
+		break;
+	case 16:
+		freeChain16(This, fat);
+		break;
+	default:
+		freeChain32(This, fat);
+		break;
+	}
+}
+
+/*
+ * Set the bits (in map, one per cluster) of the clusters of the chain
+ * starting at fat. Stops at clusters which are already set, so that
+ * cross-linked or looping chains are only marked once. Returns the
+ * number of clusters newly marked
+ */
+unsigned int fatMarkChain(Fs_t *This, unsigned int fat, unsigned char *map)
+{
+	unsigned int n = 0;
+
+	while(!This->fat_error && fat >= 2 && fat <= This->num_clus + 1 &&
+	      !(map[fat >> 3] & (1 << (fat & 7)))) {
+		map[fat >> 3] |= (unsigned char) (1 << (fat & 7));
+		n++;
+		fat = fatDecode(This, fat);
+	}
+	return n;
+}
+
+/*
+ * Free all clusters marked in map, in one ascending sweep: each FAT
+ * sector is touched once, however the chains were interleaved
+ */
+void fatFreeMarked(Fs_t *This, const unsigned char *map)
+{
+	unsigned int i, end = This->num_clus + 2;
+
+	for(i=2; i < end; i++) {
+		if(!map[i >> 3]) {
+			i |= 7;
+			continue;
+		}
+		if(map[i >> 3] & (1 << (i & 7)))
+			fatDeallocate(This, i);
+	}
+}
+
+#define DECODE_CHUNK 1024
+
+/*
+ * Decode entries which all are in the same FAT sector, without going
+ * through fat_decode for each of them. Plain loops over the sector
+ * buffer, which the compiler is able to vectorize
+ */
+static void decodeSpan(Fs_t *This, const unsigned char *address,
+		       unsigned int n, uint32_t *out)
+{
+	unsigned int i;
+
+	if(This->fat_bits == 16) {
+		for(i=0; i < n; i++)
+			out[i] = (uint32_t) address[2*i] |
+				((uint32_t) address[2*i+1] << 8);
+	} else {
+		for(i=0; i < n; i++)
+			out[i] = ((uint32_t) address[4*i] |
+				  ((uint32_t) address[4*i+1] << 8) |
+				  ((uint32_t) address[4*i+2] << 16) |
+				  ((uint32_t) address[4*i+3] << 24)) &
+				FAT32_ADDR;
+	}
+}
+
+/* Whether any of these entries would make fatDecode complain */
+static int badSpan(Fs_t *This, const uint32_t *buf, unsigned int n)
+{
+	unsigned int i;
+	uint32_t bad = 0;
+	uint32_t max = This->num_clus - 1;
+	uint32_t last_fat = This->last_fat;
+
+	for(i=0; i < n; i++) {
+		uint32_t v = buf[i];
+		bad |= (v != 0) & (v - 2 > max) & (v < last_fat);
+	}
+	return bad != 0;
+}
+
+/*
+ * Decode n consecutive FAT entries starting at pos, as they are, without
+ * any checks. Returns 0, or -1 if a FAT sector could not be read
+ */
+static int decodeRaw(Fs_t *This, unsigned int pos, unsigned int n,
+		     uint32_t *out)
+{
+	unsigned int i, done, chunk;
+	unsigned int bytes = This->fat_bits / 8;
+
+	if(This->fat_bits == 12) {
+		/* entries straddle sectors, and the whole FAT is at
+		 * most 6 KB anyways */
+		for(i=0; i < n; i++)
+			out[i] = fat12_decode(This, pos+i);
+	} else {
+		for(done = 0; done < n; done += chunk) {
+			unsigned int offset = (pos + done) * bytes;
+			unsigned char *address;
+
+			address = getAddress(This, offset, FAT_ACCESS_READ);
+			if(!address)
+				return -1;
+			if(This->fatData)
+				/* contiguous up to the end of the FAT */
+				chunk = (unsigned int)
+					((((size_t) This->fat_len <<
+					   This->sectorShift) - offset) / bytes);
+			else
+				chunk = (This->sector_size -
+					 (offset & This->sectorMask)) / bytes;
+			if(chunk > n - done)
+				chunk = n - done;
+			decodeSpan(This, address, chunk, out + done);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Decode n consecutive FAT entries starting at pos, with the same
+ * checks as n calls to fatDecode(). Returns 0, or -1 if an entry could
+ * not be read (or decodes to 1)
+ */
+int fatDecodeRange(Fs_t *This, unsigned int pos, unsigned int n,
+		   uint32_t *out)
+{
+	unsigned int i;
+
+	if(decodeRaw(This, pos, n, out) < 0)
+		return -1;
+	if(badSpan(This, out, n))
+		/* slow path, for the diagnostics */
+		for(i=0; i < n; i++) {
+			out[i] = fatDecode(This, pos+i);
+			if(out[i] == 1)
+				return -1;
+		}
+	return 0;
+}
+
+/*
+ * Count the free clusters in [ from, to [, stopping early once at least
+ * max have been found. Returns -1 on a FAT error
+ */
+int fatCountFree(Fs_t *This, unsigned int from, unsigned int to,
+		 unsigned int max)
+{
+	uint32_t buf[DECODE_CHUNK];
+	unsigned int i, n;
+	unsigned int total = 0;
+
+	for(; from < to && total < max; from += n) {
+		n = to - from;
+		if(n > DECODE_CHUNK)
+			n = DECODE_CHUNK;
+		if(fatDecodeRange(This, from, n, buf) < 0)
+			return -1;
+		for(i=0; i < n; i++)
+			total += !buf[i];
+	}
+	return (int) total;
+}
+
+/*
+ * Find the first free cluster in [ from, to [. Returns 0 if there is
+ * none, and 1 on a FAT error
+ */
+unsigned int fatFindFree(Fs_t *This, unsigned int from, unsigned int to)
+{
+	uint32_t buf[DECODE_CHUNK];
+	unsigned int i, n;
+
+	for(; from < to; from += n) {
+		n = to - from;
+		if(n > DECODE_CHUNK)
+			n = DECODE_CHUNK;
+		if(fatDecodeRange(This, from, n, buf) < 0)
+			return 1;
+		for(i=0; i < n; i++)
+			if(!buf[i])
+				return from + i;
+	}
+	return 0;
+}
+
+/*
+ * Fill in the chain length table, for callers about to ask for the length
+ * of many chains (mdu). The FAT is read in one sweep, into the table
+ * itself, and each chain is then followed once up to a cluster whose
+ * length is already known, and once more to store the lengths. Every
+ * cluster is thus visited at most three times, however many files share
+ * it. Returns -1 if the table could not be built, in which case
+ * fatCountChain keeps walking the chains
+ */
+int fatBuildChainLengths(Fs_t *This)
+{
+	uint32_t *len;
+	unsigned int c, x, count;
+	uint32_t v, tail, l;
+	uint32_t max = This->num_clus + 1;
+
+	if(This->chainLen)
+		return 0;
+	if(This->chainLenFailed)
+		return -1;
+	This->chainLenFailed = 1;
+
+	len = malloc(((size_t) max + 1) * sizeof(*len));
+	if(!len)
+		return -1;
+	len[0] = len[1] = CHAIN_UNKNOWN;
+	if(decodeRaw(This, 2, This->num_clus, len + 2) < 0) {
+		free(len);
+		return -1;
+	}
+
+	for(c=2; c <= max; c++) {
+		if(len[c] & CHAIN_RESOLVED)
+			continue;
+
+		/* follow the chain up to its end, or to a cluster whose
+		 * length is already known */
+		count = 0;
+		x = c;
+		while(1) {
+			v = len[x];
+			if(v & CHAIN_RESOLVED) {
+				tail = v;
+				break;
+			}
+			if(v & CHAIN_VISITING) {
+				/* loop */
+				tail = CHAIN_UNKNOWN;
+				break;
+			}
+			len[x] = v | CHAIN_VISITING;
+			count++;
+			if(!v || v > This->last_fat) {
+				/* free cluster, or end of chain */
+				tail = CHAIN_RESOLVED;
+				break;
+			}
+			if(v < 2 || v > max) {
+				tail = CHAIN_UNKNOWN;
+				break;
+			}
+			x = v;
+		}
+
+		/* follow it again, storing the lengths */
+		l = count + (tail & CHAIN_LEN_MASK);
+		for(x = c; count; count--, l--) {
+			v = len[x] & ~CHAIN_VISITING;
+			if(tail == CHAIN_UNKNOWN)
+				len[x] = CHAIN_UNKNOWN;
+			else
+				len[x] = CHAIN_RESOLVED | l;
+			x = v;
+		}
+	}
+
+	This->chainLen = len;
+	This->chainLenFailed = 0;
+	return 0;
+}
+
+/* Forget about the chain lengths, once the FAT gets modified */
+void fatDropChainLengths(Fs_t *This)
+{
+	if(This->chainLen) {
+		free(This->chainLen);
+		This->chainLen = NULL;
+	}
+}
+
 /* append a new cluster */
 void fatAppend(Fs_t *This, unsigned int pos, unsigned int newpos)
 {
@@ -848,27 +1320,22 @@ unsigned int get_next_free_cluster(Fs_t *This, unsigned int last)
 	    last >= This->num_clus+1)
 		last = 1;
 
-	for (i=last+1; i< This->num_clus+2; i++) {
-		unsigned int r = fatDecode(This, i);
-		if(r == 1)
+	if(fat_snapshot_valid(This)) {
+		i = fat_snapshot_next_free(This, last+1, This->num_clus+2);
+		if(!i)
+			i = fat_snapshot_next_free(This, 2, last+1);
+	} else {
+		i = fatFindFree(This, last+1, This->num_clus+2);
+		if(!i)
+			i = fatFindFree(This, 2, last+1);
+		if(i == 1)
 			goto exit_0;
-		if (!r) {
-			This->last = i;
-			return i;
-		}
 	}
-
-	for(i=2; i < last+1; i++) {
-		unsigned int r = fatDecode(This, i);
-		if(r == 1)
-			goto exit_0;
-		if (!r) {
-			This->last = i;
-			return i;
-		}
+	if(i) {
+		This->last = i;
+		return i;
 	}
 
-
 	fprintf(stderr,"No free cluster %d %d\n", This->preallocatedClusters,
 		This->last);
 	return 1;
@@ -920,26 +1387,112 @@ mt_off_t getfree(Stream_t *Dir)
 	Stream_t *Stream = GetFs(Dir);
 	DeclareThis(Fs_t);
 
-	if(This->freeSpace == MAX32 || This->freeSpace == 0) {
-		register unsigned int i;
-		uint32_t total;
+	if(This->snapshot) {
+		/* the walk below, also recording which clusters are used */
+		int r = fat_snapshot_build(This);
+		if(r < 0)
+			return -1;
+		if(r == 0)
+			return sectorsToBytes(This,
+					      This->freeSpace *
+					      This->cluster_size);
+	}
 
-		total = 0L;
-		for (i = 2; i < This->num_clus + 2; i++) {
-			unsigned int r = fatDecode(This,i);
-			if(r == 1) {
-				return -1;
-			}
-			if (!r)
-				total++;
-		}
-		This->freeSpace = total;
+	if(This->freeSpace == MAX32 || This->freeSpace == 0) {
+		int total = fatCountFree(This, 2, This->num_clus + 2, UINT_MAX);
+		if(total < 0)
+			return -1;
+		This->freeSpace = (uint32_t) total;
 	}
 	return sectorsToBytes(This,
 			      This->freeSpace * This->cluster_size);
 }
 
 
+/*
+ * FAT sector off (counted from the start of a FAT copy) has been changed
+ * on the image by another process: read it again, if we have it
+ */
+static int fatReload(Fs_t *This, uint32_t off)
+{
+	uint32_t slot, bit;
+	unsigned int dupe;
+	char *data;
+
+	if(locate(This, off, &slot, &bit) < 0 ||
+	   !(This->FatMap[slot].valid & (ONE << bit)))
+		return 0; /* will be read when needed */
+	data = (char *) This->FatMap[slot].data + (bit << This->sectorShift);
+	for(dupe = 0; dupe < This->num_fat; dupe++) {
+		unsigned int fat = (dupe + This->primaryFat) % This->num_fat;
+		if(forceReadSector(This, data,
+				   This->fat_start + This->fat_len * fat + off,
+				   1) == This->sector_size)
+			return 0;
+	}
+	return -1;
+}
+
+/*
+ * Another process wrote [start, end[ of the file or device dev/ino (as
+ * identified by fs_init). Bring what we have cached about this
+ * filesystem up to date. Returns -1 if this is not possible, and the
+ * filesystem should rather be opened again
+ */
+int fs_reload_range(Stream_t *Dir, dev_t dev, ino_t ino,
+		    mt_off_t start, mt_off_t end)
+{
+	Stream_t *Stream = GetFs(Dir);
+	DeclareThis(Fs_t);
+	mt_off_t fatEnd;
+	uint32_t first, last, sector;
+
+	if(!This->hasIdentity || This->snapshot || This->fat_dirty)
+		return -1;
+	if(dev != This->identDev || ino != This->identIno)
+		return 0;
+	if(This->identOffset && start < 512)
+		/* the partition table may have changed */
+		return -1;
+	start -= This->identOffset;
+	end -= This->identOffset;
+	if(end <= 0)
+		return 0;
+	if(start < 0)
+		start = 0;
+
+	/* anything else we cached, such as directories, is in the buffer.
+	 * Ours is never dirty */
+	if(!buf_bypass(trace_io_skip(This->head.Next)))
+		return -1;
+
+	fatEnd = sectorsToBytes(This, This->fat_start +
+			       This->num_fat * This->fat_len);
+	if(start >= fatEnd)
+		return 0; /* just data */
+	if(end > fatEnd)
+		end = fatEnd;
+	first = (uint32_t) (start >> This->sectorShift);
+	last = (uint32_t) ((end - 1) >> This->sectorShift);
+	for(sector = first; sector <= last; sector++) {
+		if(sector >= This->fat_start) {
+			if(fatReload(This, (sector - This->fat_start) %
+				     This->fat_len) < 0)
+				return -1;
+		} else if(This->fat_bits == 32 &&
+			  sector == This->infoSectorLoc) {
+			This->last = MAX32;
+		} else
+			/* boot sector or other reserved sectors */
+			return -1;
+	}
+
+	/* to be counted again, from the updated FAT */
+	This->freeSpace = MAX32;
+	fatDropChainLengths(This);
+	return 0;
+}
+
 /*
  * Ensure that there is a minimum of total sectors free
  */
@@ -947,8 +1500,8 @@ int getfreeMinClusters(Stream_t *Dir, uint32_t size)
 {
 	Stream_t *Stream = GetFs(Dir);
 	DeclareThis(Fs_t);
-	register unsigned int i, last;
-	size_t total;
+	unsigned int last;
+	int total;
 
 	if(batchmode && This->freeSpace == MAX32)
 		getfree(Stream);
@@ -963,8 +1516,6 @@ int getfreeMinClusters(Stream_t *Dir, uint32_t size)
 		}
 	}
 
-	total = 0L;
-
 	/* we start at the same place where we'll start later to actually
 	 * allocate the sectors.  That way, the same sectors of the FAT, which
 	 * are already loaded during getfreeMin will be able to be reused
@@ -973,26 +1524,18 @@ int getfreeMinClusters(Stream_t *Dir, uint32_t size)
 
 	if ( last < 2 || last >= This->num_clus + 2)
 		last = 1;
-	for (i=last+1; i< This->num_clus+2; i++){
-		unsigned int r = fatDecode(This, i);
-		if(r == 1) {
-			goto exit_0;
-		}
-		if (!r)
-			total++;
-		if(total >= size)
-			return 1;
-	}
-	for(i=2; i < last+1; i++){
-		unsigned int r = fatDecode(This, i);
-		if(r == 1) {
+	total = fatCountFree(This, last+1, This->num_clus+2, size);
+	if(total < 0)
+		goto exit_0;
+	if((uint32_t) total < size) {
+		int more = fatCountFree(This, 2, last+1,
+					size - (uint32_t) total);
+		if(more < 0)
 			goto exit_0;
-		}
-		if (!r)
-			total++;
-		if(total >= size)
-			return 1;
+		total += more;
 	}
+	if((uint32_t) total >= size)
+		return 1;
 	fprintf(stderr, "Disk full\n");
 	got_signal = 1;
 	return 0;
@@ -1035,7 +1578,13 @@ int fs_free(Stream_t *Stream)
 {
 	DeclareThis(Fs_t);
 
-	if(This->FatMap) {
+	forgetFs(This);
+	fat_snapshot_close(This);
+	fatDropChainLengths(This);
+	if(This->fatData) {
+		free(This->fatData);
+		free(This->FatMap);
+	} else if(This->FatMap) {
 		int i, nr_entries;
 		nr_entries = (This->fat_len + SECT_PER_ENTRY - 1) /
 			SECT_PER_ENTRY;
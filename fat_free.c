@@ -30,20 +30,10 @@ int fat_free(Stream_t *Dir, unsigned int fat)
 {
 	Stream_t *Stream = GetFs(Dir);
 	DeclareThis(Fs_t);
-	unsigned int next_no_step;
 					/* a zero length file? */
 	if (fat == 0)
 		return(0);
-	/* CONSTCOND */
-	while (!This->fat_error) {
-		/* get next cluster number */
-		next_no_step = fatDecode(This,fat);
-		/* mark current cluster as empty */
-		fatDeallocate(This,fat);
-		if (next_no_step >= This->last_fat)
-			break;
-		fat = next_no_step;
-	}
+	fatFreeChain(This, fat);
 	return(0);
 }
 
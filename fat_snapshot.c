@@ -0,0 +1,423 @@
+/*  Copyright 2026 Alain Knaff.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * FAT snapshot: a sidecar file next to an image holding a bitmap of the
+ * used clusters, the free cluster count and the last allocated
+ * cluster. As long as the image is unchanged (same size, inode, mtime
+ * and ctime, same boot sector and same FAT32 info sector), the free
+ * space and free clusters can be had from the snapshot without walking
+ * the FAT. Changes made by mtools itself are tracked in the bitmap, and
+ * the snapshot is rewritten when the filesystem is closed.
+ */
+
+#include "sysincludes.h"
+#include "msdos.h"
+#include "mtools.h"
+#include "fsP.h"
+#include "plain_io.h"
+#include "offset.h"
+
+#define SNAPSHOT_MAGIC "MTFATSN1"
+
+typedef struct SnapshotHeader_t {
+	char magic[8];
+	uint32_t headerSize;
+	uint32_t fat_bits;
+	uint32_t num_clus;
+	uint32_t fat_start;
+	uint32_t fat_len;
+	uint32_t freeSpace;
+	uint32_t last;
+	uint32_t bootSum;
+	uint32_t bitmapSum;
+	uint32_t infoFree;	/* as in the FAT32 info sector, or MAX32 */
+	uint32_t infoLast;
+	uint64_t size;
+	uint64_t ino;
+	int64_t mtime;
+	int64_t mtime_ns;
+	int64_t ctime;
+	int64_t ctime_ns;
+} SnapshotHeader_t;
+
+struct FatSnapshot_t {
+	char *path;
+	int fd;			/* descriptor of the image */
+	SnapshotHeader_t hdr;	/* as loaded, or as to be written */
+	unsigned char *bitmap;	/* bit set = cluster in use */
+	size_t bitmapSize;
+	int valid;		/* bitmap reflects the current FAT */
+	int dirty;		/* bitmap changed since loaded */
+	void (*encode)(Fs_t *This, unsigned int num, unsigned int code);
+};
+
+/* FNV-1a */
+static uint32_t checksum(const unsigned char *p, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+	for(i=0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void stat_to_header(SnapshotHeader_t *hdr, struct MT_STAT *st)
+{
+	hdr->size = (uint64_t) st->st_size;
+	hdr->ino = (uint64_t) st->st_ino;
+	hdr->mtime = st->st_mtime;
+	hdr->ctime = st->st_ctime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	hdr->mtime_ns = st->st_mtim.tv_nsec;
+	hdr->ctime_ns = st->st_ctim.tv_nsec;
+#else
+	hdr->mtime_ns = 0;
+	hdr->ctime_ns = 0;
+#endif
+}
+
+static void snapshot_free(FatSnapshot_t *snap)
+{
+	if(snap->bitmap)
+		free(snap->bitmap);
+	free(snap->path);
+	Free(snap);
+}
+
+static int read_snapshot(FatSnapshot_t *snap, SnapshotHeader_t *expect)
+{
+	SnapshotHeader_t hdr;
+	int fd;
+	int ret = -1;
+
+	fd = open(snap->path, O_RDONLY | O_BINARY);
+	if(fd < 0)
+		return -1;
+	if(read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto exit_0;
+
+	/* everything but the free count, the last allocated cluster and
+	 * the info sector (checked later) must match */
+	expect->freeSpace = hdr.freeSpace;
+	expect->last = hdr.last;
+	expect->bitmapSum = hdr.bitmapSum;
+	expect->infoFree = hdr.infoFree;
+	expect->infoLast = hdr.infoLast;
+	if(memcmp(&hdr, expect, sizeof(hdr)))
+		goto exit_0;
+
+	snap->bitmap = malloc(snap->bitmapSize);
+	if(!snap->bitmap)
+		goto exit_0;
+	if(read(fd, snap->bitmap, snap->bitmapSize) !=
+	   (ssize_t) snap->bitmapSize ||
+	   checksum(snap->bitmap, snap->bitmapSize) != hdr.bitmapSum) {
+		free(snap->bitmap);
+		snap->bitmap = NULL;
+		goto exit_0;
+	}
+	ret = 0;
+ exit_0:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Prepare the snapshot of a filesystem which is about to be read.
+ * Returns NULL if snapshots are disabled or not possible for this
+ * device (not a plain image file, or sitting behind a partition or
+ * remap layer)
+ */
+FatSnapshot_t *fat_snapshot_open(Fs_t *This, const char *name,
+				 union bootsector *boot)
+{
+	FatSnapshot_t *snap;
+	Stream_t *Stream;
+	mt_off_t offset = 0;
+	struct MT_STAT st;
+	size_t len;
+	int fd;
+
+	if(!mtools_fat_snapshot || !This->head.Next)
+		return NULL;
+
+	Stream = offset_resolve_base(This->head.Next, &offset);
+	fd = get_fd(Stream);
+	if(fd < 0 || MT_FSTAT(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	snap = New(FatSnapshot_t);
+	if(!snap)
+		return NULL;
+	len = strlen(name) + 32;
+	snap->path = malloc(len);
+	if(!snap->path) {
+		Free(snap);
+		return NULL;
+	}
+	if(offset)
+		snprintf(snap->path, len, "%s@%lld.mfat", name,
+			 (long long) offset);
+	else
+		snprintf(snap->path, len, "%s.mfat", name);
+
+	snap->fd = fd;
+	snap->bitmapSize = (This->num_clus + 2 + 7) / 8;
+
+	memcpy(snap->hdr.magic, SNAPSHOT_MAGIC, sizeof(snap->hdr.magic));
+	snap->hdr.headerSize = sizeof(SnapshotHeader_t);
+	snap->hdr.fat_bits = This->fat_bits;
+	snap->hdr.num_clus = This->num_clus;
+	snap->hdr.fat_start = This->fat_start;
+	snap->hdr.fat_len = This->fat_len;
+	snap->hdr.bootSum = checksum(boot->bytes,
+				     This->sector_size < sizeof(boot->bytes) ?
+				     This->sector_size : sizeof(boot->bytes));
+	stat_to_header(&snap->hdr, &st);
+
+	if(read_snapshot(snap, &snap->hdr) == 0)
+		snap->valid = 1;
+	return snap;
+}
+
+static void snapshot_encode(Fs_t *This, unsigned int num, unsigned int code)
+{
+	FatSnapshot_t *snap = This->snapshot;
+
+	if(num < This->num_clus + 2) {
+		unsigned char mask = (unsigned char) (1 << (num & 7));
+		unsigned char old = snap->bitmap[num >> 3];
+		if(code)
+			snap->bitmap[num >> 3] |= mask;
+		else
+			snap->bitmap[num >> 3] &= (unsigned char) ~mask;
+		if(old != snap->bitmap[num >> 3])
+			snap->dirty = 1;
+	}
+	snap->encode(This, num, code);
+}
+
+static void snapshot_track(Fs_t *This)
+{
+	This->snapshot->encode = This->fat_encode;
+	This->fat_encode = snapshot_encode;
+}
+
+/*
+ * Called once the FAT has been read. Drops the snapshot if the FAT32
+ * info sector has changed since it was written, else makes its free
+ * count and last allocated cluster current
+ */
+void fat_snapshot_attach(Fs_t *This)
+{
+	FatSnapshot_t *snap = This->snapshot;
+
+	if(!snap || !snap->valid)
+		return;
+
+	/* fat_read has put the info sector's values there */
+	if(This->freeSpace != snap->hdr.infoFree ||
+	   This->last != snap->hdr.infoLast) {
+		free(snap->bitmap);
+		snap->bitmap = NULL;
+		snap->valid = 0;
+		return;
+	}
+	This->freeSpace = snap->hdr.freeSpace;
+	This->last = snap->hdr.last;
+	snapshot_track(This);
+}
+
+/*
+ * Build the bitmap by walking the whole FAT. Sets the free count and
+ * returns 0 on success, -1 on a FAT error, and 1 if there is not
+ * enough memory for the bitmap
+ */
+int fat_snapshot_build(Fs_t *This)
+{
+	FatSnapshot_t *snap = This->snapshot;
+	uint32_t buf[1024];
+	unsigned int i, j, n;
+	uint32_t total = 0;
+
+	if(snap->valid)
+		return 0;
+
+	if(!snap->bitmap) {
+		snap->bitmap = malloc(snap->bitmapSize);
+		if(!snap->bitmap)
+			return 1;
+	}
+	memset(snap->bitmap, 0, snap->bitmapSize);
+	snap->bitmap[0] = 3; /* clusters 0 and 1 do not exist */
+
+	for (i = 2; i < This->num_clus + 2; i += n) {
+		n = This->num_clus + 2 - i;
+		if(n > 1024)
+			n = 1024;
+		if(fatDecodeRange(This, i, n, buf) < 0)
+			return -1;
+		for(j=0; j < n; j++) {
+			if (buf[j])
+				snap->bitmap[(i+j) >> 3] |=
+					(unsigned char) (1 << ((i+j) & 7));
+			else
+				total++;
+		}
+	}
+	This->freeSpace = total;
+	snap->valid = 1;
+	snap->dirty = 1;
+	snapshot_track(This);
+	return 0;
+}
+
+int fat_snapshot_valid(Fs_t *This)
+{
+	return This->snapshot && This->snapshot->valid;
+}
+
+/*
+ * Find the first free cluster in [ from, to [ according to the bitmap.
+ * Returns 0 if there is none
+ */
+unsigned int fat_snapshot_next_free(Fs_t *This, unsigned int from,
+				    unsigned int to)
+{
+	unsigned char *bitmap = This->snapshot->bitmap;
+	unsigned int i = from;
+
+	while(i < to) {
+		if(!(i & 7) && bitmap[i >> 3] == 0xff) {
+			i += 8;
+			continue;
+		}
+		if(!(bitmap[i >> 3] & (1 << (i & 7))))
+			return i;
+		i++;
+	}
+	return 0;
+}
+
+static uint32_t count_free(FatSnapshot_t *snap, uint32_t num_clus)
+{
+	uint32_t used = 0;
+	size_t i;
+
+	for(i=0; i < snap->bitmapSize; i++) {
+		unsigned int b = snap->bitmap[i];
+		while(b) {
+			b &= b - 1;
+			used++;
+		}
+	}
+	/* bits past the last cluster are never set */
+	return num_clus + 2 - used;
+}
+
+/* Same as what fat_read does for FAT32 */
+static void read_info_sector(Fs_t *This, SnapshotHeader_t *hdr)
+{
+	InfoSector_t *infoSector;
+
+	hdr->infoFree = MAX32;
+	hdr->infoLast = MAX32;
+	if(This->fat_bits != 32 || This->sector_size < 512 ||
+	   !This->infoSectorLoc || This->infoSectorLoc == MAX32)
+		return;
+	infoSector = (InfoSector_t *) malloc(This->sector_size);
+	if(!infoSector)
+		return;
+	if(force_pread(This->head.Next, (char *)infoSector,
+		       sectorsToBytes(This, This->infoSectorLoc),
+		       This->sector_size) == (ssize_t) This->sector_size &&
+	   DWORD(infoSector->signature1) == INFOSECT_SIGNATURE1 &&
+	   DWORD(infoSector->signature2) == INFOSECT_SIGNATURE2) {
+		hdr->infoFree = DWORD(infoSector->count);
+		hdr->infoLast = DWORD(infoSector->pos);
+	}
+	free(infoSector);
+}
+
+static void write_snapshot(Fs_t *This, FatSnapshot_t *snap)
+{
+	char *tmp;
+	size_t len;
+	int fd;
+	int ok;
+
+	snap->hdr.freeSpace = count_free(snap, This->num_clus);
+	snap->hdr.last = This->last;
+	snap->hdr.bitmapSum = checksum(snap->bitmap, snap->bitmapSize);
+
+	len = strlen(snap->path) + 5;
+	tmp = malloc(len);
+	if(!tmp)
+		return;
+	snprintf(tmp, len, "%s.new", snap->path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if(fd < 0) {
+		/* the image's directory may be read-only, which is fine */
+		free(tmp);
+		return;
+	}
+	ok = write(fd, &snap->hdr, sizeof(snap->hdr)) ==
+		sizeof(snap->hdr) &&
+		write(fd, snap->bitmap, snap->bitmapSize) ==
+		(ssize_t) snap->bitmapSize;
+	if(close(fd) < 0)
+		ok = 0;
+	if(!ok || rename(tmp, snap->path) < 0)
+		unlink(tmp);
+	free(tmp);
+}
+
+/*
+ * Called when the filesystem is closed, after the FAT has been
+ * written. Saves the snapshot if it has changed, or if the image has
+ * changed under it
+ */
+void fat_snapshot_close(Fs_t *This)
+{
+	FatSnapshot_t *snap = This->snapshot;
+	SnapshotHeader_t old;
+	struct MT_STAT st;
+	Stream_t *Stream;
+
+	if(!snap)
+		return;
+	This->snapshot = NULL;
+
+	if(snap->valid && !This->fat_error) {
+		/* make sure everything has reached the image, so that
+		 * we record its final mtime */
+		for(Stream = This->head.Next; Stream; Stream = Stream->Next)
+			if(Stream->Class->flush)
+				Stream->Class->flush(Stream);
+
+		old = snap->hdr;
+		if(MT_FSTAT(snap->fd, &st) == 0) {
+			stat_to_header(&snap->hdr, &st);
+			read_info_sector(This, &snap->hdr);
+			if(snap->dirty || This->last != old.last ||
+			   memcmp(&old, &snap->hdr, sizeof(old)))
+				write_snapshot(This, snap);
+		}
+	}
+	snapshot_free(snap);
+}
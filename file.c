@@ -33,6 +33,10 @@ typedef struct File_t {
 			   mt_off_t *res);
 	uint32_t FileSize;
 
+	/* Size of a directory not yet known: FileSize is only an upper
+	   bound, and gets fixed up once the end of the chain is mapped */
+	int lazySize;
+
 	/* How many bytes do we project to need for this file
 	   (includes those already in FileSize) */
 	uint32_t preallocatedSize;
@@ -58,6 +62,10 @@ typedef struct File_t {
 	unsigned int loopDetectAbs;
 
 	uint32_t where;
+
+	/* drive letter this was opened through, as aliases of a drive
+	 * share their filesystem */
+	char drive;
 } File_t;
 
 static Class_t FileClass;
@@ -136,65 +144,34 @@ static int recalcPreallocSize(File_t *This)
 	return 0;
 }
 
-static int _loopDetect(unsigned int *oldrel, unsigned int rel,
-		       unsigned int *oldabs, unsigned int absol)
-{
-	if(*oldrel && rel > *oldrel && absol == *oldabs) {
-		fprintf(stderr, "loop detected! oldrel=%d newrel=%d abs=%d\n",
-				*oldrel, rel, absol);
-		return -1;
-	}
-
-	if(rel >= 2 * *oldrel + 1) {
-		*oldrel = rel;
-		*oldabs = absol;
-	}
-	return 0;
-}
-
-
 static int loopDetect(File_t *This, unsigned int rel, unsigned int absol)
 {
 	return _loopDetect(&This->loopDetectRel, rel, &This->loopDetectAbs, absol);
 }
 
-static unsigned int _countBlocks(Fs_t *This, unsigned int block)
-{
-	unsigned int blocks;
-	unsigned int rel, oldabs, oldrel;
-
-	blocks = 0;
-
-	oldabs = oldrel = rel = 0;
-
-	while (block <= This->last_fat && block != 1 && block) {
-		blocks++;
-		block = fatDecode(This, block);
-		rel++;
-		if(_loopDetect(&oldrel, rel, &oldabs, block) < 0)
-			block = 1;
-	}
-	return blocks;
-}
-
 unsigned int countBlocks(Stream_t *Dir, unsigned int block)
 {
 	Stream_t *Stream = GetFs(Dir);
 	DeclareThis(Fs_t);
 
-	return _countBlocks(This, block);
+	/* from the second chain on, assume that the caller (mdu) is going
+	 * to ask for many more, and measure them all at once */
+	if(This->chainQueries++)
+		fatBuildChainLengths(This);
+	return fatCountChain(This, block);
 }
 
-/* returns number of bytes in a directory.  Represents a file size, and
- * can hence be not bigger than 2^32
- */
-static uint32_t countBytes(Stream_t *Dir, unsigned int block)
+/* Size of a directory still needed for writing or stat'ing: walk the
+ * chain now */
+static void resolveSize(File_t *This)
 {
-	Stream_t *Stream = GetFs(Dir);
-	DeclareThis(Fs_t);
+	Fs_t *Fs = _getFs(This);
 
-	return _countBlocks(This, block) *
-		This->sector_size * This->cluster_size;
+	if(!This->lazySize)
+		return;
+	This->FileSize = fatCountChain(Fs, This->FirstAbsCluNr) *
+		Fs->sector_size * Fs->cluster_size;
+	This->lazySize = 0;
 }
 
 void printFat(Stream_t *Stream)
@@ -342,6 +319,12 @@ static int normal_map(File_t *This, uint32_t where, uint32_t *len,
 			fatAppend(_getFs(This), AbsCluNr, NewCluNr);
 		}
 
+		if (NewCluNr > Fs->last_fat && This->lazySize) {
+			/* end of a directory's chain: now we know its size */
+			This->FileSize = (CurCluNr + 1) * clus_size;
+			This->lazySize = 0;
+		}
+
 		if (CurCluNr < RelCluNr && NewCluNr > Fs->last_fat){
 			*len = 0;
 			return 0;
@@ -434,6 +417,7 @@ static ssize_t write_file(Stream_t *Stream, char *buf, size_t ilen)
 	uint32_t len;
 	int err;
 
+	resolveSize(This);
 	if(ilen > maxLen) {
 		len = maxLen;
 	} else
@@ -549,8 +533,10 @@ static int get_file_data(Stream_t *Stream, time_t *date, mt_off_t *size,
 
 	if(date)
 		*date = conv_stamp(& This->direntry.dir);
-	if(size)
+	if(size) {
+		resolveSize(This);
 		*size = to_mt_off_t(This->FileSize);
+	}
 	if(type)
 		*type = This->direntry.dir.attr & ATTR_DIR;
 	if(address)
@@ -594,6 +580,7 @@ static int pre_allocate_file(Stream_t *Stream, mt_off_t isize)
 
 	uint32_t size = truncMtOffTo32u(isize);
 
+	resolveSize(This);
 	if(size > This->FileSize &&
 	   size > This->preallocatedSize) {
 		This->preallocatedSize = size;
@@ -632,13 +619,6 @@ static uint32_t func1(void *Stream)
 	return getAbsCluNr(This) ^ (uint32_t) (unsigned long) This->head.Next;
 }
 
-static uint32_t func2(void *Stream)
-{
-	DeclareThis(File_t);
-
-	return getAbsCluNr(This);
-}
-
 static int comp(void *Stream, void *Stream2)
 {
 	DeclareThis(File_t);
@@ -646,7 +626,8 @@ static int comp(void *Stream, void *Stream2)
 	File_t *This2 = (File_t *) Stream2;
 
 	return _getFs(This) != _getFs(This2) ||
-		getAbsCluNr(This) != getAbsCluNr(This2);
+		getAbsCluNr(This) != getAbsCluNr(This2) ||
+		This->drive != This2->drive;
 }
 
 static void init_hash(void)
@@ -654,13 +635,14 @@ static void init_hash(void)
 	static int is_initialised=0;
 
 	if(!is_initialised){
-		make_ht(func1, func2, comp, 20, &filehash);
+		make_ht(func1, comp, 20, &filehash);
 		is_initialised = 1;
 	}
 }
 
 
-static Stream_t *_internalFileOpen(Stream_t *Dir, unsigned int first,
+static Stream_t *_internalFileOpen(Stream_t *Dir, char drive,
+				   unsigned int first,
 				   uint32_t size, direntry_t *entry)
 {
 	Stream_t *Stream = GetFs(Dir);
@@ -683,6 +665,7 @@ static Stream_t *_internalFileOpen(Stream_t *Dir, unsigned int first,
 		Pattern.FirstAbsCluNr = first;
 		Pattern.loopDetectRel = 0;
 		Pattern.loopDetectAbs = first;
+		Pattern.drive = drive;
 		if(!hash_lookup(filehash, &Pattern,
 				&Result, 0)){
 			File=Result;
@@ -707,6 +690,7 @@ static Stream_t *_internalFileOpen(Stream_t *Dir, unsigned int first,
 	else
 		COPY(File->direntry.Dir);
 	File->where = 0;
+	File->drive = drive;
 	if(first || (entry && !IS_DIR(entry)))
 		File->map = normal_map;
 	else
@@ -720,7 +704,13 @@ static Stream_t *_internalFileOpen(Stream_t *Dir, unsigned int first,
 	File->loopDetectAbs = 0;
 
 	File->PreviousRelCluNr = 0xffff;
-	File->FileSize = size;
+	/* Directory sizes are only discovered while reading (see
+	 * normal_map), so that opening a directory doesn't walk its chain */
+	File->lazySize = first > 1 && entry && IS_DIR(entry);
+	if(File->lazySize)
+		File->FileSize = UINT32_MAX;
+	else
+		File->FileSize = size;
 	hash_add(filehash, File, &File->hint);
 	return (Stream_t *) File;
 }
@@ -751,7 +741,11 @@ static void bufferize(Stream_t **Dir)
 }
 
 
-Stream_t *OpenRoot(Stream_t *Dir)
+/*
+ * Root directory of the filesystem, as seen through drive, which may be
+ * an alias of the drive the filesystem was first opened as
+ */
+Stream_t *OpenDriveRoot(Stream_t *Dir, char drive)
 {
 	unsigned int num;
 	direntry_t entry;
@@ -768,16 +762,26 @@ Stream_t *OpenRoot(Stream_t *Dir)
 	mk_entry_from_base("/", ATTR_DIR, num, 0, 0, &entry.dir);
 
 	if(num)
-		size = countBytes(Dir, num);
+		size = 0; /* discovered while reading */
 	else {
 		Fs_t *Fs = (Fs_t *) GetFs(Dir);
 		size = Fs->dir_len * Fs->sector_size;
 	}
-	file = _internalFileOpen(Dir, num, size, &entry);
+	file = _internalFileOpen(Dir, drive, num, size, &entry);
 	bufferize(&file);
 	return file;
 }
 
+Stream_t *OpenRoot(Stream_t *Dir)
+{
+	return OpenDriveRoot(Dir, getDrive(Dir));
+}
+
+char getFileDrive(Stream_t *Stream)
+{
+	return getUnbufferedFile(Stream)->drive;
+}
+
 
 Stream_t *OpenFileByDirentry(direntry_t *entry)
 {
@@ -790,10 +794,11 @@ Stream_t *OpenFileByDirentry(direntry_t *entry)
 	if(!first && IS_DIR(entry))
 		return OpenRoot(entry->Dir);
 	if (IS_DIR(entry))
-		size = countBytes(entry->Dir, first);
+		size = 0; /* discovered while reading */
 	else
 		size = FILE_SIZE(&entry->dir);
-	file = _internalFileOpen(entry->Dir, first, size, entry);
+	file = _internalFileOpen(entry->Dir, getDrive(entry->Dir),
+				 first, size, entry);
 	if(IS_DIR(entry)) {
 		bufferize(&file);
 		if(first == 1)
@@ -22,6 +22,8 @@
 
 Stream_t *OpenFileByDirentry(direntry_t *entry);
 Stream_t *OpenRoot(Stream_t *Dir);
+Stream_t *OpenDriveRoot(Stream_t *Dir, char drive);
+char getFileDrive(Stream_t *Stream);
 void printFat(Stream_t *Stream);
 void printFatWithOffset(Stream_t *Stream, off_t offset);
 direntry_t *getDirentry(Stream_t *Stream);
@@ -46,7 +46,6 @@ size_t wchar_to_native(const wchar_t *wchar, char *native,
 size_t native_to_wchar(const char *native, wchar_t *wchar, size_t len,
 		       const char *end, int *mangled);
 
-int match(const wchar_t *, const wchar_t *, wchar_t *, int,  int);
 wchar_t *unix_name(doscp_t *fromDos,
 		   const char *base, const char *ext, uint8_t Case,
 		   wchar_t *answer);
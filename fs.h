@@ -27,6 +27,8 @@ int fatFreeWithDir(Stream_t *Dir, struct directory *dir);
 int fat_error(Stream_t *Dir);
 uint32_t fat32RootCluster(Stream_t *Dir);
 char getDrive(Stream_t *Stream);
+int fs_reload_range(Stream_t *Dir, dev_t dev, ino_t ino,
+		    mt_off_t start, mt_off_t end);
 
 typedef struct Fs_t Fs_t;
 bool getSerialized(Fs_t *File);
@@ -51,13 +51,31 @@ struct Fs_t {
 				  eliminated */
 
 	struct FatMap_t *FatMap;
+	unsigned char *fatData; /* whole FAT, when resident */
+	struct FatSnapshot_t *snapshot;
+	uint32_t *chainLen; /* chain length of each cluster, when known */
+	int chainLenFailed;
+	unsigned int chainQueries;
 
 	uint32_t dir_start;
 	uint16_t dir_len;
 	uint32_t clus_start;
 
 	uint32_t num_clus;
-	char drive; /* for error messages */
+	char drive; /* drive letter of the first opening */
+
+	/* what is underneath, so that drives which are aliases of each
+	 * other share one filesystem */
+	struct Fs_t *nextOpen;
+	int hasIdentity;
+	dev_t identDev;
+	ino_t identIno;
+	mt_off_t identOffset;
+	int readOnly;
+	/* drive settings which apply to the open filesystem, and must thus
+	 * be the same for drives sharing it */
+	unsigned int codepage;
+	unsigned int use_2m;
 
 	/* fat 32 */
 	uint32_t primaryFat;
@@ -81,16 +99,49 @@ struct Fs_t {
 #include "fs.h"
 
 
+/*
+ * Detect loops in a cluster chain: remember the cluster reached at
+ * relative positions 1, 3, 7, 15, ..., and complain if we reach it again
+ */
+static inline int _loopDetect(unsigned int *oldrel, unsigned int rel,
+			      unsigned int *oldabs, unsigned int absol)
+{
+	if(*oldrel && rel > *oldrel && absol == *oldabs) {
+		fprintf(stderr, "loop detected! oldrel=%d newrel=%d abs=%d\n",
+				*oldrel, rel, absol);
+		return -1;
+	}
+
+	if(rel >= 2 * *oldrel + 1) {
+		*oldrel = rel;
+		*oldabs = absol;
+	}
+	return 0;
+}
+
+
 #ifndef abs
 #define abs(x) ((unsigned int)((x)>0?(x):-(x)))
 #endif
 
 mt_off_t sectorsToBytes(Fs_t *This, uint32_t off);
 int fs_free(Stream_t *Stream);
+void forgetFs(Fs_t *This);
 
 void set_fat(Fs_t *This,bool haveBigFatLen);
 unsigned int get_next_free_cluster(Fs_t *Fs, unsigned int last);
 unsigned int fatDecode(Fs_t *This, unsigned int pos);
+int fatDecodeRange(Fs_t *This, unsigned int pos, unsigned int n,
+		   uint32_t *out);
+int fatCountFree(Fs_t *This, unsigned int from, unsigned int to,
+		 unsigned int max);
+unsigned int fatFindFree(Fs_t *This, unsigned int from, unsigned int to);
+unsigned int fatCountChain(Fs_t *This, unsigned int block);
+int fatBuildChainLengths(Fs_t *This);
+void fatDropChainLengths(Fs_t *This);
+void fatFreeChain(Fs_t *This, unsigned int fat);
+unsigned int fatMarkChain(Fs_t *This, unsigned int fat, unsigned char *map);
+void fatFreeMarked(Fs_t *This, const unsigned char *map);
 void fatAppend(Fs_t *This, unsigned int pos, unsigned int newpos);
 void fatDeallocate(Fs_t *This, unsigned int pos);
 void fatAllocate(Fs_t *This, unsigned int pos, unsigned int value);
@@ -98,12 +149,23 @@ void fatEncode(Fs_t *This, unsigned int pos, unsigned int value);
 
 int fat_read(Fs_t *This, union bootsector *boot, int nodups);
 void fat_write(Fs_t *This);
+int fatMarkAllDirty(Fs_t *This);
 int zero_fat(Fs_t *Fs, uint8_t media_descriptor);
 extern Class_t FsClass;
 int fsPreallocateClusters(Fs_t *Fs, uint32_t);
 void fsReleasePreallocateClusters(Fs_t *Fs, uint32_t);
 Fs_t *getFs(Stream_t *Stream);
 
+typedef struct FatSnapshot_t FatSnapshot_t;
+FatSnapshot_t *fat_snapshot_open(Fs_t *This, const char *name,
+				 union bootsector *boot);
+void fat_snapshot_attach(Fs_t *This);
+int fat_snapshot_build(Fs_t *This);
+int fat_snapshot_valid(Fs_t *This);
+unsigned int fat_snapshot_next_free(Fs_t *This, unsigned int from,
+				    unsigned int to);
+void fat_snapshot_close(Fs_t *This);
+
 int calc_fs_parameters(struct device *dev, bool fat32, uint32_t tot_sectors,
 		       struct Fs_t *Fs, uint8_t *descr);
 
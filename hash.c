@@ -1,4 +1,4 @@
-/*  Copyright 1996,1997,2001,2002,2009 Alain Knaff.
+/*  Copyright 1996,1997,2001,2002,2009,2026 Alain Knaff.
  *  This file is part of mtools.
  *
  *  Mtools is free software: you can redistribute it and/or modify
@@ -15,207 +15,224 @@
  *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
  *
  * hash.c - hash table.
+ *
+ * Open addressing with linear probing, in a table whose size is a power
+ * of two. The hash of each entry is kept next to it, so that probing
+ * only calls the comparison function on entries whose hash matches.
+ * Removed entries leave a tombstone behind (unless they were at the end
+ * of a probe sequence), which goes away when the table is rehashed.
  */
 
 #include "sysincludes.h"
 #include "htable.h"
 #include "mtools.h"
 
+/* special values in hashes[]: entry hashes are mapped above them */
+#define EMPTY 0
+#define DELETED 1
+
+#define MIN_SIZE 8
+#define MAX_SIZE ((size_t) 1 << 31)
+
 struct hashtable {
-  T_HashFunc f1,f2;
-  T_ComparFunc compar;
-  size_t size;  /* actual size of the array */
-  size_t fill;  /* number of deleted or in use slots */
-  size_t inuse; /* number of slots in use */
-  size_t max;   /* maximal number of elements to keep efficient */
-  void **entries;
+	T_HashFunc f;
+	T_ComparFunc compar;
+	size_t size;	/* number of slots, a power of two */
+	unsigned int shift; /* 32 - log2(size) */
+	size_t fill;	/* number of deleted or in use slots */
+	size_t inuse;	/* number of slots in use */
+	size_t max;	/* fill at which the table gets rehashed */
+	uint32_t *hashes;
+	void **entries;
 };
 
-static size_t sizes[]=
-	{ 5, 11, 23, 47, 97, 197, 397, 797, 1597, 3203, 6421, 12853,
-	  25717, 51437, 102877, 205759, 411527, 823117, 1646237,
-	  3292489, 6584983, 13169977, 26339969, 52679969, 105359939,
-	  210719881, 421439783, 842879579, 1685759167, 0 };
-static int deleted=0;
-static int unallocated=0;
+static uint32_t hashOf(T_HashTable *H, void *E)
+{
+	/* multiplicative scrambling, the slot being taken from the top
+	 * bits: callers' hash functions needn't spread the low ones */
+	uint32_t h = H->f(E) * 0x9e3779b1u;
+	if(h <= DELETED)
+		h += DELETED + 1;
+	return h;
+}
+
+static size_t slotOf(T_HashTable *H, uint32_t h)
+{
+	return H->shift < 32 ? (size_t) (h >> H->shift) : 0;
+}
 
-static int alloc_ht(T_HashTable *H, size_t size)
+static int alloc_ht(T_HashTable *H, size_t n)
 {
-  int i;
-  size_t ii;
-
-  for(i=0; sizes[i]; i++)
-    if (sizes[i] > size*4 )
-      break;
-  if (!sizes[i])
-    for(i=0; sizes[i]; i++)
-      if (sizes[i] > size*2 )
-	break;
-  if (!sizes[i])
-    for(i=0; sizes[i]; i++)
-      if (sizes[i] > size)
-	break;
-  if(!sizes[i])
-    return -1;
-  size = sizes[i];
-  if(size < H->size)
-	  size = H->size; /* never shrink the table */
-  H->max = size * 4 / 5 - 2;
-  H->size = size;
-  H->fill = 0;
-  H->inuse = 0;
-  H->entries = NewArray(size, void*);
-  if (H->entries == NULL)
-    return -1; /* out of memory error */
-
-  for(ii=0; ii < size; ii++)
-    H->entries[ii] = &unallocated;
-  return 0;
+	size_t size = MIN_SIZE;
+	unsigned int bits = 3;
+
+	/* at most half full after allocation */
+	while(size < 2 * n) {
+		if(size >= MAX_SIZE)
+			return -1;
+		size <<= 1;
+		bits++;
+	}
+	if(size < H->size) {
+		/* never shrink the table */
+		size = H->size;
+		bits = 32 - H->shift;
+	}
+	H->hashes = NewArray(size, uint32_t);
+	H->entries = NewArray(size, void*);
+	if (H->hashes == NULL || H->entries == NULL) {
+		free(H->hashes);
+		free(H->entries);
+		return -1; /* out of memory error */
+	}
+	H->size = size;
+	H->shift = 32 - bits;
+	H->max = size / 4 * 3;
+	H->fill = 0;
+	H->inuse = 0;
+	return 0;
 }
 
-int make_ht(T_HashFunc f1, T_HashFunc f2, T_ComparFunc c, size_t size,
-	    T_HashTable **H)
+int make_ht(T_HashFunc f, T_ComparFunc c, size_t size, T_HashTable **H)
 {
-  *H = New(T_HashTable);
-  if (*H == NULL){
-    return -1; /* out of memory error */
-  }
-
-  (*H)->f1 = f1;
-  (*H)->f2 = f2;
-  (*H)->compar = c;
-  (*H)->size = 0;
-  if(alloc_ht(*H,size))
-    return -1;
-  return 0;
+	*H = New(T_HashTable);
+	if (*H == NULL){
+		return -1; /* out of memory error */
+	}
+
+	(*H)->f = f;
+	(*H)->compar = c;
+	(*H)->size = 0;
+	(*H)->shift = 32;
+	if(alloc_ht(*H,size))
+		return -1;
+	return 0;
 }
 
 int free_ht(T_HashTable *H, T_HashFunc entry_free)
 {
-  size_t i;
-  if(entry_free)
-    for(i=0; i< H->size; i++)
-      if (H->entries[i] != &unallocated &&
-	  H->entries[i] != &deleted)
-	entry_free(H->entries[i]);
-  Free(H->entries);
-  Free(H);
-  return 0;
+	size_t i;
+	if(entry_free)
+		for(i=0; i< H->size; i++)
+			if (H->hashes[i] > DELETED)
+				entry_free(H->entries[i]);
+	Free(H->hashes);
+	Free(H->entries);
+	Free(H);
+	return 0;
 }
 
 /* add into hash table without checking for repeats */
-static int _hash_add(T_HashTable *H,void *E, size_t *hint)
+static void _hash_add(T_HashTable *H, void *E, uint32_t h, size_t *hint)
 {
-  size_t f2, pos;
-  int ctr;
-
-  pos = H->f1(E) % H->size;
-  f2 = (size_t) -1;
-  ctr = 0;
-  while(H->entries[pos] != &unallocated &&
-	H->entries[pos] != &deleted){
-    if (f2 == (size_t) -1)
-      f2 = H->f2(E) % (H->size - 1);
-    pos = (pos+f2+1) % H->size;
-    ctr++;
-  }
-  if(H->entries[pos] == &unallocated)
-     H->fill++; /* only increase fill if the previous element was not yet
-		 * counted, i.e. unallocated */
-  H->inuse++;
-  H->entries[pos] = E;
-  if(hint)
-	  *hint = pos;
-  return 0;
+	size_t mask = H->size - 1;
+	size_t pos = slotOf(H, h);
+
+	while(H->hashes[pos] > DELETED)
+		pos = (pos + 1) & mask;
+	if(H->hashes[pos] == EMPTY)
+		H->fill++; /* a reused tombstone was already counted */
+	H->inuse++;
+	H->hashes[pos] = h;
+	H->entries[pos] = E;
+	if(hint)
+		*hint = pos;
 }
 
+/* Rebuild the table, without tombstones, growing it if needed */
 static int rehash(T_HashTable *H)
 {
-  size_t size,i;
-  void **oldentries;
-  /* resize the table */
-
-  size = H->size;
-  oldentries = H->entries;
-  if(alloc_ht(H,((H->inuse+1)*4+H->fill)/5))
-	  return -1;
-
-  for(i=0; i < size; i++){
-    if(oldentries[i] != &unallocated && oldentries[i] != &deleted)
-      _hash_add(H, oldentries[i], 0);
-  }
-  Free(oldentries);
-  return 0;
+	size_t size,i;
+	uint32_t *oldhashes;
+	void **oldentries;
+
+	size = H->size;
+	oldhashes = H->hashes;
+	oldentries = H->entries;
+	if(alloc_ht(H, H->inuse + 1)) {
+		H->hashes = oldhashes;
+		H->entries = oldentries;
+		return -1;
+	}
+
+	for(i=0; i < size; i++)
+		if(oldhashes[i] > DELETED)
+			_hash_add(H, oldentries[i], oldhashes[i], 0);
+	Free(oldhashes);
+	Free(oldentries);
+	return 0;
 }
 
 int hash_add(T_HashTable *H, void *E, size_t *hint)
 {
-  if (H->fill >= H->max)
-    rehash(H);
-  if (H->fill == H->size)
-    return -1; /*out of memory error */
-  return _hash_add(H,E, hint);
+	if (H->fill >= H->max && rehash(H) && H->fill == H->size)
+		return -1; /*out of memory error */
+	_hash_add(H, E, hashOf(H, E), hint);
+	return 0;
 }
 
-
-/* add into hash table without checking for repeats */
-static int _hash_lookup(T_HashTable *H,void *E, void **E2,
+static int _hash_lookup(T_HashTable *H, void *E, void **E2,
 			size_t *hint, int isIdentity)
 {
-	size_t f2, pos, upos, ttl;
-
-  pos = H->f1(E) % H->size;
-  ttl = H->size;
-  f2 = (size_t) -1;
-  upos = (size_t) -1;
-  while(ttl &&
-	H->entries[pos] != &unallocated &&
-	(H->entries[pos] == &deleted ||
-	 ((isIdentity || H->compar(H->entries[pos], E) != 0) &&
-	  (!isIdentity || H->entries[pos] != E)))){
-    if (f2 == (size_t) -1)
-      f2 = H->f2(E) % (H->size - 1);
-    if (upos == (size_t) -1 && H->entries[pos] == &deleted)
-      upos = pos;
-    pos = (pos+f2+1) % H->size;
-    ttl--;
-  }
-  if(H->entries[pos] == &unallocated || !ttl)
-    return -1;
-  if (upos != (size_t) -1){
-    H->entries[upos] = H->entries[pos];
-    H->entries[pos] = &deleted;
-    pos = upos;
-  }
-  if(hint)
-    *hint = pos;
-  *E2= H->entries[pos];
-  return 0;
+	size_t mask = H->size - 1;
+	uint32_t h = hashOf(H, E);
+	size_t pos = slotOf(H, h);
+	size_t ttl;
+
+	for(ttl = H->size; ttl && H->hashes[pos] != EMPTY; ttl--) {
+		if(H->hashes[pos] == h &&
+		   (isIdentity ? H->entries[pos] == E :
+		    H->compar(H->entries[pos], E) == 0)) {
+			if(hint)
+				*hint = pos;
+			*E2 = H->entries[pos];
+			return 0;
+		}
+		pos = (pos + 1) & mask;
+	}
+	return -1;
 }
 
-
 int hash_lookup(T_HashTable *H,void *E, void **E2,
 		size_t *hint)
 {
 	return _hash_lookup(H, E, E2, hint, 0);
 }
 
-/* add into hash table without checking for repeats */
+static void delete_slot(T_HashTable *H, size_t pos)
+{
+	size_t mask = H->size - 1;
+
+	H->inuse--;
+	H->entries[pos] = NULL;
+	if(H->hashes[(pos + 1) & mask] != EMPTY) {
+		/* some probe sequence may go through here */
+		H->hashes[pos] = DELETED;
+		return;
+	}
+	/* end of a probe sequence: this slot, and the tombstones just
+	 * before it, become free again */
+	do {
+		H->hashes[pos] = EMPTY;
+		H->fill--;
+		pos = (pos - 1) & mask;
+	} while(H->hashes[pos] == DELETED);
+}
+
 int hash_remove(T_HashTable *H,void *E, size_t hint)
 {
-  void *E2;
-
-  if (hint < H->size && H->entries[hint] == E){
-    H->inuse--;
-    H->entries[hint] = &deleted;
-    return 0;
-  }
-
-  if(_hash_lookup(H, E, &E2, &hint, 1)) {
-	  fprintf(stderr, "Removing non-existent entry\n");
-	  exit(1);
-  }
-  H->inuse--;
-  H->entries[hint] = &deleted;
-  return 0;
+	void *E2;
+
+	if (hint < H->size && H->hashes[hint] > DELETED &&
+	    H->entries[hint] == E){
+		delete_slot(H, hint);
+		return 0;
+	}
+
+	if(_hash_lookup(H, E, &E2, &hint, 1)) {
+		fprintf(stderr, "Removing non-existent entry\n");
+		exit(1);
+	}
+	delete_slot(H, hint);
+	return 0;
 }
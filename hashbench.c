@@ -0,0 +1,154 @@
+/*  Copyright 2026 Alain Knaff.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Microbenchmark of the hash table (hash.c), with keys shaped like those
+ * of the table of open files: a cluster number and a filesystem. Prints
+ * one JSON record per operation and table size.
+ *
+ * hashbench [rounds]
+ */
+
+#include "sysincludes.h"
+#include "htable.h"
+
+typedef struct Key_t {
+	uint32_t clus;
+	void *fs;
+	size_t hint;
+} Key_t;
+
+static uint32_t keyHash(void *p)
+{
+	Key_t *k = (Key_t *) p;
+	return k->clus ^ (uint32_t) (unsigned long) k->fs;
+}
+
+static int keyComp(void *p1, void *p2)
+{
+	Key_t *k1 = (Key_t *) p1;
+	Key_t *k2 = (Key_t *) p2;
+	return k1->fs != k2->fs || k1->clus != k2->clus;
+}
+
+static double now(void)
+{
+#if defined HAVE_CLOCK_GETTIME && defined CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#else
+	return (double) time(NULL);
+#endif
+}
+
+static void record(const char *op, size_t n, unsigned long ops, double secs)
+{
+	printf("{\"op\":\"%s\",\"n\":%lu,\"ops\":%lu,\"ns_per_op\":%.2f}\n",
+	       op, (unsigned long) n, ops, ops ? secs * 1e9 / (double) ops : 0);
+}
+
+static void bench(size_t n, unsigned int rounds)
+{
+	static char fs[2];
+	Key_t *keys, probe;
+	T_HashTable *H;
+	double t, tAdd = 0, tHit = 0, tMiss = 0, tRemove = 0, tChurn = 0;
+	unsigned int r;
+	size_t i;
+	void *found;
+	unsigned long hits = 0;
+
+	keys = calloc(2 * n, sizeof(*keys));
+	if(!keys) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	/* clusters of files are spread over the disk */
+	for(i=0; i < 2 * n; i++) {
+		keys[i].clus = (uint32_t) (2 + i * 37);
+		keys[i].fs = &fs[i & 1];
+	}
+
+	for(r=0; r < rounds; r++) {
+		if(make_ht(keyHash, keyComp, 20, &H)) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+
+		t = now();
+		for(i=0; i < n; i++)
+			hash_add(H, &keys[i], &keys[i].hint);
+		tAdd += now() - t;
+
+		t = now();
+		for(i=0; i < n; i++) {
+			probe = keys[i];
+			hits += !hash_lookup(H, &probe, &found, 0);
+		}
+		tHit += now() - t;
+
+		t = now();
+		for(i=n; i < 2 * n; i++) {
+			probe = keys[i];
+			hits += !hash_lookup(H, &probe, &found, 0);
+		}
+		tMiss += now() - t;
+
+		/* files being opened and closed while others stay open */
+		t = now();
+		for(i=n; i < 2 * n; i++) {
+			hash_add(H, &keys[i], &keys[i].hint);
+			probe = keys[i];
+			hits += !hash_lookup(H, &probe, &found, 0);
+			hash_remove(H, &keys[i], keys[i].hint);
+		}
+		tChurn += now() - t;
+
+		t = now();
+		for(i=0; i < n; i++)
+			hash_remove(H, &keys[i], keys[i].hint);
+		tRemove += now() - t;
+
+		free_ht(H, 0);
+	}
+	if(hits != (unsigned long) rounds * 2 * n) {
+		fprintf(stderr, "Wrong number of hits: %lu\n", hits);
+		exit(1);
+	}
+
+	record("add", n, rounds * n, tAdd);
+	record("lookup_hit", n, rounds * n, tHit);
+	record("lookup_miss", n, rounds * n, tMiss);
+	record("churn", n, rounds * n, tChurn);
+	record("remove", n, rounds * n, tRemove);
+	free(keys);
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t sizes[] = { 16, 256, 4096, 65536 };
+	unsigned long total = argc > 1 ? strtoul(argv[1], NULL, 0) : 0;
+	unsigned int i;
+
+	if(!total)
+		total = 4000000;
+	for(i=0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		unsigned long rounds = total / sizes[i];
+		bench(sizes[i], rounds ? (unsigned int) rounds : 1);
+	}
+	return 0;
+}
@@ -22,8 +22,7 @@ typedef uint32_t (*T_HashFunc)(void *);
 typedef int (*T_ComparFunc)(void *, void *);
 
 
-int make_ht(T_HashFunc f1, T_HashFunc f2, T_ComparFunc c, size_t size,
-	    T_HashTable **H);
+int make_ht(T_HashFunc f, T_ComparFunc c, size_t size, T_HashTable **H);
 int hash_add(T_HashTable *H, void *E, size_t *hint);
 int hash_remove(T_HashTable *H, void *E, size_t hint);
 int hash_lookup(T_HashTable *H, void *E, void **E2,
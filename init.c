@@ -27,10 +27,15 @@
 #include "device.h"
 #include "old_dos.h"
 #include "fsP.h"
+#include "file.h"
 #include "buffer.h"
+#include "trace_io.h"
 #include "file_name.h"
 #include "open_image.h"
 #include "fat_device.h"
+#include "offset.h"
+#include "partition.h"
+#include "plain_io.h"
 
 #define FULL_CYL
 
@@ -485,6 +490,73 @@ uint32_t parseFsParams(	Fs_t *This,
 	return tot_sectors;
 }
 
+/* Filesystems currently open, for finding aliases */
+static Fs_t *openFss;
+
+/*
+ * Find the file or device underneath the stream stack of a filesystem,
+ * and the offset at which the filesystem starts in it. Returns -1 if some
+ * layer does more than adding an offset (remapping, byte swapping, ...)
+ */
+static int getIdentity(Fs_t *This)
+{
+	Stream_t *Stream = This->head.Next;
+	Stream_t *Next;
+	mt_off_t offset = 0;
+	struct MT_STAT st;
+	int fd;
+
+	while(1) {
+		Stream = offset_resolve_base(Stream, &offset);
+		Next = partition_resolve(Stream, &offset);
+		if(!Next)
+			break;
+		Stream = Next;
+	}
+	fd = get_fd(Stream);
+	if(fd < 0 || MT_FSTAT(fd, &st) < 0)
+		return -1;
+
+	This->hasIdentity = 1;
+	if(S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) {
+		/* several device nodes may lead to the same device */
+		This->identDev = st.st_rdev;
+		This->identIno = 0;
+	} else {
+		This->identDev = st.st_dev;
+		This->identIno = st.st_ino;
+	}
+	This->identOffset = offset;
+	return 0;
+}
+
+/* An open filesystem at the same place and with the same settings, which
+ * This can be replaced by */
+static Fs_t *findAlias(Fs_t *This)
+{
+	Fs_t *Fs;
+
+	for(Fs = openFss; Fs; Fs = Fs->nextOpen)
+		if(Fs->identDev == This->identDev &&
+		   Fs->identIno == This->identIno &&
+		   Fs->identOffset == This->identOffset &&
+		   Fs->codepage == This->codepage &&
+		   Fs->use_2m == This->use_2m &&
+		   (!Fs->readOnly || This->readOnly))
+			return Fs;
+	return NULL;
+}
+
+void forgetFs(Fs_t *This)
+{
+	Fs_t **p;
+
+	for(p = &openFss; *p; p = &(*p)->nextOpen)
+		if(*p == This) {
+			*p = This->nextOpen;
+			break;
+		}
+}
 
 Stream_t *fs_init(char drive, int mode, int *isRop)
 {
@@ -518,6 +590,25 @@ Stream_t *fs_init(char drive, int mode, int *isRop)
 				      &maxSize, isRop);
 	if(!This->head.Next)
 		return NULL;
+	This->readOnly = (mode & O_ACCMODE) == O_RDONLY || (isRop && *isRop);
+	This->codepage = dev.codepage;
+	This->use_2m = dev.use_2m;
+
+	/* Drives which are aliases of each other (same image, same offset
+	 * or partition, same settings) share one filesystem, with its
+	 * caches. A read-only one is not shared with a drive which is to be
+	 * written */
+	if(getIdentity(This) == 0) {
+		Fs_t *Alias = findAlias(This);
+		if(Alias) {
+			FREE(&This->head.Next);
+			Free(This);
+			Alias->head.refs++;
+			if(isRop)
+				*isRop = Alias->readOnly;
+			return (Stream_t *) Alias;
+		}
+	}
 
 	cylinder_size = dev.heads * dev.sectors;
 	This->serialized = 0;
@@ -534,6 +625,8 @@ Stream_t *fs_init(char drive, int mode, int *isRop)
 		return NULL;
 	}
 
+	This->snapshot = fat_snapshot_open(This, name, &boot);
+
 	/* full cylinder buffering */
 #ifdef FULL_CYL
 	disk_size = (dev.tracks) ? cylinder_size : 512;
@@ -577,16 +670,20 @@ Stream_t *fs_init(char drive, int mode, int *isRop)
 		else
 			perror("init: allocate buffer");
 	}
+	This->head.Next = OpenTraceIo(This->head.Next, "fs", name);
 
 	/* read the FAT sectors */
 	if(fat_read(This, &boot, dev.use_2m&0x7f)){
 		fprintf(stderr, "Error reading FAT\n");
 		This->num_fat = 1;
+		fat_snapshot_close(This);
 		FREE(&This->head.Next);
 		Free(This->head.Next);
 		return NULL;
 	}
 
+	fat_snapshot_attach(This);
+
 	/* Set the codepage */
 	This->cp = cp_open(dev.codepage);
 	if(This->cp == NULL) {
@@ -597,6 +694,10 @@ Stream_t *fs_init(char drive, int mode, int *isRop)
 		return NULL;
 	}
 
+	if(This->hasIdentity) {
+		This->nextOpen = openFss;
+		openFss = This;
+	}
 	return (Stream_t *) This;
 }
 
@@ -605,7 +706,7 @@ char getDrive(Stream_t *Stream)
 	DeclareThis(Fs_t);
 
 	if(This->head.Class != &FsClass)
-		return getDrive(GetFs(Stream));
+		return getFileDrive(Stream);
 	else
 		return This->drive;
 }
@@ -26,6 +26,7 @@
 #include "plain_io.h"
 #include "file.h"
 #include "file_name.h"
+#include "match.h"
 
 
 /* Fix the info in the MCWD file to be a proper directory name.
@@ -231,17 +232,20 @@ static int _dos_loop(Stream_t *Dir, MainParam_t *mp, const char *filename)
 {
 	Stream_t *MyFile=0;
 	direntry_t entry;
+	pattern_t pattern;
 	int ret;
 	int r;
 
 	ret = 0;
 	r=0;
+	vfat_compile_pattern(&pattern, filename, strlen(filename));
 	initializeDirentry(&entry, Dir);
 	while(!got_signal &&
-	      (r=vfat_lookup_zt(&entry, filename,
-				mp->lookupflags,
-				mp->shortname.data, mp->shortname.len,
-				mp->longname.data, mp->longname.len)) == 0 ){
+	      (r=vfat_lookup_pattern(&entry, &pattern,
+				     mp->lookupflags,
+				     mp->shortname.data, mp->shortname.len,
+				     mp->longname.data,
+				     mp->longname.len)) == 0 ){
 		mp->File = NULL;
 		if(!checkForDot(mp->lookupflags,entry.name)) {
 			MyFile = 0;
@@ -263,6 +267,9 @@ static int _dos_loop(Stream_t *Dir, MainParam_t *mp, const char *filename)
 			ret |= ERROR_ONE;
 		if(mp->fast_quit && (ret & ERROR_ONE))
 			break;
+		if(pattern.isLiteral)
+			/* no other entry can have the same name */
+			break;
 	}
 	if (r == -2)
 	    return ERROR_ONE;
@@ -279,6 +286,7 @@ static int recurs_dos_loop(MainParam_t *mp, const char *filename0,
 	/* Dir is de-allocated by the same entity which allocated it */
 	const char *ptr;
 	direntry_t entry;
+	pattern_t pattern;
 	size_t length;
 	int lookupflags;
 	int ret;
@@ -369,13 +377,15 @@ static int recurs_dos_loop(MainParam_t *mp, const char *filename0,
 	ret = 0;
 	r = 0;
 	have_one = 0;
+	vfat_compile_pattern(&pattern, filename0, length);
 	initializeDirentry(&entry, mp->File);
 	while(!(ret & STOP_NOW) &&
 	      !got_signal &&
-	      (r=vfat_lookup(&entry, filename0, length,
-			     lookupflags | NO_MSG,
-			     mp->shortname.data, mp->shortname.len,
-			     mp->longname.data, mp->longname.len)) == 0 ){
+	      (r=vfat_lookup_pattern(&entry, &pattern,
+				     lookupflags | NO_MSG,
+				     mp->shortname.data, mp->shortname.len,
+				     mp->longname.data,
+				     mp->longname.len)) == 0 ){
 		if(checkForDot(lookupflags, entry.name))
 			/* while following the path, ignore the
 			 * special entries if they were not
@@ -392,7 +402,7 @@ static int recurs_dos_loop(MainParam_t *mp, const char *filename0,
 			ret |= handle_leaf(&entry, mp, lookupState,
 					   DeferredFileP);
 		}
-		if(doing_mcwd)
+		if(doing_mcwd || pattern.isLiteral)
 			break;
 	}
 	if (r == -2)
@@ -438,7 +448,7 @@ static int common_dos_loop(MainParam_t *mp, const char *pathname,
 	if(!mp->File)
 		return ERROR_ONE;
 
-	if(strpbrk(mp->originalArg, "*[?") != 0 &&
+	if(mp->originalArg && strpbrk(mp->originalArg, "*[?") != 0 &&
 	   (mp->lookupflags & DEFERABLE) &&
 	   isUniqueTarget(mp->targetName))
 		DeferredFileP = &DeferredFile;
@@ -572,6 +582,7 @@ void init_mp(MainParam_t *mp)
 	mp->lookupflags = 0;
 	mp->targetName = 0;
 	mp->targetDir = 0;
+	mp->originalArg = 0;
 	mp->dirCallback = dispatchToFile;
 	mp->unixcallback = NULL;
 	mp->shortname.data = mp->longname.data = 0;
@@ -1,5 +1,5 @@
 /*  Copyright 1986-1992 Emmet P. Gray.
- *  Copyright 1996-1998,2001,2002,2008,2009 Alain Knaff.
+ *  Copyright 1996-1998,2001,2002,2008,2009,2026 Alain Knaff.
  *  This file is part of mtools.
  *
  *  Mtools is free software: you can redistribute it and/or modify
@@ -16,152 +16,246 @@
  *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
  *
  * Do shell-style pattern matching for '?', '\', '[..]', and '*' wildcards.
- * Returns 1 if match, 0 if not.
+ * Patterns are compiled once (compile_pattern), and then matched against
+ * each directory entry without recursion (match_pattern).
+ * Matching is case insensitive.
  */
 
 #include "sysincludes.h"
 #include "file_name.h"
+#include "match.h"
 
-
-static int casecmp(wchar_t a, wchar_t b)
+static void addToClass(pattern_t *pat, pattern_class_t *cls,
+		       wchar_t first, wchar_t last)
 {
-	return towupper((wint_t)a) == towupper((wint_t)b);
-}
+	wint_t c;
 
-static int exactcmp(wchar_t a,wchar_t b)
-{
-	return a == b;
+	for(c = (wint_t) first; c <= (wint_t) last && c < 256; c++)
+		cls->bits[c >> 3] |= (unsigned char) (1 << (c & 7));
+	if((wint_t) last >= 256) {
+		pat->ranges[2*pat->nranges] = first;
+		pat->ranges[2*pat->nranges+1] = last;
+		pat->nranges++;
+		cls->nRanges++;
+	}
 }
 
-
-static int is_in_range(wchar_t ch, const wchar_t **p, int *reverse) {
+/* Parses the range starting after the opening [. Returns a pointer to the
+ * closing ], or NULL if the range is not closed */
+static const wchar_t *parseClass(pattern_t *pat, pattern_class_t *cls,
+				 const wchar_t *p)
+{
 	wchar_t first, last;
-	int found=0;
-	if (**p == '^') {
-		*reverse = 1;
-		(*p)++;
-	} else
-		*reverse=0;
-	while( (first = **p) != ']') {
+
+	memset(cls, 0, sizeof(*cls));
+	cls->firstRange = pat->nranges;
+	if (*p == '^') {
+		cls->reverse = 1;
+		p++;
+	}
+	while( (first = *p) != ']') {
 		if(!first)
-			/* Malformed pattern, range not closed */
-			return 0;
-		if(*(++(*p)) == '-') {
-			last = *(++(*p));
-			if(last==']') {
+			return NULL;
+		if(*(++p) == '-') {
+			last = *(++p);
+			if(last == ']') {
 				/* Last "-" in range designates itself */
-				if(ch == first || ch == '-')
-					found = 1;
+				addToClass(pat, cls, first, first);
+				addToClass(pat, cls, '-', '-');
 				break;
 			}
-			(*p)++;
-
+			if(!last)
+				return NULL;
+			p++;
 			/* a proper range */
-			if(ch >= first && ch <= last)
-				found = 1;
+			addToClass(pat, cls, first, last);
 		} else
 			/* a Just one character */
-			if(ch == first)
-				found = 1;
+			addToClass(pat, cls, first, first);
 	}
-	return found;
+	return p;
 }
 
-static int parse_range(const wchar_t **p, const wchar_t *s, wchar_t *out,
-		       int (*compfn)(wchar_t a, wchar_t b))
+static void addElem(pattern_t *pat, int type, wchar_t ch, unsigned int cls)
 {
-	int reverse;
-	const wchar_t *p0 = *p;
-	const wchar_t *p1 = *p;
-	if(out)
-		*out = *s;
-	if(is_in_range(*s, p, &reverse))
-		return 1 ^ reverse;
-	if(compfn == exactcmp)
-		return reverse;
-	if(is_in_range((wchar_t)towlower((wint_t)*s), &p0, &reverse)) {
-		if(out)
-			*out = (wchar_t)towlower((wint_t)*s);
-		return 1 ^ reverse;
-	}
-	if(is_in_range((wchar_t)towupper((wint_t)*s), &p1, &reverse)) {
-		if(out)
-			*out = (wchar_t)towupper((wint_t)*s);
-		return 1 ^ reverse;
-	}
-	return reverse;
-}
+	pattern_elem_t *elem = &pat->elems[pat->nelems++];
 
+	elem->type = type;
+	elem->ch = ch;
+	elem->up = ch_towupper(ch);
+	elem->cls = cls;
+}
 
-static int _match(const wchar_t *s, const wchar_t *p, wchar_t *out, int Case,
-		  int length,
-		  int (*compfn) (wchar_t a, wchar_t b))
+void compile_pattern(pattern_t *pat, const wchar_t *p, size_t length)
 {
-	for (; *p != '\0' && length; ) {
-		switch (*p) {
-			case '?':	/* match any one character */
-				if (*s == '\0')
-					return(0);
-				if(out)
-					*(out++) = *s;
-				break;
-			case '*':	/* match everything */
-				while (*p == '*' && length) {
-					p++;
-					length--;
-				}
+	const wchar_t *end = p + length;
+	const wchar_t *close;
+	unsigned int i;
 
-					/* search for next char in pattern */
-				while(*s) {
-					if(_match(s, p, out, Case, length,
-						  compfn))
-						return 1;
-					if(out)
-						*out++ = *s;
-					s++;
+	pat->nelems = 0;
+	pat->nclasses = 0;
+	pat->nranges = 0;
+	pat->hasStar = 0;
+	pat->isLiteral = 1;
+	while(p < end && *p && pat->nelems < MAX_VNAMELEN) {
+		switch(*p) {
+			case '?':
+				addElem(pat, PAT_ANY, 0, 0);
+				pat->isLiteral = 0;
+				break;
+			case '*':
+				if(!pat->nelems ||
+				   pat->elems[pat->nelems-1].type != PAT_STAR)
+					addElem(pat, PAT_STAR, 0, 0);
+				pat->hasStar = 1;
+				pat->isLiteral = 0;
+				break;
+			case '[':
+				close = parseClass(pat,
+						   &pat->classes[pat->nclasses],
+						   p+1);
+				if(!close) {
+					/* not closed, take [ literally */
+					pat->nranges =
+						pat->classes[pat->nclasses].firstRange;
+					addElem(pat, PAT_LITERAL, *p, 0);
+					break;
 				}
-				continue;
-			case '[':	 /* match range of characters */
-				p++;
-				length--;
-				if(!parse_range(&p, s, out++, compfn))
-					return 0;
+				addElem(pat, PAT_CLASS, 0, pat->nclasses++);
+				pat->isLiteral = 0;
+				p = close;
 				break;
-			case '\\':	/* Literal match with next character */
-				p++;
-				length--;
+			case '\\':
+				/* Literal match with next character */
+				if(p+1 < end && p[1])
+					p++;
 				/* fall thru */
 			default:
-				if (!compfn(*s,*p))
-					return(0);
-				if(out)
-					*(out++) = *p;
+				addElem(pat, PAT_LITERAL, *p, 0);
 				break;
 		}
 		p++;
-		length--;
-		s++;
 	}
-	if(out)
-		*out = '\0';
-
-					/* string ended prematurely ? */
-	if (*s != '\0')
-		return(0);
-	else
-		return(1);
+
+	pat->minLen = 0;
+	pat->prefix = pat->suffix = 0;
+	for(i=0; i < pat->nelems; i++) {
+		if(pat->elems[i].type != PAT_STAR)
+			pat->minLen++;
+		if(pat->isLiteral)
+			pat->name[i] = pat->elems[i].ch;
+	}
+	pat->name[pat->isLiteral ? pat->nelems : 0] = '\0';
+	while(pat->prefix < pat->nelems &&
+	      pat->elems[pat->prefix].type == PAT_LITERAL)
+		pat->prefix++;
+	if(pat->hasStar)
+		while(pat->elems[pat->nelems-1-pat->suffix].type ==
+		      PAT_LITERAL)
+			pat->suffix++;
 }
 
+static int inClass(const pattern_t *pat, const pattern_class_t *cls,
+		   wchar_t ch)
+{
+	wint_t c = (wint_t) ch;
+	const wchar_t *r;
+	unsigned int i;
+
+	if(c < 256)
+		return (cls->bits[c >> 3] >> (c & 7)) & 1;
+	r = pat->ranges + 2 * cls->firstRange;
+	for(i=0; i < cls->nRanges; i++, r += 2)
+		if(c >= (wint_t) r[0] && c <= (wint_t) r[1])
+			return 1;
+	return 0;
+}
 
-int match(const wchar_t *s, const wchar_t *p, wchar_t *out, int Case, int length)
+/* Matches one character against a non-star element. The output
+ * character is the pattern's own one for literals, or the case variant
+ * which matched for classes */
+static int matchElem(const pattern_t *pat, const pattern_elem_t *elem,
+		     wchar_t ch, wchar_t up, wchar_t *out)
 {
-	int (*compfn)(wchar_t a, wchar_t b);
-
-	if(Case)
-		compfn = casecmp;
-	else
-		/*compfn = exactcmp;*/
-		compfn = casecmp;
-	return _match(s, p, out, Case, length, compfn);
+	const pattern_class_t *cls;
+	wchar_t alt;
+
+	switch(elem->type) {
+		case PAT_LITERAL:
+			*out = elem->ch;
+			return up == elem->up;
+		case PAT_ANY:
+			*out = ch;
+			return 1;
+		default:
+			cls = &pat->classes[elem->cls];
+			*out = ch;
+			if(inClass(pat, cls, ch))
+				return !cls->reverse;
+			alt = ch_towlower(ch);
+			if(inClass(pat, cls, alt)) {
+				*out = alt;
+				return !cls->reverse;
+			}
+			if(inClass(pat, cls, up)) {
+				*out = up;
+				return !cls->reverse;
+			}
+			return cls->reverse;
+	}
 }
 
+int match_pattern(const pattern_t *pat, const wchar_t *s, wchar_t *out)
+{
+	wchar_t up[MAX_VNAMELEN+1];
+	wchar_t dummy[MAX_VNAMELEN+1];
+	const pattern_elem_t *elems = pat->elems;
+	size_t len, i, starI;
+	unsigned int e, star, n;
+
+	len = wcslen(s);
+	if(len > MAX_VNAMELEN || len < pat->minLen ||
+	   (!pat->hasStar && len != pat->minLen))
+		return 0;
+	if(!out)
+		out = dummy;
+	for(i=0; i < len; i++)
+		up[i] = ch_towupper(s[i]);
+
+	/* cheap checks of the literal parts at both ends first */
+	for(i=0; i < pat->prefix; i++)
+		if(up[i] != elems[i].up)
+			return 0;
+	n = pat->nelems;
+	for(i=0; i < pat->suffix; i++)
+		if(up[len-1-i] != elems[n-1-i].up)
+			return 0;
+
+	/* On mismatch, only the last star needs to swallow one more
+	 * character: earlier stars never need to be revisited */
+	e = 0;
+	i = 0;
+	star = n;
+	starI = 0;
+	while(i < len) {
+		if(e < n && elems[e].type == PAT_STAR) {
+			star = e++;
+			starI = i;
+			continue;
+		}
+		if(e < n && matchElem(pat, &elems[e], s[i], up[i], &out[i])) {
+			e++;
+			i++;
+			continue;
+		}
+		if(star == n)
+			return 0;
+		out[starI] = s[starI];
+		i = ++starI;
+		e = star + 1;
+	}
+	while(e < n && elems[e].type == PAT_STAR)
+		e++;
+	out[len] = '\0';
+	return e == n;
+}
@@ -0,0 +1,67 @@
+#ifndef MTOOLS_MATCH_H
+#define MTOOLS_MATCH_H
+
+/*  Copyright 2026 Alain Knaff.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Wildcard patterns, compiled once and then matched against many names
+ */
+
+#include "vfat.h"
+
+#define PAT_LITERAL 0
+#define PAT_ANY 1	/* ? */
+#define PAT_STAR 2	/* * */
+#define PAT_CLASS 3	/* [...] */
+
+typedef struct pattern_class_t {
+	unsigned char bits[32];	/* members below 256 */
+	unsigned int firstRange; /* members above, as ranges in pattern_t */
+	unsigned int nRanges;
+	int reverse;
+} pattern_class_t;
+
+typedef struct pattern_elem_t {
+	int type;
+	wchar_t ch;	/* literal character, as written */
+	wchar_t up;	/* same, case folded */
+	unsigned int cls; /* index of character class */
+} pattern_elem_t;
+
+typedef struct pattern_t {
+	pattern_elem_t elems[MAX_VNAMELEN+1];
+	unsigned int nelems;
+
+	pattern_class_t classes[MAX_VNAMELEN/2+1];
+	unsigned int nclasses;
+	wchar_t ranges[MAX_VNAMELEN*2+2];
+	unsigned int nranges;
+
+	unsigned int minLen;	/* characters needed by non-star elements */
+	int hasStar;
+	unsigned int prefix;	/* literal elements before the first star */
+	unsigned int suffix;	/* literal elements after the last star */
+
+	/* no wildcards at all: at most one entry of a directory can match,
+	 * and name holds that entry's name */
+	int isLiteral;
+	wchar_t name[MAX_VNAMELEN+1];
+} pattern_t;
+
+void compile_pattern(pattern_t *pat, const wchar_t *p, size_t length);
+int match_pattern(const pattern_t *pat, const wchar_t *s, wchar_t *out);
+
+#endif
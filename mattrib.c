@@ -1,5 +1,5 @@
 /*  Copyright 1986-1992 Emmet P. Gray.
- *  Copyright 1996-1998,2000-2002,2007,2009 Alain Knaff.
+ *  Copyright 1996-1998,2000-2002,2007,2009,2026 Alain Knaff.
  *  This file is part of mtools.
  *
  *  Mtools is free software: you can redistribute it and/or modify
@@ -22,26 +22,117 @@
 #include "sysincludes.h"
 #include "mtools.h"
 #include "mainloop.h"
+#include "stream.h"
+#include "fs.h"
+#include "file.h"
+#include "dirCache.h"
 
 typedef struct Arg_t {
 	int recursive;
 	int doPrintName;
 	unsigned char add;
 	unsigned char remove;
+	int setTime;
+	time_t mtime;
 } Arg_t;
 
+/* Applies the requested changes to dir, returns whether it changed */
+static int attrib_dir(struct directory *dir, Arg_t *arg)
+{
+	struct directory old = *dir;
+
+	dir->attr = (unsigned char) ((dir->attr & arg->remove) | arg->add);
+	if(arg->setTime)
+		set_entry_time(dir, arg->mtime);
+	return memcmp(&old, dir, sizeof(old)) != 0;
+}
+
 static int attrib_file(direntry_t *entry, MainParam_t *mp)
 {
 	Arg_t *arg=(Arg_t *) mp->arg;
 
-	if(isRootEntry(entry)) {
+	if(!isRootEntry(entry)) {
 		/* if not root directory, change it */
-		entry->dir.attr = (entry->dir.attr & arg->remove) | arg->add;
-		dir_write(entry);
+		if(attrib_dir(&entry->dir, arg))
+			dir_write(entry);
 	}
 	return GOT_ONE;
 }
 
+/*
+ * Changes everything below the directory Dir. The directory is read a
+ * cluster at a time, the entries are changed in place, and each cluster
+ * is written back once, if anything in it changed. Dot entries, labels
+ * and long name slots are left alone, like in the entry by entry path
+ */
+static int attrib_tree(Stream_t *Dir, Arg_t *arg)
+{
+	size_t bufSize = getClusterBytes((Fs_t *) GetFs(Dir));
+	char *buf;
+	struct directory *dir;
+	direntry_t subEntry;
+	Stream_t *SubDir;
+	unsigned int pos, i, n;
+	ssize_t got;
+	int dirty, written = 0;
+	int ret = 0;
+
+	buf = malloc(bufSize);
+	if(!buf) {
+		perror("attrib_tree: malloc");
+		return -1;
+	}
+	for(pos=0; !ret; pos += n) {
+		got = force_pread(Dir, buf, (mt_off_t) pos * MDIR_SIZE, bufSize);
+		if(got < 0) {
+			ret = -1;
+			break;
+		}
+		n = (unsigned int) got / MDIR_SIZE;
+		dirty = 0;
+		for(i=0; i < n && !ret; i++) {
+			dir = (struct directory *) (buf + i * MDIR_SIZE);
+			if(dir->name[0] == ENDMARK)
+				break;
+			if(dir->name[0] == DELMARK ||
+			   (dir->attr & ATTR_LABEL) ||
+			   (dir->name[0] == '.' &&
+			    (dir->name[1] == ' ' || dir->name[1] == '.')))
+				continue;
+			if(got_signal) {
+				ret = -1;
+				break;
+			}
+			dirty |= attrib_dir(dir, arg);
+			if(!(dir->attr & ATTR_DIR) || getStart(Dir, dir) < 2)
+				continue;
+			initializeDirentry(&subEntry, Dir);
+			setEntryToPos(&subEntry, pos + i);
+			subEntry.dir = *dir;
+			SubDir = OpenFileByDirentry(&subEntry);
+			if(!SubDir) {
+				ret = -1;
+				break;
+			}
+			ret = attrib_tree(SubDir, arg);
+			FREE(&SubDir);
+		}
+		if(dirty) {
+			if(force_pwrite(Dir, buf, (mt_off_t) pos * MDIR_SIZE,
+					n * MDIR_SIZE) < (ssize_t) (n * MDIR_SIZE))
+				ret = -1;
+			written = 1;
+		}
+		if(i < n || !n)
+			break;
+	}
+	free(buf);
+	if(written)
+		/* cached copies of the entries are now out of date */
+		freeDirCache(Dir);
+	return ret;
+}
+
 static int replay_attrib(direntry_t *entry, MainParam_t *mp UNUSEDP)
 {
 	if ( (IS_ARCHIVE(entry) && IS_DIR(entry)) ||
@@ -129,6 +220,14 @@ static int recursive_attrib(direntry_t *entry, MainParam_t *mp)
 	return mp->loop(mp->File, mp, "*");
 }
 
+static int bulk_attrib(direntry_t *entry, MainParam_t *mp)
+{
+	attrib_file(entry, mp);
+	if(attrib_tree(mp->File, (Arg_t *) mp->arg) < 0)
+		return ERROR_ONE;
+	return GOT_ONE;
+}
+
 
 static void usage(int ret) NORETURN;
 static void usage(int ret)
@@ -136,7 +235,7 @@ static void usage(int ret)
 	fprintf(stderr, "Mtools version %s, dated %s\n",
 		mversion, mdate);
 	fprintf(stderr,
-		"Usage: %s [-p] [-a|+a] [-h|+h] [-r|+r] [-s|+s] msdosfile [msdosfiles...]\n",
+		"Usage: %s [-p] [-a|+a] [-h|+h] [-r|+r] [-s|+s] [-m mtime] msdosfile [msdosfiles...]\n",
 		progname);
 	exit(ret);
 }
@@ -167,10 +266,13 @@ void mattrib(int argc, char **argv, int type UNUSEDP)
 	int concise;
 	int replay;
 	char *ptr;
+	long mtime;
 	int wantUsage;
 
 	arg.add = 0;
 	arg.remove = 0xff;
+	arg.setTime = 0;
+	arg.mtime = 0;
 	arg.recursive = 0;
 	arg.doPrintName = 1;
 	view = 0;
@@ -180,7 +282,7 @@ void mattrib(int argc, char **argv, int type UNUSEDP)
 
 	if(helpFlag(argc, argv))
 		usage(0);
-	while ((c = getopt(argc, argv, "i:/ahrsAHRSXp")) != EOF) {
+	while ((c = getopt(argc, argv, "i:/ahrsAHRSXpm:")) != EOF) {
 		switch (c) {
 			case 'h':
 				wantUsage = 1;
@@ -194,6 +296,23 @@ void mattrib(int argc, char **argv, int type UNUSEDP)
 			case 'p':
 				replay = 1;
 				break;
+			case 'm':
+				arg.setTime = 1;
+				if(!*optarg) {
+					/* SOURCE_DATE_EPOCH if set, else now */
+					getTimeNow(&arg.mtime);
+					break;
+				}
+				errno = 0;
+				mtime = strtol(optarg, &ptr, 10);
+				if(errno || ptr == optarg || *ptr || mtime < 0) {
+					fprintf(stderr,
+						"Bad modification time %s\n",
+						optarg);
+					exit(1);
+				}
+				arg.mtime = (time_t) mtime;
+				break;
 			case '/':
 				arg.recursive = 1;
 				break;
@@ -223,7 +342,7 @@ void mattrib(int argc, char **argv, int type UNUSEDP)
 		break;
 	}
 
-	if(arg.remove == 0xff && !arg.add)
+	if(arg.remove == 0xff && !arg.add && !arg.setTime)
 		view = 1;
 
 	if (optind >= argc)
@@ -247,7 +366,7 @@ void mattrib(int argc, char **argv, int type UNUSEDP)
 	}
 
 	if(arg.recursive)
-		mp.dirCallback = recursive_attrib;
+		mp.dirCallback = view ? recursive_attrib : bulk_attrib;
 
 	mp.arg = (void *) &arg;
 	mp.lookupflags = ACCEPT_PLAIN | ACCEPT_DIR;
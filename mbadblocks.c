@@ -22,6 +22,8 @@
 #include "sysincludes.h"
 #include "mtools.h"
 #include "fsP.h"
+#include "buffer.h"
+#include "trace_io.h"
 
 #define N_PATTERN 311
 
@@ -62,10 +64,40 @@ static char *in_buf;
 static char *pat_buf;
 static size_t in_len;
 
+/* Free clusters are tested in spans of up to this many bytes, with a
+ * single read or write each */
+#define SPAN_BYTES (4*1024*1024)
+static char *span_buf;
+static uint32_t max_span;
 
-static void progress(unsigned int i, unsigned int total) {
-	if(i % 10 == 0)
-		fprintf(stderr,	"                     \r%d/%d\r", i, total);
+static time_t start_time, last_time;
+
+static void start_progress(void) {
+	start_time = last_time = time(NULL);
+}
+
+/* Print clusters done, throughput and estimated time left, at most once
+ * a second */
+static void progress(unsigned int done, unsigned int total) {
+	time_t now = time(NULL);
+	unsigned long elapsed, left;
+	double rate;
+
+	if(now == last_time || !done)
+		return;
+	last_time = now;
+	elapsed = (unsigned long) (now - start_time);
+	rate = (double) done * (double) in_len / elapsed;
+	left = (unsigned long) ((double) (total - done) * elapsed / done);
+	fprintf(stderr,
+		"                                                  \r"
+		"%u/%u %.1f MB/s ETA %lu:%02lu\r",
+		done, total, rate / (1024*1024), left / 60, left % 60);
+}
+
+static void markBad(Fs_t *Fs, uint32_t cluster, uint32_t badClus) {
+	printf("Bad cluster %d found\n", cluster);
+	fatEncode((Fs_t*)Fs, cluster, badClus);
 }
 
 static int scan(Fs_t *Fs, Stream_t *dev,
@@ -89,24 +121,92 @@ static int scan(Fs_t *Fs, Stream_t *dev,
 		ret = force_pread(dev, in_buf, pos, in_len);
 		if(ret < (off_t) in_len )
 			bad = 1;
-		else if(buffer) {
-			size_t i;
-			for(i=0; i<in_len; i++)
-				if(in_buf[i] != buffer[i]) {
-					bad = 1;
-					break;
-				}
-		}
+		else if(buffer && memcmp(in_buf, buffer, in_len))
+			bad = 1;
 	}
 
 	if(bad) {
-		printf("Bad cluster %d found\n", cluster);
-		fatEncode((Fs_t*)Fs, cluster, badClus);
+		markBad(Fs, cluster, badClus);
 		return 1;
 	}
 	return 0;
 }
 
+/*
+ * Test the n free clusters starting at cluster with one large transfer.
+ * Only if that fails are they probed one by one, in order to find out
+ * which of them are bad
+ */
+static int scanSpan(Fs_t *Fs, Stream_t *dev,
+		    uint32_t cluster, uint32_t n, uint32_t badClus,
+		    char *pattern, int doWrite) {
+	size_t len = n * in_len;
+	mt_off_t pos;
+	ssize_t ret;
+	uint32_t j;
+	int bad = 0;
+
+	pos = sectorsToBytes(Fs, (cluster - 2) * Fs->cluster_size +
+			     Fs->clus_start);
+	if(doWrite) {
+		ret = force_pwrite(dev, pattern, pos, len);
+		if(ret >= 0 && (size_t) ret == len)
+			return 0;
+	} else {
+		ret = force_pread(dev, span_buf, pos, len);
+		if(ret >= 0 && (size_t) ret == len) {
+			if(!pattern || !memcmp(span_buf, pattern, len))
+				return 0;
+			/* data read back fine, but some clusters differ */
+			for(j=0; j < n; j++)
+				if(memcmp(span_buf + j * in_len,
+					  pattern + j * in_len, in_len)) {
+					markBad(Fs, cluster + j, badClus);
+					bad = 1;
+				}
+			return bad;
+		}
+	}
+
+	for(j=0; j < n; j++)
+		bad |= scan(Fs, dev, cluster + j, badClus,
+			    pattern ? pattern + j * in_len : NULL, doWrite);
+	return bad;
+}
+
+/*
+ * Test all free clusters in [ start, end [. If usePattern is set, each
+ * cluster is written with (or compared to) its slot of the pattern
+ * buffer
+ */
+static int scanRange(Fs_t *Fs, Stream_t *dev,
+		     uint32_t start, uint32_t end, uint32_t badClus,
+		     int usePattern, int doWrite) {
+	uint32_t i, n;
+	int ret = 0;
+
+	start_progress();
+	for(i=start; i < end; i += n) {
+		if(got_signal)
+			break;
+		progress(i - start, end - start);
+		n = 1;
+		if(Fs->fat_decode((Fs_t*)Fs, i))
+			/* cluster busy, or already marked */
+			continue;
+		/* a span may not wrap around the end of the pattern */
+		while(i + n < end && n < max_span &&
+		      (!usePattern || (i + n) % N_PATTERN) &&
+		      !Fs->fat_decode((Fs_t*)Fs, i + n))
+			n++;
+		ret |= scanSpan(Fs, dev, i, n, badClus,
+				usePattern ?
+				pat_buf + in_len * (i % N_PATTERN) : NULL,
+				doWrite);
+	}
+	return ret;
+}
+
 void mbadblocks(int argc, char **argv, int type UNUSEDP) NORETURN;
 void mbadblocks(int argc, char **argv, int type UNUSEDP)
 {
@@ -232,46 +332,48 @@ void mbadblocks(int argc, char **argv, int type UNUSEDP)
 			}
 		}
 	} else {
-		Stream_t *dev;
-		dev = Fs->head.Next;
-		if(dev->Next)
-			dev = dev->Next;
+		Stream_t *dev, *disc;
+
+		/* Scan below the filesystem's own buffer (and its tracing
+		 * layer), so that the patterns really go to the device */
+		dev = buf_bypass(trace_io_skip(Fs->head.Next));
+		if(!dev) {
+			ret = 1;
+			goto exit_0;
+		}
+		/* Layer able to drop cached data before reading back.
+		 * Partitions and offsets do not have any themselves */
+		for(disc = dev; disc && !disc->Class->discard; disc = disc->Next)
+			;
 
 		in_len = Fs->cluster_size * Fs->sector_size;
+		max_span = SPAN_BYTES / in_len;
+		if(max_span < 1)
+			max_span = 1;
+		span_buf = malloc(max_span * in_len);
+		if(!span_buf) {
+			printOom();
+			ret = 1;
+			goto exit_0;
+		}
 		if(writeMode) {
 			/* Write pattern */
-			for(i=startSector; i< endSector; i++){
-				if(got_signal)
-					break;
-				progress(i, Fs->num_clus);
-				ret |= scan(Fs, dev, i, badClus,
-					    pat_buf + in_len * (i % N_PATTERN),
-					    1);
-			}
+			ret |= scanRange(Fs, dev, startSector, endSector,
+					 badClus, 1, 1);
 
 			/* Flush cache, so that we are sure we read the data
 			   back from disk, rather than from the cache */
-			if(!got_signal)
-				DISCARD(dev);
+			if(!got_signal && disc)
+				DISCARD(disc);
 
 			/* Read data back, and compare to pattern */
-			for(i=startSector; i< endSector; i++){
-				if(got_signal)
-					break;
-				progress(i, Fs->num_clus);
-				ret |= scan(Fs, dev, i, badClus,
-					    pat_buf + in_len * (i % N_PATTERN),
-					    0);
-			}
-
+			if(!got_signal)
+				ret |= scanRange(Fs, dev,
+						 startSector, endSector,
+						 badClus, 1, 0);
 		} else {
-
-			for(i=startSector; i< endSector; i++){
-				if(got_signal)
-					break;
-				progress(i, Fs->num_clus);
-				ret |= scan(Fs, dev, i, badClus, NULL, 0);
-			}
+			ret |= scanRange(Fs, dev, startSector, endSector,
+					 badClus, 0, 0);
 		}
 	}
  exit_0:
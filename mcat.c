@@ -1,4 +1,4 @@
-/*  Copyright 1999-2003,2007,2009 Alain Knaff.
+/*  Copyright 1999-2003,2007,2009,2026 Alain Knaff.
  *  This file is part of mtools.
  *
  *  Mtools is free software: you can redistribute it and/or modify
@@ -17,28 +17,91 @@
  * mcat.c
  * Same thing as cat /dev/fd0 or cat file >/dev/fd0
  * Something, that isn't possible with floppyd anymore.
+ *
+ * The data goes through large buffers, which are filled by a reader
+ * thread while the previous one is being written out. When both ends
+ * allow it, the kernel moves the data by itself (splice)
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* O_DIRECT, splice */
+#endif
 #include "sysincludes.h"
 #include "mtools.h"
 #include "open_image.h"
+#include "offset.h"
+#include "plain_io.h"
+#include "fs.h"
+#include "fsP.h"
+
+#if defined HAVE_PTHREAD_H && defined HAVE_LIBPTHREAD
+#include <pthread.h>
+#define MCAT_THREADS
+#endif
 
 static void usage(void) NORETURN;
 static void usage(void)
 {
 	fprintf(stderr, "Mtools version %s, dated %s\n",
 		mversion, mdate);
-	fprintf(stderr, "Usage: mcat [-V] [-w] device\n");
+	fprintf(stderr,
+		"Usage: mcat [-V] [-w] [-a] [-d] [-b size] device\n");
 	fprintf(stderr, "       -w write on device else read\n");
+	fprintf(stderr, "       -a only read allocated clusters\n");
+	fprintf(stderr, "       -d direct I/O on device\n");
+	fprintf(stderr, "       -b buffer size (sectors, or K or M)\n");
 	exit(1);
 }
 
 #ifdef __CYGWIN__
 #define BUF_SIZE 512u
 #else
-#define BUF_SIZE 16000u
+#define BUF_SIZE (1024u * 1024u)
 #endif
 
+/* buffer alignment, good enough for direct I/O */
+#define BUF_ALIGN 4096u
+
+#define NR_CHUNKS 2
+
+typedef struct Chunk_t {
+	char *data;
+	mt_off_t address;
+	size_t len;	/* 0 at end of input */
+	int hole;	/* only unallocated clusters, data is all zeroes */
+	int full;
+} Chunk_t;
+
+typedef struct Cat_t {
+	Stream_t *Stream;
+	int writing;
+	mt_off_t size; /* 0 if unknown */
+	size_t bufSize;
+
+	/* device file descriptor, and offset of the stream into it, or -1 */
+	int fd;
+	mt_off_t fdOffset;
+	int direct;
+
+	/* allocated-only mode */
+	unsigned char *allocated; /* bitmap of allocated clusters */
+	mt_off_t dataStart;
+	mt_off_t dataEnd;
+	mt_off_t clusBytes;
+
+	int outSeekable; /* holes may be seeked over on stdout */
+	int pendingHole;
+
+	mt_off_t address; /* next address to be read */
+	Chunk_t chunks[NR_CHUNKS];
+	int error;
+	int abort;
+#ifdef MCAT_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+} Cat_t;
+
 static size_t bufLen(size_t blocksize, mt_off_t totalSize, mt_off_t address)
 {
 	if(totalSize == 0)
@@ -48,6 +111,426 @@ static size_t bufLen(size_t blocksize, mt_off_t totalSize, mt_off_t address)
 	return blocksize;
 }
 
+/* Direct I/O needs aligned buffers, offsets and lengths. Switch to
+ * buffered I/O for a transfer which is not, rather than letting the
+ * kernel refuse it */
+static void checkDirect(Cat_t *cat, char *buf, mt_off_t address, size_t len)
+{
+#ifdef O_DIRECT
+	int flags;
+
+	if(!cat->direct ||
+	   (!((unsigned long) buf % BUF_ALIGN) &&
+	    !((cat->fdOffset + address) % BUF_ALIGN) &&
+	    !(len % BUF_ALIGN)))
+		return;
+	cat->direct = 0;
+	flags = fcntl(cat->fd, F_GETFL);
+	if(flags >= 0)
+		fcntl(cat->fd, F_SETFL, flags & ~O_DIRECT);
+#else
+	(void) cat;
+	(void) buf;
+	(void) address;
+	(void) len;
+#endif
+}
+
+/* Read from the device until len bytes, or end of device */
+static ssize_t devRead(Cat_t *cat, char *buf, mt_off_t address, size_t len)
+{
+	size_t done = 0;
+
+	while(done < len) {
+		ssize_t r;
+
+		checkDirect(cat, buf + done, address + (mt_off_t) done,
+			    len - done);
+		r = PREADS(cat->Stream, buf + done,
+			   address + (mt_off_t) done, len - done);
+		if(r < 0)
+			return -1;
+		if(r == 0)
+			break;
+		done += (size_t) r;
+	}
+	return (ssize_t) done;
+}
+
+static int devWrite(Cat_t *cat, char *buf, mt_off_t address, size_t len)
+{
+	size_t done = 0;
+
+	while(done < len) {
+		ssize_t r;
+
+		checkDirect(cat, buf + done, address + (mt_off_t) done,
+			    len - done);
+		r = PWRITES(cat->Stream, buf + done,
+			    address + (mt_off_t) done, len - done);
+		if(r <= 0)
+			return -1;
+		done += (size_t) r;
+	}
+	return 0;
+}
+
+/* Read from fd until len bytes, or end of file */
+static ssize_t readFull(int fd, char *buf, size_t len)
+{
+	size_t done = 0;
+
+	while(done < len) {
+		ssize_t r = read(fd, buf + done, len - done);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r < 0)
+			return -1;
+		if(r == 0)
+			break;
+		done += (size_t) r;
+	}
+	return (ssize_t) done;
+}
+
+static int writeFull(int fd, const char *buf, size_t len)
+{
+	while(len) {
+		ssize_t r = write(fd, buf, len);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			return -1;
+		buf += r;
+		len -= (size_t) r;
+	}
+	return 0;
+}
+
+static int isAllocated(Cat_t *cat, mt_off_t address)
+{
+	mt_off_t clus;
+
+	if(address < cat->dataStart || address >= cat->dataEnd)
+		return 1;
+	clus = (address - cat->dataStart) / cat->clusBytes + 2;
+	return (cat->allocated[clus >> 3] >> (clus & 7)) & 1;
+}
+
+/*
+ * Read len bytes at address, leaving out unallocated clusters, which
+ * read as zeroes
+ */
+static ssize_t readAllocated(Cat_t *cat, Chunk_t *c, size_t len)
+{
+	mt_off_t address = c->address;
+	mt_off_t end = address + (mt_off_t) len;
+	size_t done = 0;
+
+	c->hole = 1;
+	while(address < end) {
+		int alloc = isAllocated(cat, address);
+		mt_off_t segEnd = address;
+		size_t n;
+
+		/* extend to a run of clusters in the same state */
+		do {
+			if(segEnd < cat->dataStart)
+				segEnd = cat->dataStart;
+			else if(segEnd >= cat->dataEnd)
+				segEnd = end;
+			else
+				segEnd += cat->clusBytes -
+					(segEnd - cat->dataStart) %
+					cat->clusBytes;
+		} while(segEnd < end && isAllocated(cat, segEnd) == alloc);
+		if(segEnd > end)
+			segEnd = end;
+		n = (size_t) (segEnd - address);
+
+		if(alloc) {
+			ssize_t r = devRead(cat, c->data + done, address, n);
+			if(r < 0)
+				return -1;
+			if(r)
+				c->hole = 0;
+			done += (size_t) r;
+			if((size_t) r < n)
+				break;
+		} else {
+			memset(c->data + done, 0, n);
+			done += n;
+		}
+		address = segEnd;
+	}
+	return (ssize_t) done;
+}
+
+/* Fill a chunk from the input. Returns its length, 0 at end, or -1 */
+static ssize_t fill(Cat_t *cat, Chunk_t *c)
+{
+	size_t len = bufLen(cat->bufSize, cat->size, cat->address);
+
+	c->address = cat->address;
+	c->hole = 0;
+	if(!len)
+		return 0;
+	if(cat->writing)
+		return readFull(0, c->data, len);
+	if(cat->allocated)
+		return readAllocated(cat, c, len);
+	return devRead(cat, c->data, c->address, len);
+}
+
+/* Write a chunk out to the output */
+static int drain(Cat_t *cat, Chunk_t *c)
+{
+	if(cat->writing) {
+		if(devWrite(cat, c->data, c->address, c->len) < 0) {
+			perror("write to device");
+			return -1;
+		}
+		return 0;
+	}
+
+	if(c->hole && cat->outSeekable &&
+	   lseek(1, (off_t) c->len, SEEK_CUR) >= 0) {
+		cat->pendingHole = 1;
+		return 0;
+	}
+	cat->pendingHole = 0;
+	if(writeFull(1, c->data, c->len) < 0) {
+		perror("write to stdout");
+		return -1;
+	}
+	return 0;
+}
+
+static void finish(Cat_t *cat)
+{
+	off_t end;
+
+	/* a seek alone does not extend the file */
+	if(cat->pendingHole) {
+		end = lseek(1, 0, SEEK_CUR);
+		if(end < 0 || ftruncate(1, end) < 0) {
+			perror("truncate stdout");
+			cat->error = 1;
+		}
+	}
+}
+
+static void copySequential(Cat_t *cat)
+{
+	Chunk_t *c = &cat->chunks[0];
+	ssize_t r;
+
+	while((r = fill(cat, c)) > 0) {
+		c->len = (size_t) r;
+		cat->address += r;
+		if(drain(cat, c) < 0) {
+			cat->error = 1;
+			return;
+		}
+	}
+	if(r < 0) {
+		perror(cat->writing ? "read from stdin" : "read from device");
+		cat->error = 1;
+	}
+}
+
+#ifdef MCAT_THREADS
+static void *reader(void *arg)
+{
+	Cat_t *cat = (Cat_t *) arg;
+	unsigned int i;
+	ssize_t r;
+
+	for(i=0; ; i = (i + 1) % NR_CHUNKS) {
+		Chunk_t *c = &cat->chunks[i];
+
+		pthread_mutex_lock(&cat->lock);
+		while(c->full && !cat->abort)
+			pthread_cond_wait(&cat->cond, &cat->lock);
+		pthread_mutex_unlock(&cat->lock);
+		if(cat->abort)
+			break;
+
+		r = fill(cat, c);
+		if(r < 0)
+			perror(cat->writing ?
+			       "read from stdin" : "read from device");
+		pthread_mutex_lock(&cat->lock);
+		c->len = r > 0 ? (size_t) r : 0;
+		if(r < 0)
+			cat->error = 1;
+		c->full = 1;
+		pthread_cond_broadcast(&cat->cond);
+		pthread_mutex_unlock(&cat->lock);
+		if(r <= 0)
+			break;
+		cat->address += r;
+	}
+	return NULL;
+}
+
+/*
+ * Read into one buffer while the other one is being written out.
+ * Returns -1 if no thread could be started
+ */
+static int copyOverlapped(Cat_t *cat)
+{
+	pthread_t thread;
+	unsigned int i;
+
+	if(pthread_mutex_init(&cat->lock, 0))
+		return -1;
+	pthread_cond_init(&cat->cond, 0);
+	if(pthread_create(&thread, 0, reader, cat)) {
+		pthread_cond_destroy(&cat->cond);
+		pthread_mutex_destroy(&cat->lock);
+		return -1;
+	}
+
+	for(i=0; ; i = (i + 1) % NR_CHUNKS) {
+		Chunk_t *c = &cat->chunks[i];
+		int ret;
+
+		pthread_mutex_lock(&cat->lock);
+		while(!c->full)
+			pthread_cond_wait(&cat->cond, &cat->lock);
+		pthread_mutex_unlock(&cat->lock);
+		if(!c->len)
+			break;
+
+		ret = drain(cat, c);
+		pthread_mutex_lock(&cat->lock);
+		if(ret < 0)
+			cat->abort = cat->error = 1;
+		c->full = 0;
+		pthread_cond_broadcast(&cat->cond);
+		pthread_mutex_unlock(&cat->lock);
+		if(ret < 0)
+			break;
+	}
+
+	pthread_join(thread, NULL);
+	pthread_cond_destroy(&cat->cond);
+	pthread_mutex_destroy(&cat->lock);
+	return 0;
+}
+#endif
+
+/*
+ * Let the kernel copy between the pipe and the device. Returns 0 if
+ * done, and 1 if the caller should copy the rest (from cat->address) by
+ * itself
+ */
+static int copySplice(Cat_t *cat)
+{
+#if defined HAVE_SPLICE && defined SPLICE_F_MOVE
+	struct MT_STAT st;
+	int pipeFd = cat->writing ? 0 : 1;
+
+	if(cat->fd < 0 || cat->direct || cat->allocated ||
+	   MT_FSTAT(pipeFd, &st) < 0 || !S_ISFIFO(st.st_mode))
+		return 1;
+
+	while(1) {
+		size_t len = bufLen(cat->bufSize, cat->size, cat->address);
+		loff_t off = (loff_t) (cat->fdOffset + cat->address);
+		ssize_t r;
+
+		if(!len)
+			return 0;
+		if(cat->writing)
+			r = splice(0, NULL, cat->fd, &off, len,
+				   SPLICE_F_MOVE | SPLICE_F_MORE);
+		else
+			r = splice(cat->fd, &off, 1, NULL, len,
+				   SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r < 0 && (errno == EINVAL || errno == ENOSYS ||
+			     errno == ESPIPE))
+			/* not supported between these two */
+			return 1;
+		if(r < 0) {
+			perror("splice");
+			cat->error = 1;
+			return 0;
+		}
+		if(r == 0)
+			return 0;
+		cat->address += r;
+	}
+#else
+	(void) cat;
+	return 1;
+#endif
+}
+
+/*
+ * Load the allocation bitmap of the filesystem on drive, for dumping only
+ * the allocated clusters
+ */
+static int readAllocationMap(Cat_t *cat, char drive)
+{
+	Stream_t *Stream;
+	Fs_t *Fs;
+	uint32_t buf[1024];
+	unsigned int i, pos, n;
+	int isRop;
+
+	Stream = fs_init(drive, O_RDONLY, &isRop);
+	if(!Stream) {
+		fprintf(stderr, "Cannot read the FAT of drive %c:\n", drive);
+		return -1;
+	}
+	Fs = (Fs_t *) Stream;
+
+	cat->allocated = calloc((Fs->num_clus + 2 + 7) / 8, 1);
+	if(!cat->allocated) {
+		fprintf(stderr, "Out of memory\n");
+		FREE(&Stream);
+		return -1;
+	}
+	for(pos = 2; pos < Fs->num_clus + 2; pos += n) {
+		n = Fs->num_clus + 2 - pos;
+		if(n > 1024)
+			n = 1024;
+		if(fatDecodeRange(Fs, pos, n, buf) < 0) {
+			fprintf(stderr, "Cannot read the FAT of drive %c:\n",
+				drive);
+			FREE(&Stream);
+			return -1;
+		}
+		for(i=0; i < n; i++)
+			/* clusters marked bad are left out as well */
+			if(buf[i] && buf[i] != Fs->last_fat + 1)
+				cat->allocated[(pos+i) >> 3] |=
+					(unsigned char) (1 << ((pos+i) & 7));
+	}
+	cat->clusBytes = (mt_off_t) Fs->cluster_size * Fs->sector_size;
+	cat->dataStart = sectorsToBytes(Fs, Fs->clus_start);
+	cat->dataEnd = cat->dataStart + cat->clusBytes * Fs->num_clus;
+	FREE(&Stream);
+	return 0;
+}
+
+static char *allocBuffer(size_t size)
+{
+#ifdef HAVE_POSIX_MEMALIGN
+	void *p;
+
+	if(posix_memalign(&p, BUF_ALIGN, size))
+		return NULL;
+	return p;
+#else
+	return malloc(size);
+#endif
+}
+
 void mcat(int argc, char **argv, int type UNUSEDP) NORETURN;
 void mcat(int argc, char **argv, int type UNUSEDP)
 {
@@ -56,12 +539,16 @@ void mcat(int argc, char **argv, int type UNUSEDP)
 	char drive, name[EXPAND_BUF];
         char errmsg[200];
         Stream_t *Stream;
-	char buf[BUF_SIZE];
+	Cat_t cat;
+	struct MT_STAT st;
 
-	mt_off_t address = 0;
 	mt_off_t maxSize = 0;
 
-	char mode = O_RDONLY;
+	int mode = O_RDONLY;
+	int allocatedOnly = 0;
+	int direct = 0;
+	size_t bufSize = BUF_SIZE;
+	unsigned int i;
 	int c;
 
 	noPrivileges = 1;
@@ -70,7 +557,7 @@ void mcat(int argc, char **argv, int type UNUSEDP)
 		usage();
 	}
 
-	while ((c = getopt(argc,argv, "wi:"))!= EOF) {
+	while ((c = getopt(argc,argv, "wi:adb:"))!= EOF) {
 		switch (c) {
 		case 'w':
 			mode = O_WRONLY;
@@ -78,6 +565,17 @@ void mcat(int argc, char **argv, int type UNUSEDP)
 		case 'i':
 			set_cmd_line_image(optarg);
 			break;
+		case 'a':
+			allocatedOnly = 1;
+			break;
+		case 'd':
+			direct = 1;
+			break;
+		case 'b':
+			bufSize = (size_t) parseSize(optarg) * 512;
+			if(!bufSize)
+				usage();
+			break;
 		default:
 			usage();
 		}
@@ -85,6 +583,8 @@ void mcat(int argc, char **argv, int type UNUSEDP)
 
 	if (argc - optind > 1)
 		usage();
+	if(mode == O_WRONLY && allocatedOnly)
+		usage();
 	if(argc - optind == 1) {
 		if(!argv[optind][0] || argv[optind][1] != ':')
 			usage();
@@ -93,6 +593,13 @@ void mcat(int argc, char **argv, int type UNUSEDP)
 		drive = get_default_drive();
 	}
 
+	memset(&cat, 0, sizeof(cat));
+	cat.writing = (mode == O_WRONLY);
+	cat.bufSize = bufSize;
+	cat.fd = -1;
+	if(allocatedOnly && readAllocationMap(&cat, drive) < 0)
+		exit(1);
+
         /* check out a drive whose letter and parameters match */
         sprintf(errmsg, "Drive '%c:' not supported", drive);
         Stream = NULL;
@@ -119,32 +626,47 @@ void mcat(int argc, char **argv, int type UNUSEDP)
 		goto exit_1;
 
 	if (mode == O_WRONLY) {
-		size_t len;
-		mt_off_t size=0;
 		if(chs_to_totsectors(&out_dev, errmsg) < 0 ||
 		   check_if_sectors_fit(out_dev.tot_sectors,
 					maxSize, 512, errmsg))
 			goto exit_1;
-		size = 512 * (mt_off_t) out_dev.tot_sectors;
-		while ((len = fread(buf, 1,
-				    bufLen(BUF_SIZE, size, address),
-				    stdin)) > 0) {
-			ssize_t r = PWRITES(Stream, buf, address, len);
-			fprintf(stderr, "Wrote to %d\n", (int) address);
-			if(r < 0)
-				break;
-			address += len;
-		}
-	} else {
-		ssize_t len;
-		while ((len = PREADS(Stream, buf, address, BUF_SIZE)) > 0) {
-			fwrite(buf, 1, (size_t) len, stdout);
-			address += (size_t) len;
+		cat.size = 512 * (mt_off_t) out_dev.tot_sectors;
+	}
+
+	cat.Stream = Stream;
+	cat.fd = get_fd(offset_resolve(Stream, &cat.fdOffset));
+#ifdef O_DIRECT
+	if(direct && cat.fd >= 0) {
+		/* set after opening, so that probing the geometry still
+		 * works with unaligned buffers */
+		int flags = fcntl(cat.fd, F_GETFL);
+		if(flags >= 0 && fcntl(cat.fd, F_SETFL, flags | O_DIRECT) >= 0)
+			cat.direct = 1;
+	}
+#endif
+	if(!cat.writing && MT_FSTAT(1, &st) >= 0 && S_ISREG(st.st_mode))
+		cat.outSeekable = 1;
+
+	if(copySplice(&cat)) {
+		for(i=0; i < NR_CHUNKS; i++) {
+			cat.chunks[i].data = allocBuffer(cat.bufSize);
+			if(!cat.chunks[i].data) {
+				sprintf(errmsg, "Out of memory");
+				goto exit_1;
+			}
 		}
+#ifdef MCAT_THREADS
+		if(copyOverlapped(&cat) < 0)
+#endif
+			copySequential(&cat);
+		if(!cat.error)
+			finish(&cat);
 	}
 
-	FREE(&Stream);
-	exit(0);
+	/* deferred writes (MTOOLS_IO_QUEUE_DEPTH) may only fail now */
+	if(FREE(&Stream) < 0)
+		cat.error = 1;
+	exit(cat.error);
 exit_1:
 	FREE(&Stream);
 	fprintf(stderr,"%s\n",errmsg);
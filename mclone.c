@@ -0,0 +1,819 @@
+/*  Copyright 2026 Alain Knaff.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * mclone.c
+ * Clone a FAT volume to an image file or device, copying only the
+ * clusters which are in use. Optionally, the clone is defragmented and
+ * shrunk to the space actually used
+ */
+
+#include "sysincludes.h"
+#include "mtools.h"
+#include "fs.h"
+#include "fsP.h"
+#include "fat_device.h"
+#include "llong.h"
+#include "plain_io.h"
+
+#define CLONE_BUF_SIZE (1024u * 1024u)
+#define DECODE_CHUNK 1024
+
+/* A chain to be copied to the (shrunk) target */
+typedef struct CloneItem_t {
+	uint32_t old;	/* first cluster on the source */
+	uint32_t new;	/* first cluster on the target */
+	uint32_t len;	/* number of clusters */
+	uint32_t parent; /* new first cluster of the parent directory */
+	int isDir;
+} CloneItem_t;
+
+/* Where things are on the target */
+typedef struct Layout_t {
+	uint32_t tot_sectors;
+	uint32_t fat_len;
+	uint32_t num_clus;
+	uint32_t dir_start;
+	uint32_t clus_start;
+} Layout_t;
+
+typedef struct Clone_t {
+	Fs_t *Fs;
+	Stream_t *Src;	/* raw source, below the buffer cache */
+	union bootsector boot;
+	uint32_t tot_sectors;
+	uint16_t backupBoot;
+
+	int fd;		/* target */
+	const char *target;
+	int isReg;
+
+	char *buf;
+	size_t bufSize;
+	mt_off_t clusBytes;
+
+	/* shrinking */
+	Layout_t new;
+	uint32_t *map; /* new first cluster, by old first cluster */
+	CloneItem_t *items;
+	unsigned int nrItems;
+	unsigned int maxItems;
+	uint32_t next; /* next free cluster on the target */
+} Clone_t;
+
+static void usage(int ret) NORETURN;
+static void usage(int ret)
+{
+	fprintf(stderr, "Mtools version %s, dated %s\n",
+		mversion, mdate);
+	fprintf(stderr, "Usage: %s [-s] drive: target\n", progname);
+	fprintf(stderr, "       -s defragment and shrink to the used size\n");
+	exit(ret);
+}
+
+static mt_off_t sectorBytes(Clone_t *cl, uint32_t sector)
+{
+	return (mt_off_t) sector * cl->Fs->sector_size;
+}
+
+/* Read from the source. Anything beyond its end reads as zeroes */
+static int srcRead(Clone_t *cl, char *buf, mt_off_t where, size_t len)
+{
+	size_t done = 0;
+
+	while(done < len) {
+		ssize_t r = PREADS(cl->Src, buf + done,
+				   where + (mt_off_t) done, len - done);
+		if(r < 0) {
+			perror("read source");
+			return -1;
+		}
+		if(r == 0) {
+			memset(buf + done, 0, len - done);
+			break;
+		}
+		done += (size_t) r;
+	}
+	return 0;
+}
+
+static int dstWrite(Clone_t *cl, const char *buf, mt_off_t where, size_t len)
+{
+	if(mt_lseek(cl->fd, where, SEEK_SET) < 0) {
+		perror(cl->target);
+		return -1;
+	}
+	while(len) {
+		ssize_t r = write(cl->fd, buf, len);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0) {
+			perror(cl->target);
+			return -1;
+		}
+		buf += r;
+		len -= (size_t) r;
+	}
+	return 0;
+}
+
+/* Copy len bytes, in large sequential transfers */
+static int copyRange(Clone_t *cl, mt_off_t from, mt_off_t to, mt_off_t len)
+{
+	while(len > 0) {
+		size_t n = cl->bufSize;
+		if((mt_off_t) n > len)
+			n = (size_t) len;
+		if(srcRead(cl, cl->buf, from, n) < 0 ||
+		   dstWrite(cl, cl->buf, to, n) < 0)
+			return -1;
+		from += (mt_off_t) n;
+		to += (mt_off_t) n;
+		len -= (mt_off_t) n;
+	}
+	return 0;
+}
+
+static mt_off_t srcCluster(Clone_t *cl, uint32_t clus)
+{
+	return sectorBytes(cl, cl->Fs->clus_start) +
+		(mt_off_t) (clus - 2) * cl->clusBytes;
+}
+
+static mt_off_t dstCluster(Clone_t *cl, uint32_t clus)
+{
+	return sectorBytes(cl, cl->new.clus_start) +
+		(mt_off_t) (clus - 2) * cl->clusBytes;
+}
+
+/* Is this FAT entry that of a cluster worth copying? */
+static int inUse(Fs_t *Fs, uint32_t entry)
+{
+	/* clusters marked as bad are left out as well */
+	return entry && entry != Fs->last_fat + 1;
+}
+
+/*
+ * Plain clone: everything in front of the data area, and then the
+ * allocated cluster runs, at the same place
+ */
+static int clonePlain(Clone_t *cl)
+{
+	Fs_t *Fs = cl->Fs;
+	uint32_t buf[DECODE_CHUNK];
+	uint32_t pos, n, i;
+	uint32_t runStart = 0, runLen = 0;
+
+	if(copyRange(cl, 0, 0, sectorBytes(cl, Fs->clus_start)) < 0)
+		return -1;
+
+	for(pos = 2; pos < Fs->num_clus + 2; pos += n) {
+		n = Fs->num_clus + 2 - pos;
+		if(n > DECODE_CHUNK)
+			n = DECODE_CHUNK;
+		if(fatDecodeRange(Fs, pos, n, buf) < 0)
+			/* one entry at a time: unreadable or bad entries
+			 * get copied, just in case */
+			for(i=0; i < n; i++)
+				buf[i] = fatDecode(Fs, pos + i);
+		for(i=0; i < n; i++) {
+			if(inUse(Fs, buf[i])) {
+				if(!runLen)
+					runStart = pos + i;
+				runLen++;
+				continue;
+			}
+			if(runLen &&
+			   copyRange(cl, srcCluster(cl, runStart),
+				     srcCluster(cl, runStart),
+				     runLen * cl->clusBytes) < 0)
+				return -1;
+			runLen = 0;
+		}
+	}
+	if(runLen &&
+	   copyRange(cl, srcCluster(cl, runStart), srcCluster(cl, runStart),
+		     runLen * cl->clusBytes) < 0)
+		return -1;
+	return 0;
+}
+
+static uint32_t getStartCluster(Clone_t *cl, struct directory *dir)
+{
+	uint32_t start = START(dir);
+	if(cl->Fs->fat_bits == 32)
+		start |= (uint32_t) STARTHI(dir) << 16;
+	return start;
+}
+
+static void setStartCluster(Clone_t *cl, struct directory *dir, uint32_t start)
+{
+	set_word(dir->start, (unsigned short) (start & 0xffff));
+	if(cl->Fs->fat_bits == 32)
+		set_word(dir->startHi, (unsigned short) (start >> 16));
+}
+
+/* Give the chain starting at old its place on the target */
+static int assign(Clone_t *cl, uint32_t old, uint32_t parent, int isDir)
+{
+	CloneItem_t *item;
+	uint32_t len;
+
+	if(cl->map[old])
+		return 0;
+	len = fatCountChain(cl->Fs, old);
+	if(!len)
+		return 0;
+
+	if(cl->nrItems == cl->maxItems) {
+		unsigned int max = cl->maxItems ? 2 * cl->maxItems : 256;
+		CloneItem_t *items = realloc(cl->items, max * sizeof(*items));
+		if(!items) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		cl->items = items;
+		cl->maxItems = max;
+	}
+	item = &cl->items[cl->nrItems++];
+	item->old = old;
+	item->new = cl->next;
+	item->len = len;
+	item->parent = parent;
+	item->isDir = isDir;
+	cl->map[old] = cl->next;
+	cl->next += len;
+	return 0;
+}
+
+/*
+ * Go through the entries of a directory, either assigning their chains
+ * a place on the target, or pointing them to that place
+ */
+static int scanDir(Clone_t *cl, char *data, size_t len,
+		   uint32_t self, uint32_t parent, int patch)
+{
+	size_t off;
+
+	for(off = 0; off + sizeof(struct directory) <= len;
+	    off += sizeof(struct directory)) {
+		struct directory *dir = (struct directory *) (data + off);
+		uint32_t start;
+
+		if(!dir->name[0])
+			break;
+		if(dir->name[0] == DELMARK ||
+		   dir->attr == 0x0f || (dir->attr & ATTR_LABEL))
+			continue;
+
+		if(!strncmp(dir->name, ".       ", 8)) {
+			if(patch)
+				setStartCluster(cl, dir, self);
+			continue;
+		}
+		if(!strncmp(dir->name, "..      ", 8)) {
+			if(patch)
+				setStartCluster(cl, dir, parent);
+			continue;
+		}
+
+		start = getStartCluster(cl, dir);
+		if(start < 2 || start > cl->Fs->num_clus + 1) {
+			/* empty file, or broken entry */
+			if(patch && start)
+				setStartCluster(cl, dir, 0);
+			continue;
+		}
+		if(patch)
+			setStartCluster(cl, dir, cl->map[start]);
+		else if(assign(cl, start, self,
+			       (dir->attr & ATTR_DIR) != 0) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Read the len clusters of the chain starting at clus */
+static int readChain(Clone_t *cl, char *data, uint32_t clus, uint32_t len)
+{
+	uint32_t i;
+
+	for(i=0; i < len; i++) {
+		if(clus < 2 || clus > cl->Fs->num_clus + 1) {
+			/* broken chain */
+			memset(data, 0, (size_t) ((len - i) * cl->clusBytes));
+			break;
+		}
+		if(srcRead(cl, data, srcCluster(cl, clus),
+			   (size_t) cl->clusBytes) < 0)
+			return -1;
+		data += cl->clusBytes;
+		clus = fatDecode(cl->Fs, clus);
+	}
+	return 0;
+}
+
+/* Read a directory: the fixed root directory if len is 0 */
+static char *readDir(Clone_t *cl, CloneItem_t *item, size_t *size)
+{
+	char *data;
+
+	if(item)
+		*size = (size_t) (item->len * cl->clusBytes);
+	else
+		*size = (size_t) cl->Fs->dir_len * cl->Fs->sector_size;
+	data = malloc(*size ? *size : 1);
+	if(!data) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+	if(item ? readChain(cl, data, item->old, item->len) :
+	   srcRead(cl, data, sectorBytes(cl, cl->Fs->dir_start), *size)) {
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+/*
+ * First pass of shrinking: walk the directory tree, and give each chain
+ * its place on the target, in the order in which they are found
+ */
+static int plan(Clone_t *cl)
+{
+	Fs_t *Fs = cl->Fs;
+	unsigned int i;
+	char *data;
+	size_t size;
+	int ret;
+
+	cl->map = calloc(Fs->num_clus + 2, sizeof(*cl->map));
+	if(!cl->map) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	cl->next = 2;
+
+	if(Fs->fat_bits == 32) {
+		if(assign(cl, Fs->rootCluster, 0, 1) < 0)
+			return -1;
+	} else {
+		data = readDir(cl, NULL, &size);
+		if(!data)
+			return -1;
+		ret = scanDir(cl, data, size, 0, 0, 0);
+		free(data);
+		if(ret < 0)
+			return -1;
+	}
+
+	/* items get appended while we go: breadth first */
+	for(i=0; i < cl->nrItems; i++) {
+		CloneItem_t item = cl->items[i];
+		uint32_t self;
+
+		if(!item.isDir)
+			continue;
+		data = readDir(cl, &item, &size);
+		if(!data)
+			return -1;
+		/* in the root's subdirectories, .. points to cluster 0 */
+		self = item.new;
+		if(Fs->fat_bits == 32 && item.old == Fs->rootCluster)
+			self = 0;
+		ret = scanDir(cl, data, size, self, item.parent, 0);
+		free(data);
+		if(ret < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Number of FAT sectors needed for nclus clusters */
+static uint32_t fatSectors(Fs_t *Fs, uint32_t nclus)
+{
+	return (uint32_t) (((uint64_t) (nclus + 2) * Fs->fat_bits / 8 +
+			    Fs->sector_size - 1) / Fs->sector_size);
+}
+
+/*
+ * Compute the parameters of the smallest filesystem with the same FAT
+ * type, cluster size, reserved sectors and root directory, holding at
+ * least needed clusters. Returns -1 if it would not be any smaller
+ */
+static int calcLayout(Clone_t *cl, uint32_t needed)
+{
+	Fs_t *Fs = cl->Fs;
+	struct device dev;
+	Fs_t tmp;
+	uint8_t descr;
+	uint32_t minClus, tot;
+	int tries;
+
+	switch(Fs->fat_bits) {
+	case 12:
+		minClus = 1;
+		break;
+	case 16:
+		minClus = 4096;
+		break;
+	default:
+		minClus = FAT16;
+		break;
+	}
+	if(needed < minClus)
+		needed = minClus;
+
+	/* a few spare sectors, so that rounding never leaves us below
+	 * the minimum number of clusters for this FAT type */
+	tot = Fs->fat_start + Fs->dir_len +
+		Fs->num_fat * (fatSectors(Fs, needed) + 1) +
+		(needed + 2) * Fs->cluster_size;
+
+	memset(&dev, 0, sizeof(dev));
+	dev.fat_bits = (int) Fs->fat_bits;
+	dev.heads = 1;
+	dev.sectors = 1;
+	for(tries = 0; tries < 16; tries++) {
+		if(tot >= cl->tot_sectors)
+			return -1;
+
+		initFsForFormat(&tmp);
+		tmp.sector_size = Fs->sector_size;
+		tmp.sectorShift = Fs->sectorShift;
+		tmp.cluster_size = Fs->cluster_size;
+		tmp.fat_start = Fs->fat_start;
+		tmp.num_fat = Fs->num_fat;
+		tmp.dir_len = Fs->dir_len;
+		if(calc_fs_parameters(&dev, false, tot, &tmp, &descr) < 0 ||
+		   tmp.fat_bits != Fs->fat_bits)
+			return -1;
+		if(tmp.num_clus >= needed) {
+			cl->new.tot_sectors = tot;
+			cl->new.fat_len = tmp.fat_len;
+			cl->new.num_clus = tmp.num_clus;
+			cl->new.dir_start = tmp.fat_start +
+				tmp.num_fat * tmp.fat_len;
+			cl->new.clus_start = tmp.clus_start;
+			return 0;
+		}
+		tot += (needed - tmp.num_clus) * Fs->cluster_size;
+	}
+	return -1;
+}
+
+static void setFatEntry(Fs_t *Fs, unsigned char *fat, uint32_t pos,
+			uint32_t value)
+{
+	unsigned char *p;
+
+	switch(Fs->fat_bits) {
+	case 12:
+		p = fat + pos * 3 / 2;
+		if(pos & 1) {
+			p[0] = (unsigned char) ((p[0] & 0x0f) |
+						((value & 0x0f) << 4));
+			p[1] = (unsigned char) (value >> 4);
+		} else {
+			p[0] = (unsigned char) value;
+			p[1] = (unsigned char) ((p[1] & 0xf0) |
+						((value >> 8) & 0x0f));
+		}
+		break;
+	case 16:
+		set_word(fat + 2 * pos, (unsigned short) value);
+		break;
+	default:
+		set_dword(fat + 4 * pos, value);
+		break;
+	}
+}
+
+/* Reserved sectors, with the boot sector(s) and info sector updated */
+static int writeReserved(Clone_t *cl)
+{
+	Fs_t *Fs = cl->Fs;
+	union bootsector *boot = &cl->boot;
+	size_t ss = Fs->sector_size;
+	uint32_t sect;
+
+	if(copyRange(cl, 0, 0, sectorBytes(cl, Fs->fat_start)) < 0)
+		return -1;
+
+	if(cl->new.tot_sectors <= UINT16_MAX && Fs->fat_bits != 32) {
+		set_word(boot->boot.psect, (unsigned short) cl->new.tot_sectors);
+		set_dword(boot->boot.bigsect, 0);
+	} else {
+		set_word(boot->boot.psect, 0);
+		set_dword(boot->boot.bigsect, cl->new.tot_sectors);
+	}
+	if(Fs->fat_bits == 32) {
+		set_dword(boot->boot.ext.fat32.bigFat, cl->new.fat_len);
+		set_dword(boot->boot.ext.fat32.rootCluster,
+			  cl->map[Fs->rootCluster]);
+	} else
+		set_word(boot->boot.fatlen, (unsigned short) cl->new.fat_len);
+
+	if(dstWrite(cl, boot->characters, 0, ss) < 0)
+		return -1;
+	if(Fs->fat_bits == 32 && cl->backupBoot &&
+	   cl->backupBoot < Fs->fat_start &&
+	   dstWrite(cl, boot->characters,
+		    sectorBytes(cl, cl->backupBoot), ss) < 0)
+		return -1;
+
+	if(Fs->fat_bits != 32 || !Fs->infoSectorLoc ||
+	   Fs->infoSectorLoc == MAX32)
+		return 0;
+
+	/* info sector, and its backup */
+	for(sect = Fs->infoSectorLoc; sect < Fs->fat_start;
+	    sect += cl->backupBoot) {
+		InfoSector_t *info = (InfoSector_t *) cl->buf;
+
+		if(srcRead(cl, cl->buf, sectorBytes(cl, sect), ss) < 0)
+			return -1;
+		if(DWORD(info->signature1) == INFOSECT_SIGNATURE1 &&
+		   DWORD(info->signature2) == INFOSECT_SIGNATURE2) {
+			set_dword(info->count,
+				  cl->new.num_clus - (cl->next - 2));
+			set_dword(info->pos, cl->next - 1);
+			if(dstWrite(cl, cl->buf, sectorBytes(cl, sect), ss) < 0)
+				return -1;
+		}
+		if(!cl->backupBoot || sect > Fs->infoSectorLoc)
+			break;
+	}
+	return 0;
+}
+
+static int writeFats(Clone_t *cl)
+{
+	Fs_t *Fs = cl->Fs;
+	size_t size = (size_t) cl->new.fat_len * Fs->sector_size;
+	unsigned char *fat;
+	unsigned int i;
+	uint32_t k;
+	int ret = 0;
+
+	fat = calloc(size, 1);
+	if(!fat) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	/* the two reserved entries (media descriptor and flags) */
+	if(srcRead(cl, (char *) fat, sectorBytes(cl, Fs->fat_start),
+		   Fs->fat_bits / 4) < 0) {
+		free(fat);
+		return -1;
+	}
+	for(i=0; i < cl->nrItems; i++) {
+		CloneItem_t *item = &cl->items[i];
+		for(k=0; k < item->len - 1; k++)
+			setFatEntry(Fs, fat, item->new + k, item->new + k + 1);
+		setFatEntry(Fs, fat, item->new + k, Fs->end_fat);
+	}
+	for(i=0; i < Fs->num_fat && !ret; i++)
+		ret = dstWrite(cl, (char *) fat,
+			       sectorBytes(cl, Fs->fat_start +
+					   i * cl->new.fat_len), size);
+	free(fat);
+	return ret;
+}
+
+/* Copy the len clusters of a file, in runs of consecutive clusters */
+static int copyChain(Clone_t *cl, CloneItem_t *item)
+{
+	uint32_t clus = item->old;
+	uint32_t done = 0;
+
+	while(done < item->len) {
+		uint32_t runStart = clus;
+		uint32_t runLen = 0;
+
+		if(clus < 2 || clus > cl->Fs->num_clus + 1)
+			/* broken chain: the rest stays empty */
+			break;
+		do {
+			runLen++;
+			clus = fatDecode(cl->Fs, clus);
+		} while(done + runLen < item->len &&
+			clus == runStart + runLen &&
+			(mt_off_t) (runLen + 1) * cl->clusBytes <=
+			(mt_off_t) cl->bufSize);
+
+		if(copyRange(cl, srcCluster(cl, runStart),
+			     dstCluster(cl, item->new + done),
+			     runLen * cl->clusBytes) < 0)
+			return -1;
+		done += runLen;
+	}
+	return 0;
+}
+
+/*
+ * Second pass of shrinking: write the new reserved sectors and FATs,
+ * and copy every chain to its new place, with the directories pointing
+ * to the new places of their entries
+ */
+static int cloneShrunk(Clone_t *cl)
+{
+	Fs_t *Fs = cl->Fs;
+	unsigned int i;
+	char *data;
+	size_t size;
+
+	if(writeReserved(cl) < 0 || writeFats(cl) < 0)
+		return -1;
+
+	if(Fs->fat_bits != 32) {
+		data = readDir(cl, NULL, &size);
+		if(!data)
+			return -1;
+		scanDir(cl, data, size, 0, 0, 1);
+		if(dstWrite(cl, data, sectorBytes(cl, cl->new.dir_start),
+			    size) < 0) {
+			free(data);
+			return -1;
+		}
+		free(data);
+	}
+
+	for(i=0; i < cl->nrItems; i++) {
+		CloneItem_t *item = &cl->items[i];
+		uint32_t self;
+
+		if(!item->isDir) {
+			if(copyChain(cl, item) < 0)
+				return -1;
+			continue;
+		}
+
+		data = readDir(cl, item, &size);
+		if(!data)
+			return -1;
+		self = item->new;
+		if(Fs->fat_bits == 32 && item->old == Fs->rootCluster)
+			self = 0;
+		scanDir(cl, data, size, self, item->parent, 1);
+		if(dstWrite(cl, data, dstCluster(cl, item->new), size) < 0) {
+			free(data);
+			return -1;
+		}
+		free(data);
+	}
+	return 0;
+}
+
+/* Is st the file or device underneath the source stack? name is the
+ * source's file name, for streams which do not expose a descriptor */
+static int isSource(Stream_t *Src, const char *name, struct MT_STAT *st)
+{
+	struct MT_STAT srcSt;
+	int fd;
+
+	while(Src->Next)
+		Src = Src->Next;
+	fd = get_fd(Src);
+	if(fd >= 0) {
+		if(MT_FSTAT(fd, &srcSt) < 0)
+			return 0;
+	} else if(MT_STAT(name, &srcSt) < 0)
+		return 0;
+
+	if(S_ISBLK(st->st_mode) || S_ISCHR(st->st_mode))
+		/* several device nodes may lead to the same device */
+		return (S_ISBLK(srcSt.st_mode) || S_ISCHR(srcSt.st_mode)) &&
+			st->st_rdev == srcSt.st_rdev;
+	return st->st_dev == srcSt.st_dev && st->st_ino == srcSt.st_ino;
+}
+
+void mclone(int argc, char **argv, int type UNUSEDP) NORETURN;
+void mclone(int argc, char **argv, int type UNUSEDP)
+{
+	Clone_t cl;
+	Stream_t *Stream;
+	struct device dev;
+	struct MT_STAT st;
+	char name[EXPAND_BUF];
+	int media;
+	int shrink = 0;
+	int isRop;
+	char drive;
+	int c;
+	int ret;
+
+	if(helpFlag(argc, argv))
+		usage(0);
+	while ((c = getopt(argc, argv, "i:sh")) != EOF) {
+		switch (c) {
+			case 'i':
+				set_cmd_line_image(optarg);
+				break;
+			case 's':
+				shrink = 1;
+				break;
+			case 'h':
+				usage(0);
+			default:
+				usage(1);
+		}
+	}
+	if(argc - optind != 2 || !argv[optind][0] || argv[optind][1] != ':')
+		usage(1);
+	drive = ch_toupper(argv[optind][0]);
+
+	memset(&cl, 0, sizeof(cl));
+	cl.target = argv[optind + 1];
+
+	Stream = fs_init(drive, O_RDONLY, &isRop);
+	if(!Stream) {
+		fprintf(stderr, "Cannot initialize '%c:'\n", drive);
+		exit(1);
+	}
+	cl.Fs = (Fs_t *) Stream;
+	cl.clusBytes = (mt_off_t) cl.Fs->cluster_size * cl.Fs->sector_size;
+
+	/* a second view of the device, without the buffer cache, for the
+	 * large transfers */
+	cl.Src = find_device(drive, O_RDONLY, &dev, &cl.boot, name, &media,
+			     0, NULL);
+	if(!cl.Src)
+		exit(1);
+	cl.tot_sectors = WORD(cl.boot.boot.psect);
+	if(!cl.tot_sectors)
+		cl.tot_sectors = DWORD(cl.boot.boot.bigsect);
+	if(cl.Fs->fat_bits == 32)
+		cl.backupBoot = WORD(cl.boot.boot.ext.fat32.backupBoot);
+
+	cl.bufSize = CLONE_BUF_SIZE;
+	if((mt_off_t) cl.bufSize < cl.clusBytes)
+		cl.bufSize = (size_t) cl.clusBytes;
+	cl.buf = malloc(cl.bufSize);
+	if(!cl.buf) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	/* the layout stays the same, unless shrinking makes it smaller */
+	cl.new.tot_sectors = cl.tot_sectors;
+	cl.new.fat_len = cl.Fs->fat_len;
+	cl.new.num_clus = cl.Fs->num_clus;
+	cl.new.dir_start = cl.Fs->dir_start;
+	cl.new.clus_start = cl.Fs->clus_start;
+	if(shrink) {
+		if(plan(&cl) < 0)
+			exit(1);
+		if(calcLayout(&cl, cl.next - 2) < 0)
+			fprintf(stderr,
+				"Cannot shrink %c:, only defragmenting\n",
+				drive);
+	}
+
+	cl.fd = open(cl.target, O_WRONLY | O_CREAT | O_BINARY | O_LARGEFILE,
+		     0666);
+	if(cl.fd < 0 || MT_FSTAT(cl.fd, &st) < 0) {
+		perror(cl.target);
+		exit(1);
+	}
+	if(isSource(cl.Src, name, &st)) {
+		fprintf(stderr, "%s: cannot clone a drive onto itself\n",
+			cl.target);
+		exit(1);
+	}
+	if(S_ISREG(st.st_mode)) {
+		/* unwritten parts become holes */
+		cl.isReg = 1;
+		if(ftruncate(cl.fd, 0) < 0 ||
+		   ftruncate(cl.fd, (off_t) sectorBytes(&cl,
+							cl.new.tot_sectors)) < 0) {
+			perror(cl.target);
+			exit(1);
+		}
+	}
+
+	if(shrink)
+		ret = cloneShrunk(&cl);
+	else
+		ret = clonePlain(&cl);
+	if(!ret && close(cl.fd) < 0) {
+		perror(cl.target);
+		ret = -1;
+	}
+
+	FREE(&cl.Src);
+	FREE(&Stream);
+	exit(ret ? 1 : 0);
+}
@@ -0,0 +1,813 @@
+/*  Copyright 2026 Alain Knaff.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * mdefrag.c
+ * Defragment a FAT volume in place: files and directories are moved into
+ * contiguous runs of clusters, as low on the volume as they fit,
+ * directories first.
+ *
+ * Chains are moved in batches. For each batch, the data is first copied
+ * to free clusters and the new chains are written to the FAT. Only once
+ * this has been flushed are the directory entries pointed to the new
+ * chains, and once that has been flushed, the old chains are freed. An
+ * interruption thus leaves at worst some lost clusters behind.
+ */
+
+#include "sysincludes.h"
+#include "mtools.h"
+#include "fs.h"
+#include "fsP.h"
+#include "buffer.h"
+#include "trace_io.h"
+
+#define DEFRAG_BUF_SIZE (1024u * 1024u)
+#define DEFRAG_BATCH_SIZE (32u * 1024u * 1024u)
+#define DEFRAG_BATCH_ITEMS 1024
+#define DEFRAG_PASSES 8
+#define DECODE_CHUNK 1024
+#define RUN_BUCKETS 32
+
+#define NONE 0xffffffff
+
+/* A file or directory, with the place of its directory entry */
+typedef struct DefragItem_t {
+	uint32_t start;	/* first cluster */
+	uint32_t len;	/* number of clusters */
+	uint32_t parent; /* directory holding the entry, or NONE */
+	uint32_t entry;	/* byte offset of the entry in that directory */
+	uint32_t firstChild; /* entries of a directory, if it is one */
+	uint32_t nrChildren;
+	unsigned int isDir:1;
+	unsigned int pinned:1; /* broken, cross-linked, or FAT32 root */
+} DefragItem_t;
+
+/* A chain moved by the current batch */
+typedef struct DefragMove_t {
+	uint32_t item;
+	uint32_t from;
+	uint32_t to;
+} DefragMove_t;
+
+/* A run of free clusters */
+typedef struct Extent_t {
+	uint32_t start;
+	uint32_t len;
+} Extent_t;
+
+typedef struct RunStats_t {
+	uint32_t items;
+	uint32_t fragmented;
+	uint32_t runs[RUN_BUCKETS]; /* by log2 of the run length */
+	uint32_t clusters[RUN_BUCKETS];
+} RunStats_t;
+
+typedef struct Defrag_t {
+	Fs_t *Fs;
+	Stream_t *Dev;	/* below the buffer cache */
+	char *sector;
+	mt_off_t clusBytes;
+	uint32_t *fat;	/* in-memory copy of the FAT, kept up to date */
+	uint32_t *owner; /* item + 1, by cluster, while planning */
+
+	DefragItem_t *items;
+	uint32_t nrItems;
+	uint32_t maxItems;
+	uint32_t root; /* item of the FAT32 root directory, or NONE */
+
+	/* free extents, with a tree of their maximal lengths for finding
+	 * the first one which fits */
+	Extent_t *ext;
+	uint32_t nrExt;
+	uint32_t maxExt;
+	uint32_t *tree;
+	uint32_t treeSize;
+
+	DefragMove_t *moves;
+	uint32_t nrMoves;
+	uint32_t maxMoves;
+	uint32_t batchClusters;
+
+	/* copies to consecutive places get collected into one write */
+	char *buf;
+	size_t bufClusters;
+	uint32_t pendStart;
+	uint32_t pendLen;
+
+	uint32_t moved;
+	uint32_t movedClusters;
+} Defrag_t;
+
+static void usage(int ret) NORETURN;
+static void usage(int ret)
+{
+	fprintf(stderr, "Mtools version %s, dated %s\n",
+		mversion, mdate);
+	fprintf(stderr, "Usage: %s [-n] drive:\n", progname);
+	fprintf(stderr, "       -n only report the fragmentation\n");
+	exit(ret);
+}
+
+static void *growArray(void *array, uint32_t *max, size_t size)
+{
+	uint32_t n = *max ? 2 * *max : 256;
+	void *ret = realloc(array, n * size);
+	if(!ret) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+	*max = n;
+	return ret;
+}
+
+static mt_off_t clusterPos(Defrag_t *d, uint32_t clus)
+{
+	return (mt_off_t) d->Fs->clus_start * d->Fs->sector_size +
+		(mt_off_t) (clus - 2) * d->clusBytes;
+}
+
+static int devRead(Defrag_t *d, char *buf, mt_off_t where, size_t len)
+{
+	ssize_t r = force_pread(d->Dev, buf, where, len);
+	if(r < 0 || (size_t) r != len) {
+		perror("read");
+		return -1;
+	}
+	return 0;
+}
+
+static int devWrite(Defrag_t *d, char *buf, mt_off_t where, size_t len)
+{
+	ssize_t r = force_pwrite(d->Dev, buf, where, len);
+	if(r < 0 || (size_t) r != len) {
+		perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+static int isCluster(Defrag_t *d, uint32_t clus)
+{
+	return clus >= 2 && clus <= d->Fs->num_clus + 1;
+}
+
+/* Is this the entry of the last cluster of a chain? */
+static int isEnd(Defrag_t *d, uint32_t entry)
+{
+	return entry > d->Fs->last_fat + 1;
+}
+
+static int loadFat(Defrag_t *d)
+{
+	Fs_t *Fs = d->Fs;
+	uint32_t pos, n, i;
+
+	d->fat = calloc(Fs->num_clus + 2, sizeof(*d->fat));
+	d->owner = calloc(Fs->num_clus + 2, sizeof(*d->owner));
+	if(!d->fat || !d->owner) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for(pos = 2; pos < Fs->num_clus + 2; pos += n) {
+		n = Fs->num_clus + 2 - pos;
+		if(n > DECODE_CHUNK)
+			n = DECODE_CHUNK;
+		if(fatDecodeRange(Fs, pos, n, d->fat + pos) < 0)
+			for(i=0; i < n; i++)
+				d->fat[pos + i] = fatDecode(Fs, pos + i);
+	}
+	return 0;
+}
+
+/*
+ * Length of the run of consecutive clusters starting at *clus, at most
+ * max. Moves *clus on to the cluster following the run in the chain
+ */
+static uint32_t nextRun(Defrag_t *d, uint32_t *clus, uint32_t max)
+{
+	uint32_t start = *clus;
+	uint32_t len = 0;
+
+	do {
+		len++;
+		*clus = d->fat[*clus];
+	} while(len < max && *clus == start + len);
+	return len;
+}
+
+/* Count the runs of the chain of an item, and add them to stats */
+static uint32_t countRuns(Defrag_t *d, DefragItem_t *item, RunStats_t *stats)
+{
+	uint32_t clus = item->start;
+	uint32_t done = 0, runs = 0;
+
+	while(done < item->len && isCluster(d, clus)) {
+		uint32_t len = nextRun(d, &clus, item->len - done);
+		unsigned int b;
+
+		done += len;
+		runs++;
+		if(!stats)
+			continue;
+		for(b=0; b < RUN_BUCKETS - 1 && len >> (b + 1); b++);
+		stats->runs[b]++;
+		stats->clusters[b] += len;
+	}
+	if(stats) {
+		stats->items++;
+		if(runs > 1)
+			stats->fragmented++;
+	}
+	return runs;
+}
+
+static void gatherStats(Defrag_t *d, RunStats_t *stats)
+{
+	uint32_t i;
+
+	memset(stats, 0, sizeof(*stats));
+	for(i=0; i < d->nrItems; i++)
+		if(d->items[i].len)
+			countRuns(d, &d->items[i], stats);
+}
+
+static void report(const char *when, RunStats_t *stats)
+{
+	unsigned int b;
+
+	printf("%s: %u files and directories, %u of them fragmented\n",
+	       when, stats->items, stats->fragmented);
+	printf("%12s %10s %10s\n", "run length", "runs", "clusters");
+	for(b=0; b < RUN_BUCKETS; b++) {
+		char range[24];
+
+		if(!stats->runs[b])
+			continue;
+		if(b)
+			sprintf(range, "%u-%u", 1u << b, (2u << b) - 1);
+		else
+			strcpy(range, "1");
+		printf("%12s %10u %10u\n", range,
+		       stats->runs[b], stats->clusters[b]);
+	}
+}
+
+/* Pin an item, and whatever already owns a cluster of its chain */
+static void pinOwner(Defrag_t *d, uint32_t clus)
+{
+	d->items[d->owner[clus] - 1].pinned = 1;
+}
+
+/*
+ * Add the chain starting at start, and follow it. Chains which are
+ * broken, or share clusters with others, are left where they are
+ */
+static int addItem(Defrag_t *d, uint32_t start, uint32_t parent,
+		   uint32_t entry, int isDir)
+{
+	DefragItem_t *item;
+	uint32_t self = d->nrItems;
+	uint32_t clus = start;
+
+	if(d->owner[start]) {
+		/* several entries pointing to the same chain */
+		pinOwner(d, start);
+		return 0;
+	}
+	if(d->nrItems == d->maxItems) {
+		DefragItem_t *items = growArray(d->items, &d->maxItems,
+						sizeof(*items));
+		if(!items)
+			return -1;
+		d->items = items;
+	}
+	item = &d->items[d->nrItems++];
+	memset(item, 0, sizeof(*item));
+	item->start = start;
+	item->parent = parent;
+	item->entry = entry;
+	item->isDir = isDir != 0;
+
+	while(1) {
+		if(d->owner[clus]) {
+			pinOwner(d, clus);
+			item->pinned = 1;
+			break;
+		}
+		d->owner[clus] = self + 1;
+		item->len++;
+		clus = d->fat[clus];
+		if(isEnd(d, clus))
+			break;
+		if(!isCluster(d, clus)) {
+			item->pinned = 1;
+			break;
+		}
+	}
+	return 0;
+}
+
+static uint32_t getStartCluster(Defrag_t *d, struct directory *dir)
+{
+	uint32_t start = START(dir);
+	if(d->Fs->fat_bits == 32)
+		start |= (uint32_t) STARTHI(dir) << 16;
+	return start;
+}
+
+static void setStartCluster(Defrag_t *d, struct directory *dir, uint32_t start)
+{
+	set_word(dir->start, (unsigned short) (start & 0xffff));
+	if(d->Fs->fat_bits == 32)
+		set_word(dir->startHi, (unsigned short) (start >> 16));
+}
+
+/* Add the entries of a directory (NONE for the fixed root directory) */
+static int scanDir(Defrag_t *d, uint32_t self, char *data, size_t len)
+{
+	uint32_t first = d->nrItems;
+	size_t off;
+
+	for(off = 0; off + sizeof(struct directory) <= len;
+	    off += sizeof(struct directory)) {
+		struct directory *dir = (struct directory *) (data + off);
+		uint32_t start;
+
+		if(!dir->name[0])
+			break;
+		if(dir->name[0] == DELMARK ||
+		   dir->attr == 0x0f || (dir->attr & ATTR_LABEL) ||
+		   !strncmp(dir->name, ".       ", 8) ||
+		   !strncmp(dir->name, "..      ", 8))
+			continue;
+		start = getStartCluster(d, dir);
+		if(!isCluster(d, start))
+			continue;
+		if(addItem(d, start, self, (uint32_t) off,
+			   (dir->attr & ATTR_DIR) != 0) < 0)
+			return -1;
+	}
+	if(self != NONE) {
+		d->items[self].firstChild = first;
+		d->items[self].nrChildren = d->nrItems - first;
+	}
+	return 0;
+}
+
+/* Read a directory, in runs of consecutive clusters */
+static char *readDir(Defrag_t *d, uint32_t self, size_t *size)
+{
+	Fs_t *Fs = d->Fs;
+	DefragItem_t *item = self == NONE ? NULL : &d->items[self];
+	char *data;
+	int ret = 0;
+
+	if(item)
+		*size = (size_t) (item->len * d->clusBytes);
+	else
+		*size = (size_t) Fs->dir_len * Fs->sector_size;
+	data = calloc(*size ? *size : 1, 1);
+	if(!data) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+	if(item) {
+		uint32_t clus = item->start;
+		uint32_t done = 0;
+
+		while(!ret && done < item->len && isCluster(d, clus)) {
+			uint32_t runStart = clus;
+			uint32_t len = nextRun(d, &clus, item->len - done);
+			ret = devRead(d, data + done * d->clusBytes,
+				      clusterPos(d, runStart),
+				      (size_t) (len * d->clusBytes));
+			done += len;
+		}
+	} else
+		ret = devRead(d, data,
+			      (mt_off_t) Fs->dir_start * Fs->sector_size,
+			      *size);
+	if(ret < 0) {
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+/* Walk the directory tree, breadth first */
+static int plan(Defrag_t *d)
+{
+	Fs_t *Fs = d->Fs;
+	uint32_t i;
+	char *data;
+	size_t size;
+	int ret;
+
+	d->root = NONE;
+	if(Fs->fat_bits == 32) {
+		if(!isCluster(d, Fs->rootCluster)) {
+			fprintf(stderr, "Bad root directory cluster\n");
+			return -1;
+		}
+		if(addItem(d, Fs->rootCluster, NONE, 0, 1) < 0)
+			return -1;
+		/* would need the boot sector(s) to be rewritten */
+		d->root = 0;
+		d->items[0].pinned = 1;
+	} else {
+		data = readDir(d, NONE, &size);
+		if(!data)
+			return -1;
+		ret = scanDir(d, NONE, data, size);
+		free(data);
+		if(ret < 0)
+			return -1;
+	}
+
+	/* items get appended while we go */
+	for(i=0; i < d->nrItems; i++) {
+		if(!d->items[i].isDir)
+			continue;
+		data = readDir(d, i, &size);
+		if(!data)
+			return -1;
+		ret = scanDir(d, i, data, size);
+		free(data);
+		if(ret < 0)
+			return -1;
+	}
+	free(d->owner);
+	d->owner = NULL;
+	return 0;
+}
+
+static void updateNode(Defrag_t *d, uint32_t node)
+{
+	uint32_t left = d->tree[2 * node];
+	uint32_t right = d->tree[2 * node + 1];
+
+	d->tree[node] = left > right ? left : right;
+}
+
+/* Index the runs of free clusters */
+static int buildExtents(Defrag_t *d)
+{
+	uint32_t clus, i, node;
+
+	d->nrExt = 0;
+	for(clus = 2; clus < d->Fs->num_clus + 2; clus++) {
+		if(d->fat[clus])
+			continue;
+		if(d->nrExt &&
+		   d->ext[d->nrExt - 1].start + d->ext[d->nrExt - 1].len == clus) {
+			d->ext[d->nrExt - 1].len++;
+			continue;
+		}
+		if(d->nrExt == d->maxExt) {
+			Extent_t *ext = growArray(d->ext, &d->maxExt,
+						  sizeof(*ext));
+			if(!ext)
+				return -1;
+			d->ext = ext;
+		}
+		d->ext[d->nrExt].start = clus;
+		d->ext[d->nrExt].len = 1;
+		d->nrExt++;
+	}
+
+	for(d->treeSize = 1; d->treeSize < d->nrExt; d->treeSize <<= 1);
+	free(d->tree);
+	d->tree = calloc(2 * d->treeSize, sizeof(*d->tree));
+	if(!d->tree) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for(i=0; i < d->nrExt; i++)
+		d->tree[d->treeSize + i] = d->ext[i].len;
+	for(node = d->treeSize - 1; node; node--)
+		updateNode(d, node);
+	return 0;
+}
+
+/* The lowest free extent with room for len clusters */
+static uint32_t firstFit(Defrag_t *d, uint32_t len)
+{
+	uint32_t node = 1;
+
+	if(!d->nrExt || d->tree[1] < len)
+		return NONE;
+	while(node < d->treeSize)
+		node = d->tree[2 * node] >= len ? 2 * node : 2 * node + 1;
+	return node - d->treeSize;
+}
+
+/* Take len clusters from the front of an extent */
+static uint32_t takeExtent(Defrag_t *d, uint32_t e, uint32_t len)
+{
+	uint32_t start = d->ext[e].start;
+	uint32_t node = d->treeSize + e;
+
+	d->ext[e].start += len;
+	d->ext[e].len -= len;
+	d->tree[node] = d->ext[e].len;
+	for(node >>= 1; node; node >>= 1)
+		updateNode(d, node);
+	return start;
+}
+
+static int flushPending(Defrag_t *d)
+{
+	int ret;
+
+	if(!d->pendLen)
+		return 0;
+	ret = devWrite(d, d->buf, clusterPos(d, d->pendStart),
+		       (size_t) (d->pendLen * d->clusBytes));
+	d->pendLen = 0;
+	return ret;
+}
+
+/*
+ * Copy the chain of an item to to. The runs are read one by one, but
+ * written together with those of any items going right behind
+ */
+static int copyItem(Defrag_t *d, DefragItem_t *item, uint32_t to)
+{
+	uint32_t clus = item->start;
+	uint32_t done = 0;
+
+	if(d->pendLen && d->pendStart + d->pendLen != to &&
+	   flushPending(d) < 0)
+		return -1;
+	while(done < item->len) {
+		uint32_t runStart = clus;
+		uint32_t len = item->len - done;
+
+		if(d->pendLen == d->bufClusters && flushPending(d) < 0)
+			return -1;
+		if(!d->pendLen)
+			d->pendStart = to + done;
+		maximize(len, (uint32_t) d->bufClusters - d->pendLen);
+		len = nextRun(d, &clus, len);
+		if(devRead(d, d->buf + d->pendLen * d->clusBytes,
+			   clusterPos(d, runStart),
+			   (size_t) (len * d->clusBytes)) < 0)
+			return -1;
+		d->pendLen += len;
+		done += len;
+	}
+	return 0;
+}
+
+/* Point the entry at offset off of a directory to start. If name is
+ * given, the entry is only changed if it has this name */
+static int patchEntry(Defrag_t *d, uint32_t dir, uint32_t off,
+		      uint32_t start, const char *name)
+{
+	Fs_t *Fs = d->Fs;
+	mt_off_t pos;
+	struct directory *entry;
+	size_t inSector;
+
+	if(dir == NONE)
+		pos = (mt_off_t) Fs->dir_start * Fs->sector_size + off;
+	else {
+		uint32_t clus = d->items[dir].start;
+		uint32_t k;
+
+		for(k = off / (uint32_t) d->clusBytes; k; k--)
+			clus = d->fat[clus];
+		if(!isCluster(d, clus))
+			return 0;
+		pos = clusterPos(d, clus) + off % (uint32_t) d->clusBytes;
+	}
+	inSector = (size_t) (pos % Fs->sector_size);
+	pos -= (mt_off_t) inSector;
+	if(devRead(d, d->sector, pos, Fs->sector_size) < 0)
+		return -1;
+	entry = (struct directory *) (d->sector + inSector);
+	if(name && strncmp(entry->name, name, 8))
+		return 0;
+	setStartCluster(d, entry, start);
+	return devWrite(d, d->sector, pos, Fs->sector_size);
+}
+
+/*
+ * Make the chains of the current batch official: point the directories
+ * to them, and free the old ones, flushing after each step
+ */
+static int commitBatch(Defrag_t *d)
+{
+	Stream_t *Fs = (Stream_t *) d->Fs;
+	uint32_t i, c;
+
+	if(!d->nrMoves)
+		return 0;
+	if(flushPending(d) < 0 || FLUSH(Fs) < 0)
+		return -1;
+
+	for(i=0; i < d->nrMoves; i++)
+		d->items[d->moves[i].item].start = d->moves[i].to;
+	for(i=0; i < d->nrMoves; i++) {
+		DefragItem_t *item = &d->items[d->moves[i].item];
+
+		if(patchEntry(d, item->parent, item->entry, item->start,
+			      NULL) < 0)
+			return -1;
+		if(!item->isDir)
+			continue;
+		if(patchEntry(d, d->moves[i].item, 0, item->start,
+			      ".       ") < 0)
+			return -1;
+		for(c = item->firstChild;
+		    c < item->firstChild + item->nrChildren; c++)
+			if(d->items[c].isDir &&
+			   patchEntry(d, c, sizeof(struct directory),
+				      item->start, "..      ") < 0)
+				return -1;
+	}
+	if(FLUSH(Fs) < 0)
+		return -1;
+
+	for(i=0; i < d->nrMoves; i++) {
+		uint32_t clus = d->moves[i].from;
+		uint32_t k;
+
+		for(k=0; k < d->items[d->moves[i].item].len; k++) {
+			uint32_t next = d->fat[clus];
+			d->fat[clus] = 0;
+			fatDeallocate(d->Fs, clus);
+			clus = next;
+		}
+	}
+	if(FLUSH(Fs) < 0)
+		return -1;
+
+	d->nrMoves = 0;
+	d->batchClusters = 0;
+	return buildExtents(d);
+}
+
+/* Write a contiguous chain */
+static void writeChain(Defrag_t *d, uint32_t start, uint32_t len)
+{
+	uint32_t k;
+
+	for(k=0; k < len; k++) {
+		uint32_t next = k + 1 < len ? start + k + 1 : d->Fs->end_fat;
+		d->fat[start + k] = next;
+		fatAllocate(d->Fs, start + k, next);
+	}
+}
+
+/*
+ * Move the fragmented directories (or files) to the first free extent
+ * which fits them, and the contiguous ones too if that is lower. Returns
+ * the number of moves
+ */
+static int defragPass(Defrag_t *d, int dirs)
+{
+	uint32_t i;
+	int moved = 0;
+
+	for(i=0; i < d->nrItems; i++) {
+		DefragItem_t *item = &d->items[i];
+		uint32_t e, to;
+
+		if(item->pinned || !item->len || item->isDir != (dirs != 0))
+			continue;
+		e = firstFit(d, item->len);
+		if(e == NONE ||
+		   (d->ext[e].start > item->start &&
+		    countRuns(d, item, NULL) == 1))
+			continue;
+
+		to = takeExtent(d, e, item->len);
+		if(copyItem(d, item, to) < 0)
+			return -1;
+		writeChain(d, to, item->len);
+
+		if(d->nrMoves == d->maxMoves) {
+			DefragMove_t *moves = growArray(d->moves, &d->maxMoves,
+							sizeof(*moves));
+			if(!moves)
+				return -1;
+			d->moves = moves;
+		}
+		d->moves[d->nrMoves].item = i;
+		d->moves[d->nrMoves].from = item->start;
+		d->moves[d->nrMoves].to = to;
+		d->nrMoves++;
+		d->batchClusters += item->len;
+		d->moved++;
+		d->movedClusters += item->len;
+		moved++;
+
+		if((d->nrMoves >= DEFRAG_BATCH_ITEMS ||
+		    d->batchClusters * d->clusBytes >= DEFRAG_BATCH_SIZE) &&
+		   commitBatch(d) < 0)
+			return -1;
+	}
+	return moved;
+}
+
+static int defrag(Defrag_t *d)
+{
+	int pass;
+
+	if(buildExtents(d) < 0)
+		return -1;
+	/* space freed by one pass may let the next one pack tighter */
+	for(pass = 0; pass < DEFRAG_PASSES; pass++) {
+		int dirs = defragPass(d, 1);
+		int files = dirs < 0 ? -1 : defragPass(d, 0);
+
+		if(files < 0 || commitBatch(d) < 0)
+			return -1;
+		if(!dirs && !files)
+			break;
+	}
+	return 0;
+}
+
+void mdefrag(int argc, char **argv, int type UNUSEDP) NORETURN;
+void mdefrag(int argc, char **argv, int type UNUSEDP)
+{
+	Defrag_t d;
+	Stream_t *Stream;
+	RunStats_t stats;
+	int dryRun = 0;
+	char drive;
+	int c;
+	int ret = 0;
+
+	if(helpFlag(argc, argv))
+		usage(0);
+	while ((c = getopt(argc, argv, "i:nh")) != EOF) {
+		switch (c) {
+			case 'i':
+				set_cmd_line_image(optarg);
+				break;
+			case 'n':
+				dryRun = 1;
+				break;
+			case 'h':
+				usage(0);
+			default:
+				usage(1);
+		}
+	}
+	if(argc - optind != 1 || !argv[optind][0] || argv[optind][1] != ':')
+		usage(1);
+	drive = ch_toupper(argv[optind][0]);
+
+	memset(&d, 0, sizeof(d));
+	Stream = fs_init(drive, dryRun ? O_RDONLY : O_RDWR, NULL);
+	if(!Stream) {
+		fprintf(stderr, "Cannot initialize '%c:'\n", drive);
+		exit(1);
+	}
+	d.Fs = (Fs_t *) Stream;
+	d.clusBytes = (mt_off_t) d.Fs->cluster_size * d.Fs->sector_size;
+
+	/* the data goes around the buffer cache, which only ever gets to
+	 * see the FAT from now on */
+	d.Dev = buf_bypass(trace_io_skip(d.Fs->head.Next));
+	d.bufClusters = (size_t) (DEFRAG_BUF_SIZE / d.clusBytes);
+	if(!d.bufClusters)
+		d.bufClusters = 1;
+	d.buf = malloc((size_t) (d.bufClusters * d.clusBytes));
+	d.sector = malloc(d.Fs->sector_size);
+	if(!d.Dev || !d.buf || !d.sector) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	if(loadFat(&d) < 0 || plan(&d) < 0)
+		exit(1);
+	gatherStats(&d, &stats);
+	report("Before", &stats);
+
+	if(!dryRun) {
+		ret = defrag(&d);
+		gatherStats(&d, &stats);
+		report("After", &stats);
+		printf("%u chains moved, %u clusters copied\n",
+		       d.moved, d.movedClusters);
+	}
+
+	FREE(&Stream);
+	exit(ret ? 1 : 0);
+}
@@ -25,6 +25,7 @@
 #include "stream.h"
 #include "mainloop.h"
 #include "fs.h"
+#include "fsP.h"
 #include "file.h"
 #include "file_name.h"
 
@@ -34,27 +35,38 @@ typedef struct Arg_t {
 } Arg_t;
 
 /**
- * Wiped the given entry
+ * Wiped the given entry. The long name slots are marked as deleted in
+ * one read and one write, rather than one slot at a time
  */
 void wipeEntry(direntry_t *entry)
 {
-	direntry_t longNameEntry;
-	unsigned int i;
-	initializeDirentry(&longNameEntry, entry->Dir);
-	for(i=entry->beginSlot; i< entry->endSlot; i++) {
-	    int error;
-	    setEntryToPos(&longNameEntry,i);
-	    dir_read(&longNameEntry, &error);
-	    if(error)
-		break;
-	    longNameEntry.dir.name[0] = (char) DELMARK;
-	    dir_write(&longNameEntry);
+	char buf[32 * MDIR_SIZE];
+	unsigned int pos, n, i;
+	ssize_t got;
+
+	for(pos=entry->beginSlot; pos < entry->endSlot; pos += n) {
+		n = entry->endSlot - pos;
+		if(n > 32)
+			n = 32;
+		got = force_pread(entry->Dir, buf,
+				  (mt_off_t) pos * MDIR_SIZE, n * MDIR_SIZE);
+		if(got < MDIR_SIZE)
+			break;
+		n = (unsigned int) got / MDIR_SIZE;
+		for(i=0; i < n; i++)
+			buf[i * MDIR_SIZE] = DELMARK;
+		force_pwrite(entry->Dir, buf,
+			     (mt_off_t) pos * MDIR_SIZE, n * MDIR_SIZE);
 	}
 	entry->dir.name[0] = (char) DELMARK;
 	dir_write(entry);
 }
 
-static int del_entry(direntry_t *entry, MainParam_t *mp)
+/*
+ * Frees the chain of entry, or, if map is given, all the clusters marked
+ * in it (see del_tree)
+ */
+static int del_entry(direntry_t *entry, MainParam_t *mp, unsigned char *map)
 {
 	Arg_t *arg=(Arg_t *) mp->arg;
 
@@ -79,13 +91,120 @@ static int del_entry(direntry_t *entry, MainParam_t *mp)
 				     progname, tmp))
 			return ERROR_ONE;
 	}
-	if (fatFreeWithDirentry(entry))
+	if (map)
+		fatFreeMarked((Fs_t *) GetFs(entry->Dir), map);
+	else if (fatFreeWithDirentry(entry))
 		return ERROR_ONE;
 
 	wipeEntry(entry);
 	return GOT_ONE;
 }
 
+/*
+ * Marks in map the chains of everything below the directory Dir. The
+ * directory is read a cluster at a time, without decoding the names.
+ * Returns 1 if the tree holds read only or system entries, which need
+ * confirmation one by one, and -1 on errors
+ */
+static int markTree(Stream_t *Dir, Fs_t *Fs, unsigned char *map)
+{
+	size_t bufSize = getClusterBytes(Fs);
+	char *buf;
+	struct directory *dir;
+	direntry_t subEntry;
+	Stream_t *SubDir;
+	unsigned int pos, i, n, start;
+	ssize_t got;
+	int ret = 0;
+
+	buf = malloc(bufSize);
+	if(!buf) {
+		perror("markTree: malloc");
+		return -1;
+	}
+	for(pos=0; !ret; pos += n) {
+		got = force_pread(Dir, buf, (mt_off_t) pos * MDIR_SIZE, bufSize);
+		if(got < 0) {
+			ret = -1;
+			break;
+		}
+		n = (unsigned int) got / MDIR_SIZE;
+		for(i=0; i < n && !ret; i++) {
+			dir = (struct directory *) (buf + i * MDIR_SIZE);
+			if(dir->name[0] == ENDMARK)
+				break;
+			if(dir->name[0] == DELMARK ||
+			   (dir->attr & ATTR_LABEL) ||
+			   (dir->name[0] == '.' &&
+			    (dir->name[1] == ' ' || dir->name[1] == '.')))
+				continue;
+			if(got_signal) {
+				ret = -1;
+				break;
+			}
+			if(dir->attr & (ATTR_READONLY | ATTR_SYSTEM)) {
+				ret = 1;
+				break;
+			}
+			start = getStart(Dir, dir);
+			if(start < 2 || start > Fs->num_clus + 1 ||
+			   (map[start >> 3] & (1 << (start & 7))))
+				continue; /* empty, bad, or cross-linked */
+			fatMarkChain(Fs, start, map);
+			if(!(dir->attr & ATTR_DIR))
+				continue;
+			initializeDirentry(&subEntry, Dir);
+			setEntryToPos(&subEntry, pos + i);
+			subEntry.dir = *dir;
+			SubDir = OpenFileByDirentry(&subEntry);
+			if(!SubDir) {
+				ret = -1;
+				break;
+			}
+			ret = markTree(SubDir, Fs, map);
+			FREE(&SubDir);
+		}
+		if(i < n || !n)
+			break;
+	}
+	free(buf);
+	return ret;
+}
+
+/*
+ * Deletes the directory entry and everything below it at once: the
+ * chains of the whole tree are collected in a cluster bitmap, and then
+ * freed in a single sweep over the FAT. Only entry itself is wiped, the
+ * rest of the tree is left as is, as its clusters are going away.
+ * Returns -1 if the tree must be deleted entry by entry instead
+ */
+static int del_tree(direntry_t *entry, MainParam_t *mp)
+{
+	Fs_t *Fs = (Fs_t *) GetFs(entry->Dir);
+	unsigned char *map;
+	Stream_t *SubDir;
+	unsigned int start = getStart(entry->Dir, &entry->dir);
+	int ret;
+
+	if(start < 2 || start > Fs->num_clus + 1)
+		return -1;
+	map = calloc((Fs->num_clus + 9) / 8, 1);
+	if(!map)
+		return -1;
+	fatMarkChain(Fs, start, map);
+	SubDir = OpenFileByDirentry(entry);
+	ret = SubDir ? markTree(SubDir, Fs, map) : -1;
+	FREE(&SubDir);
+	if(ret == 0)
+		ret = del_entry(entry, mp, map);
+	else if(ret < 0)
+		ret = ERROR_ONE;
+	else
+		ret = -1;
+	free(map);
+	return ret;
+}
+
 static int del_file(direntry_t *entry, MainParam_t *mp)
 {
 	char shortname[13];
@@ -99,6 +218,13 @@ static int del_file(direntry_t *entry, MainParam_t *mp)
 	sonmp = *mp;
 	sonmp.arg = mp->arg;
 
+	if (arg->deltype == 2 && !arg->verbose &&
+	    IS_DIR(entry) && !isRootEntry(entry)) {
+		ret = del_tree(entry, mp);
+		if(ret >= 0)
+			return ret;
+	}
+
 	r = 0;
 	if (IS_DIR(entry)){
 		/* a directory */
@@ -136,7 +262,7 @@ static int del_file(direntry_t *entry, MainParam_t *mp)
 		if(ret)
 			return ret;
 	}
-	return del_entry(entry, mp);
+	return del_entry(entry, mp, NULL);
 }
 
 static void usage(int ret) NORETURN;
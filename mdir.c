@@ -186,7 +186,7 @@ static inline int print_volume_label(Stream_t *Dir, char drive)
 	char longname[VBUFSIZE];
 	int r;
 
-	RootDir = OpenRoot(Stream);
+	RootDir = OpenRoot(Dir);
 	if(concise)
 		return 0;
 
@@ -316,7 +316,9 @@ static int enterDirectory(Stream_t *Dir)
 {
 	int r;
 	char drive;
-	if(currentDir == Dir)
+	/* aliased drives share their directories, but get listed
+	 * separately */
+	if(currentDir == Dir && currentDrive == getDrive(Dir))
 		return 0; /* still the same directory */
 
 	leaveDirectory(0);
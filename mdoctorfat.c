@@ -62,13 +62,465 @@ static int unix_doctorfat(MainParam_t *mp UNUSEDP)
 	return ERROR_ONE;
 }
 
+/*
+ * Consistency check (-c): decode the whole FAT once, then follow the
+ * chain of each directory entry, recording which clusters are owned.
+ * Chains running out of range, into free or bad clusters, or into
+ * clusters already owned by another file are reported, as are files
+ * whose size does not match their chain, lost clusters, divergent FAT
+ * copies and a wrong free cluster count. With -r, these are repaired
+ */
+
+typedef struct Check_t {
+	Fs_t *Fs;
+	uint32_t *fat;		/* whole FAT, decoded */
+	unsigned char *owned;	/* clusters belonging to some entry */
+	uint32_t clusterBytes;
+	int repair;
+	int unscanned;		/* some directory could not be read */
+	unsigned long errors;
+	unsigned long files;
+	unsigned long dirs;
+} Check_t;
+
+#define TEST_BIT(map, n) ((map)[(n) >> 3] & (1 << ((n) & 7)))
+#define SET_BIT(map, n) ((map)[(n) >> 3] |= (unsigned char) (1 << ((n) & 7)))
+#define CLEAR_BIT(map, n) \
+	((map)[(n) >> 3] &= (unsigned char) ~(1 << ((n) & 7)))
+
+/* Directory entries are read this many at a time */
+#define DIR_CHUNK 512
+
+static void setEntry(Check_t *c, uint32_t cluster, uint32_t value)
+{
+	fatEncode(c->Fs, cluster, value);
+	c->fat[cluster] = value;
+}
+
+static int decodeWholeFat(Check_t *c)
+{
+	Fs_t *Fs = c->Fs;
+	uint32_t i, n;
+	uint32_t end = Fs->num_clus + 2;
+
+	c->fat = malloc(end * sizeof(uint32_t));
+	if(!c->fat)
+		return -1;
+	c->fat[0] = c->fat[1] = 0;
+	for(i = 2; i < end; i += n) {
+		n = end - i;
+		if(n > 4096)
+			n = 4096;
+		if(fatDecodeRange(Fs, i, n, c->fat + i) < 0) {
+			/* some entry is unreadable, or 1. Take the raw
+			 * values, the chain checks will deal with them */
+			uint32_t j;
+			for(j=0; j < n; j++)
+				c->fat[i+j] = Fs->fat_decode(Fs, i+j);
+		}
+	}
+	return 0;
+}
+
+/* Compare each FAT copy to the primary one, on disk */
+static void checkFatCopies(Check_t *c)
+{
+	Fs_t *Fs = c->Fs;
+	size_t len;
+	char *primary, *copy;
+	uint32_t done, n, fat;
+
+	if(Fs->num_fat < 2 || !Fs->writeAllFats)
+		/* FAT32 with mirroring disabled: the copies are allowed
+		 * to differ */
+		return;
+
+	len = (size_t) 256 * Fs->sector_size;
+	primary = malloc(len);
+	copy = malloc(len);
+	if(!primary || !copy)
+		goto exit_0;
+
+	for(fat = 0; fat < Fs->num_fat; fat++) {
+		uint32_t differ = 0;
+		if(fat == Fs->primaryFat)
+			continue;
+		for(done = 0; done < Fs->fat_len; done += n) {
+			uint32_t i;
+			n = Fs->fat_len - done;
+			if(n > 256)
+				n = 256;
+			if(force_pread(Fs->head.Next, primary,
+				       sectorsToBytes(Fs, Fs->fat_start +
+						      Fs->primaryFat *
+						      Fs->fat_len + done),
+				       n * Fs->sector_size) !=
+			   (ssize_t) (n * Fs->sector_size) ||
+			   force_pread(Fs->head.Next, copy,
+				       sectorsToBytes(Fs, Fs->fat_start +
+						      fat * Fs->fat_len + done),
+				       n * Fs->sector_size) !=
+			   (ssize_t) (n * Fs->sector_size)) {
+				printf("Could not read FAT sectors %u-%u\n",
+				       done, done + n - 1);
+				c->errors++;
+				continue;
+			}
+			if(!memcmp(primary, copy, n * Fs->sector_size))
+				continue;
+			for(i = 0; i < n; i++)
+				if(memcmp(primary + i * Fs->sector_size,
+					  copy + i * Fs->sector_size,
+					  Fs->sector_size))
+					differ++;
+		}
+		if(differ) {
+			printf("FAT copy %u differs from primary FAT in %u sectors\n",
+			       fat, differ);
+			c->errors++;
+			if(c->repair && fatMarkAllDirty(Fs) < 0)
+				printf("Could not load the primary FAT\n");
+		}
+	}
+ exit_0:
+	free(primary);
+	free(copy);
+}
+
+/* Whether cluster is among the first n clusters of the chain at first */
+static int inChain(Check_t *c, uint32_t first, uint32_t n, uint32_t cluster)
+{
+	uint32_t i;
+	for(i=0; i < n; i++, first = c->fat[first])
+		if(first == cluster)
+			return 1;
+	return 0;
+}
+
+/*
+ * Follow a chain, marking its clusters as owned. Returns the number of
+ * clusters in its valid part, and sets *broken if it had to be cut
+ * short. A cluster is only part of the valid part if it is in range,
+ * in use, not bad and not yet owned. With repair, the chain is
+ * terminated after its valid part.
+ */
+static uint32_t checkChain(Check_t *c, const char *path, uint32_t first,
+			   int *broken)
+{
+	Fs_t *Fs = c->Fs;
+	uint32_t cur = first;
+	uint32_t last = 0;
+	uint32_t n = 0;
+
+	*broken = 1;
+	while(1) {
+		uint32_t next;
+
+		if(cur < 2 || cur > Fs->num_clus + 1) {
+			printf("%s: cluster %u out of range\n", path, cur);
+			break;
+		}
+		if(TEST_BIT(c->owned, cur)) {
+			if(inChain(c, first, n, cur))
+				printf("%s: chain loops back to cluster %u\n",
+				       path, cur);
+			else
+				printf("%s: cross-linked at cluster %u\n",
+				       path, cur);
+			break;
+		}
+
+		next = c->fat[cur];
+		if(next == 0) {
+			printf("%s: chain runs into free cluster %u\n",
+			       path, cur);
+			break;
+		}
+		if(next == Fs->last_fat + 1) {
+			printf("%s: chain runs into bad cluster %u\n",
+			       path, cur);
+			break;
+		}
+		SET_BIT(c->owned, cur);
+		n++;
+		last = cur;
+		if(next >= Fs->last_fat) {
+			*broken = 0;
+			return n;
+		}
+		cur = next;
+	}
+
+	c->errors++;
+	if(c->repair && last)
+		setEntry(c, last, Fs->end_fat);
+	return n;
+}
+
+/* Release the clusters of a chain from the owned map, from cluster
+ * number "from" onwards, so that they are counted as lost */
+static void disownChain(Check_t *c, uint32_t cluster, uint32_t n,
+			uint32_t from)
+{
+	uint32_t i;
+	for(i=0; i < n; i++) {
+		if(i >= from)
+			CLEAR_BIT(c->owned, cluster);
+		cluster = c->fat[cluster];
+	}
+}
+
+static void checkFileSize(Check_t *c, direntry_t *entry, const char *path,
+			  uint32_t first, uint32_t n)
+{
+	Fs_t *Fs = c->Fs;
+	uint32_t size = FILE_SIZE(&entry->dir);
+	uint32_t needed = (uint32_t)
+		(((mt_off_t) size + c->clusterBytes - 1) / c->clusterBytes);
+	uint32_t i, cluster;
+
+	if(n == needed)
+		return;
+	printf("%s: size %u needs %u clusters, but chain has %u\n",
+	       path, size, needed, n);
+	c->errors++;
+	if(!c->repair)
+		return;
+
+	if(n == 0 && first) {
+		/* not even the first cluster is usable */
+		set_dword(entry->dir.size, 0);
+		set_word(entry->dir.start, 0);
+		set_word(entry->dir.startHi, 0);
+	} else if(n < needed) {
+		/* size too big: shrink it to what the chain holds */
+		set_dword(entry->dir.size, n * c->clusterBytes);
+	} else if(needed == 0) {
+		/* empty file with clusters: drop them */
+		disownChain(c, first, n, 0);
+		set_word(entry->dir.start, 0);
+		set_word(entry->dir.startHi, 0);
+	} else {
+		/* chain too long: cut it after the last needed cluster */
+		disownChain(c, first, n, needed);
+		cluster = first;
+		for(i=1; i < needed; i++)
+			cluster = c->fat[cluster];
+		setEntry(c, cluster, Fs->end_fat);
+	}
+	dir_write(entry);
+}
+
+/*
+ * Check the entries of a directory, and what they point to. Only the
+ * first maxEntries entries are read: those in the valid part of the
+ * directory's chain
+ */
+static void checkDir(Check_t *c, Stream_t *Dir, const char *path,
+		     unsigned int maxEntries)
+{
+	char *buf;
+	unsigned int pos = 0;
+	ssize_t got;
+
+	buf = malloc(DIR_CHUNK * MDIR_SIZE);
+	if(!buf) {
+		printOom();
+		exit(1);
+	}
+
+	while(pos < maxEntries &&
+	      (got = force_pread(Dir, buf, (mt_off_t) pos * MDIR_SIZE,
+				 (maxEntries - pos < DIR_CHUNK ?
+				  maxEntries - pos : DIR_CHUNK) *
+				 MDIR_SIZE)) >= MDIR_SIZE) {
+		unsigned int i, nr = (unsigned int) got / MDIR_SIZE;
+
+		for(i=0; i < nr; i++, pos++) {
+			direntry_t entry;
+			struct directory *dir = (struct directory *)
+				(buf + i * MDIR_SIZE);
+			char name[13], *childPath;
+			uint32_t first, n;
+			int broken, j, k;
+
+			if(dir->name[0] == ENDMARK)
+				goto done;
+			if(dir->name[0] == DELMARK || dir->attr == 0x0f ||
+			   (dir->attr & ATTR_LABEL))
+				continue;
+			if(!strncmp(dir->name, ".       ", 8) ||
+			   !strncmp(dir->name, "..      ", 8))
+				continue;
+
+			/* short name, for the messages */
+			for(j=0, k=0; j < 8 && dir->name[j] != ' '; j++)
+				name[k++] = dir->name[j];
+			if(dir->ext[0] != ' ') {
+				name[k++] = '.';
+				for(j=0; j < 3 && dir->ext[j] != ' '; j++)
+					name[k++] = dir->ext[j];
+			}
+			name[k] = '\0';
+			childPath = malloc(strlen(path) + k + 2);
+			if(!childPath) {
+				printOom();
+				exit(1);
+			}
+			sprintf(childPath, "%s%s%s", path,
+				path[1] ? "/" : "", name);
+
+			initializeDirentry(&entry, Dir);
+			entry.entry = (int) pos;
+			entry.dir = *dir;
+			first = getStart(Dir, dir);
+
+			if(dir->attr & ATTR_DIR) {
+				c->dirs++;
+				if(!first) {
+					printf("%s: directory without clusters\n",
+					       childPath);
+					c->errors++;
+				} else {
+					n = checkChain(c, childPath, first,
+						       &broken);
+					if(!n && c->repair) {
+						/* nothing left of it */
+						entry.dir.name[0] = DELMARK;
+						dir_write(&entry);
+					} else if(n) {
+						/* if the chain is broken, its
+						 * valid part still holds
+						 * entries */
+						Stream_t *Sub =
+							OpenFileByDirentry(&entry);
+						if(Sub) {
+							checkDir(c, Sub,
+								 childPath,
+								 n * (c->clusterBytes / MDIR_SIZE));
+							FREE(&Sub);
+						} else
+							c->unscanned = 1;
+					} else
+						c->unscanned = 1;
+				}
+			} else {
+				c->files++;
+				n = first ?
+					checkChain(c, childPath, first,
+						   &broken) : 0;
+				checkFileSize(c, &entry, childPath, first, n);
+			}
+			free(childPath);
+		}
+	}
+ done:
+	free(buf);
+}
+
+static int checkFs(char drive, int repair)
+{
+	Check_t c;
+	Stream_t *RootDir;
+	Fs_t *Fs;
+	uint32_t i, end, lost, chains, nfree;
+	unsigned char *pointed;
+
+	memset(&c, 0, sizeof(c));
+	c.repair = repair;
+
+	RootDir = open_root_dir(drive, repair ? O_RDWR : O_RDONLY, NULL);
+	if(!RootDir)
+		return 4;
+	Fs = c.Fs = (Fs_t *) GetFs(RootDir);
+	c.clusterBytes = Fs->cluster_size * Fs->sector_size;
+	end = Fs->num_clus + 2;
+
+	c.owned = calloc((end + 7) / 8, 1);
+	pointed = calloc((end + 7) / 8, 1);
+	if(!c.owned || !pointed || decodeWholeFat(&c) < 0) {
+		printOom();
+		exit(1);
+	}
+
+	checkFatCopies(&c);
+
+	if(Fs->fat_bits == 32) {
+		int broken;
+		uint32_t n = checkChain(&c, "/", Fs->rootCluster, &broken);
+		if(!n)
+			c.unscanned = 1;
+		checkDir(&c, RootDir, "/", n * (c.clusterBytes / MDIR_SIZE));
+	} else
+		checkDir(&c, RootDir, "/", UINT_MAX);
+
+	/* lost clusters: in use, but not owned by any entry */
+	lost = 0;
+	for(i = 2; i < end; i++)
+		if(c.fat[i] && c.fat[i] != Fs->last_fat + 1 &&
+		   !TEST_BIT(c.owned, i)) {
+			lost++;
+			if(c.fat[i] >= 2 && c.fat[i] < end)
+				SET_BIT(pointed, c.fat[i]);
+		}
+	if(lost) {
+		/* the lost chains start at the lost clusters to which no
+		 * other lost cluster points */
+		chains = 0;
+		for(i = 2; i < end; i++)
+			if(c.fat[i] && c.fat[i] != Fs->last_fat + 1 &&
+			   !TEST_BIT(c.owned, i)) {
+				if(!TEST_BIT(pointed, i))
+					chains++;
+				if(repair && !c.unscanned)
+					setEntry(&c, i, 0);
+			}
+		printf("%u lost clusters in %u chains\n", lost, chains);
+		if(repair && c.unscanned)
+			/* some of them may belong to entries of the
+			 * directories which could not be read */
+			printf("Not freeing them, as some directories could not be checked\n");
+		c.errors++;
+	}
+
+	nfree = 0;
+	for(i = 2; i < end; i++)
+		if(!c.fat[i])
+			nfree++;
+	if(Fs->freeSpace != MAX32 && Fs->freeSpace != nfree) {
+		printf("Free cluster count is %u, should be %u\n",
+		       Fs->freeSpace, nfree);
+		c.errors++;
+	}
+	if(repair && c.errors) {
+		Fs->freeSpace = nfree;
+		Fs->fat_dirty = 1;
+		/* all problems have been dealt with, so write all FAT
+		 * copies again */
+		Fs->fat_error = 0;
+	}
+
+	printf("%lu files, %lu directories, %u/%u clusters free\n",
+	       c.files, c.dirs, nfree, Fs->num_clus);
+	if(c.errors)
+		printf("%lu problems %s\n", c.errors,
+		       repair ? "repaired" : "found");
+
+	free(c.fat);
+	free(c.owned);
+	free(pointed);
+	FREE(&RootDir);
+	return c.errors ? 1 : 0;
+}
+
 static void usage(int ret) NORETURN;
 static void usage(int ret)
 {
 	fprintf(stderr,
 		"Mtools version %s, dated %s\n", mversion, mdate);
 	fprintf(stderr,
-		"Usage: [-b] %s file fat\n", progname);
+		"Usage: [-b] %s file fat\n"
+		"       %s -c [-r] drive:\n", progname, progname);
 	exit(ret);
 }
 
@@ -82,6 +534,7 @@ void mdoctorfat(int argc, char **argv, int mtype UNUSEDP)
 	char *number, *eptr;
 	int i;
 	unsigned int offset;
+	int check, repair;
 
 	/* get command line options */
 
@@ -91,11 +544,13 @@ void mdoctorfat(int argc, char **argv, int mtype UNUSEDP)
 
 	arg.markbad = 0;
 	arg.setsize = 0;
+	check = 0;
+	repair = 0;
 
 	/* get command line options */
 	if(helpFlag(argc, argv))
 		usage(0);
-	while ((c = getopt(argc, argv, "i:bo:s:h")) != EOF) {
+	while ((c = getopt(argc, argv, "i:bo:s:crh")) != EOF) {
 		char *endptr = NULL;
 		errno=0;
 		switch (c) {
@@ -105,6 +560,12 @@ void mdoctorfat(int argc, char **argv, int mtype UNUSEDP)
 			case 'b':
 				arg.markbad = 1;
 				break;
+			case 'c':
+				check = 1;
+				break;
+			case 'r':
+				repair = 1;
+				break;
 			case 'o':
 				offset = strtoui(optarg,&endptr,0);
 				break;
@@ -120,6 +581,14 @@ void mdoctorfat(int argc, char **argv, int mtype UNUSEDP)
 		check_number_parse_errno((char)c, optarg, endptr);
 	}
 
+	if(check) {
+		if (argc != optind+1 || !argv[optind][0] ||
+		    argv[optind][1] != ':' || argv[optind][2])
+			usage(1);
+		ret = checkFs(argv[optind][0], repair);
+		exit(ret);
+	}
+
 	if (argc - optind < 2)
 		usage(1);
 
@@ -1261,6 +1261,8 @@ void mformat(int argc, char **argv, int dummy UNUSEDP)
 
 	/* create the image file if needed */
 	if (create) {
+		/* zeroes, rather than whatever was on the stack */
+		memset(boot.characters, '\0', Fs->sector_size);
 		PWRITES(Fs->head.Next, &boot.characters,
 			sectorsToBytes(Fs, tot_sectors-1),
 			Fs->sector_size);
@@ -160,6 +160,22 @@ void print_sector(const char *message, unsigned char *data, int size)
 # define STRTOTIME strtol
 #endif
 
+/*
+ * Seeds random(), for serial numbers. In deterministic mode, the seed
+ * is the time given by SOURCE_DATE_EPOCH, so that the same serial
+ * number is drawn each time
+ */
+void init_random(void)
+{
+	time_t seed;
+
+	if(mtools_deterministic)
+		getTimeNow(&seed);
+	else
+		time(&seed);
+	srandom((unsigned int) seed);
+}
+
 time_t getTimeNow(time_t *now)
 {
 	static int haveTime = 0;
@@ -1,4 +1,4 @@
-/*  Copyright 1996-1998,2000-2002,2005,2007-2009 Alain Knaff.
+/*  Copyright 1996-1998,2000-2002,2005,2007-2009,2026 Alain Knaff.
  *  This file is part of mtools.
  *
  *  Mtools is free software: you can redistribute it and/or modify
@@ -27,6 +27,7 @@
 #include "nameclash.h"
 #include "file.h"
 #include "fs.h"
+#include "htable.h"
 
 /*
  * Preserve the file modification times after the fclose()
@@ -39,8 +40,42 @@ typedef struct Arg_t {
 
 	direntry_t *entry;
 	ClashHandling_t ch;
+
+	/* in batch mode, the directories touched so far, kept open so that
+	 * their caches and buffers last until the end of the batch */
+	T_HashTable *pinned;
 } Arg_t;
 
+static uint32_t pinHash(void *p)
+{
+	return (uint32_t) ((unsigned long) p >> 4);
+}
+
+static int pinComp(void *p1, void *p2)
+{
+	return p1 != p2;
+}
+
+static void pin(Arg_t *arg, Stream_t *Dir)
+{
+	void *found;
+
+	if(!arg->pinned || !Dir || !hash_lookup(arg->pinned, Dir, &found, 0))
+		return;
+	if(hash_add(arg->pinned, Dir, 0)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	COPY(Dir);
+}
+
+static uint32_t unpin(void *p)
+{
+	Stream_t *Dir = (Stream_t *) p;
+	FREE(&Dir);
+	return 0;
+}
+
 
 /*
  * Open the named file for read, create the cluster chain, return the
@@ -128,6 +163,8 @@ static int rename_file(direntry_t *entry, MainParam_t *mp)
 
 	arg->entry = entry;
 	targetDir = mp->targetDir;
+	pin(arg, entry->Dir);
+	pin(arg, targetDir);
 
 	if (targetDir == entry->Dir){
 		arg->ch.ignore_entry = -1;
@@ -136,6 +173,7 @@ static int rename_file(direntry_t *entry, MainParam_t *mp)
 	} else {
 		arg->ch.ignore_entry = -1;
 		arg->ch.source = -2;
+		arg->ch.source_entry = -2;
 	}
 
 	longname = mpPickTargetName(mp);
@@ -185,6 +223,7 @@ static int rename_oldsyntax(direntry_t *entry, MainParam_t *mp)
 	Arg_t * arg = (Arg_t *) (mp->arg);
 	arg->entry = entry;
 	targetDir = entry->Dir;
+	pin(arg, targetDir);
 
 	arg->ch.ignore_entry = -1;
 	arg->ch.source = entry->entry;
@@ -220,9 +259,137 @@ static void usage(int ret)
 	fprintf(stderr,
 		"       %s [-vV] [-D clash_option] file [files...] target_directory\n",
 		progname);
+	fprintf(stderr,
+		"       %s [-vV] [-D clash_option] -f listfile\n", progname);
 	exit(ret);
 }
 
+/* Checks that all names are on the same drive, and returns it */
+static int getCommonDrive(char **names, int n, char *drive)
+{
+	int i;
+
+	*drive = '\0';
+	for(i=0; i<n; i++)
+		if(names[i][0] && names[i][1] == ':' ){
+			if(!*drive)
+				*drive = ch_toupper(names[i][0]);
+			else if(*drive != ch_toupper(names[i][0])){
+				fprintf(stderr,
+					"Cannot move files across different drives\n");
+				return -1;
+			}
+		}
+	return 0;
+}
+
+/* Moves the files named by names[0] to names[n-2] to names[n-1] */
+static int moveFiles(Arg_t *arg, char **names, int n, int oldsyntax)
+{
+	char def_drive;
+	const char *target = names[n-1];
+
+	if(getCommonDrive(names, n, &def_drive))
+		return 1;
+	if(def_drive)
+		*(arg->mp.mcwd) = def_drive;
+
+	if (oldsyntax && (n != 2 || strpbrk(":/", target)))
+		oldsyntax = 0;
+
+	if (!oldsyntax){
+		if(dos_target_lookup(&arg->mp, target) & (ERROR_ONE|MISSED_ONE))
+			return 1;
+		arg->mp.callback = rename_file;
+		arg->mp.dirCallback = rename_directory;
+	} else {
+		/* do not look up the target; it will be the same dir as the
+		 * source */
+		arg->fromname = names[0];
+		if(arg->fromname[0] && arg->fromname[1] == ':')
+			arg->fromname += 2;
+		arg->fromname = _basename(arg->fromname);
+		arg->mp.targetName = strdup(target);
+		arg->mp.callback = rename_oldsyntax;
+	}
+	return main_loop(&arg->mp, names, n - 1);
+}
+
+/*
+ * Batch mode: moves each source to its target, as listed in the file
+ * listName, one pair per line, separated by a tab. The directories are
+ * kept open for the whole batch, so that their entries are only read
+ * once, names are looked up in their caches' index, and the changes
+ * to each of them are written back together
+ */
+static int moveBatch(Arg_t *arg, const char *listName, int oldsyntax)
+{
+	FILE *list;
+	char line[2 * MAX_PATH + 4];
+	char mcwd[MAX_PATH+4];
+	char *names[2], *end;
+	unsigned int lineNr = 0;
+	int ret = 0;
+
+	if(!strcmp(listName, "-"))
+		list = stdin;
+	else
+		list = fopen(listName, "r");
+	if(!list) {
+		fprintf(stderr, "Could not open %s (%s)\n",
+			listName, strerror(errno));
+		return 1;
+	}
+	if(make_ht(pinHash, pinComp, 64, &arg->pinned)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	strcpy(mcwd, arg->mp.mcwd);
+	while(!got_signal && fgets(line, sizeof(line), list)) {
+		lineNr++;
+		end = line + strcspn(line, "\r\n");
+		if(!*end && !feof(list)) {
+			fprintf(stderr, "%s:%u: line too long\n",
+				listName, lineNr);
+			ret = 1;
+			while(fgets(line, sizeof(line), list) &&
+			      !line[strcspn(line, "\n")])
+				;
+			continue;
+		}
+		*end = '\0';
+		if(!*line)
+			continue;
+		names[0] = line;
+		names[1] = strchr(line, '\t');
+		if(!names[1]) {
+			fprintf(stderr, "%s:%u: no tab between source and target\n",
+				listName, lineNr);
+			ret = 1;
+			continue;
+		}
+		*names[1]++ = '\0';
+
+		strcpy(arg->mp.mcwd, mcwd);
+		if(moveFiles(arg, names, 2, oldsyntax))
+			ret = 1;
+		/* main_loop releases the target, but an early error return
+		 * from moveFiles may leave it behind */
+		if(arg->mp.targetDir)
+			FREE(&arg->mp.targetDir);
+		if(arg->mp.targetName) {
+			free((char *) arg->mp.targetName);
+			arg->mp.targetName = 0;
+		}
+	}
+	if(list != stdin)
+		fclose(list);
+	free_ht(arg->pinned, unpin);
+	arg->pinned = 0;
+	return ret;
+}
+
 void mmove(int argc, char **argv, int oldsyntax) NORETURN;
 void mmove(int argc, char **argv, int oldsyntax)
 {
@@ -230,8 +397,7 @@ void mmove(int argc, char **argv, int oldsyntax)
 	int c;
 	char shortname[12*4+1];
 	char longname[4*MAX_VNAMELEN+1];
-	char def_drive;
-	int i;
+	const char *listName = 0;
 
 	/* get command line options */
 
@@ -239,13 +405,17 @@ void mmove(int argc, char **argv, int oldsyntax)
 
 	/* get command line options */
 	arg.verbose = 0;
+	arg.pinned = 0;
 	if(helpFlag(argc, argv))
 		usage(0);
-	while ((c = getopt(argc, argv, "i:vD:oh")) != EOF) {
+	while ((c = getopt(argc, argv, "i:vD:ohf:")) != EOF) {
 		switch (c) {
 			case 'i':
 				set_cmd_line_image(optarg);
 				break;
+			case 'f':
+				listName = optarg;
+				break;
 			case 'v':	/* dummy option for mcopy */
 				arg.verbose = 1;
 				break;
@@ -265,50 +435,14 @@ void mmove(int argc, char **argv, int oldsyntax)
 		}
 	}
 
-	if (argc - optind < 2)
+	if (listName ? argc != optind : argc - optind < 2)
 		usage(1);
 
 	init_mp(&arg.mp);
 	arg.mp.arg = (void *) &arg;
 	arg.mp.openflags = O_RDWR;
-
-	/* look for a default drive */
-	def_drive = '\0';
-	for(i=optind; i<argc; i++)
-		if(argv[i][0] && argv[i][1] == ':' ){
-			if(!def_drive)
-				def_drive = ch_toupper(argv[i][0]);
-			else if(def_drive != ch_toupper(argv[i][0])){
-				fprintf(stderr,
-					"Cannot move files across different drives\n");
-				exit(1);
-			}
-		}
-
-	if(def_drive)
-		*(arg.mp.mcwd) = def_drive;
-
-	if (oldsyntax && (argc - optind != 2 || strpbrk(":/", argv[argc-1])))
-		oldsyntax = 0;
-
 	arg.mp.lookupflags = ACCEPT_PLAIN | ACCEPT_DIR | DO_OPEN_DIRS | NO_DOTS;
 
-	if (!oldsyntax){
-		dos_target_lookup(&arg.mp, argv[argc-1]);
-		arg.mp.callback = rename_file;
-		arg.mp.dirCallback = rename_directory;
-	} else {
-		/* do not look up the target; it will be the same dir as the
-		 * source */
-		arg.fromname = argv[optind];
-		if(arg.fromname[0] && arg.fromname[1] == ':')
-			arg.fromname += 2;
-		arg.fromname = _basename(arg.fromname);
-		arg.mp.targetName = strdup(argv[argc-1]);
-		arg.mp.callback = rename_oldsyntax;
-	}
-
-
 	arg.mp.longname.data = longname;
 	arg.mp.longname.len = sizeof(longname);
 	longname[0]='\0';
@@ -317,5 +451,7 @@ void mmove(int argc, char **argv, int oldsyntax)
 	arg.mp.shortname.len = sizeof(shortname);
 	shortname[0]='\0';
 
-	exit(main_loop(&arg.mp, argv + optind, argc - optind - 1));
+	if(listName)
+		exit(moveBatch(&arg, listName, oldsyntax));
+	exit(moveFiles(&arg, argv + optind, argc - optind, oldsyntax));
 }
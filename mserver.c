@@ -0,0 +1,573 @@
+/*  Copyright 2026 Alain Knaff.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * mserver.c
+ * Keeps drives open with their FAT loaded, and runs mtools commands
+ * forwarded to it over a Unix socket. Each command runs in a child
+ * process forked from the server, and thus starts out with warm caches.
+ * After a command which wrote to an image, the parts of the FAT it wrote
+ * are read again. When an image has been modified behind our back, its
+ * caches are dropped and loaded again.
+ *
+ * Protocol: the client sends a 32 bit length, along with its stdin,
+ * stdout and stderr as ancillary data, followed by its current
+ * directory and its arguments, all null terminated. The server answers
+ * with the 32 bit exit status of the command.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* struct ucred */
+#endif
+#include "sysincludes.h"
+#include "mtools.h"
+#include "fs.h"
+#include "plain_io.h"
+
+#if defined HAVE_SYS_SOCKET_H && defined HAVE_SYS_UN_H
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+#define MAX_REQUEST 65536
+
+typedef struct warmDrive_t {
+	char drive;
+	int warm;
+	struct MT_STAT statbuf; /* of the image, when last loaded */
+} warmDrive_t;
+
+/* Send buf, and our stdin/stdout/stderr along with it */
+static int send_with_fds(int sock, void *buf, size_t len)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	int fds[3] = { 0, 1, 2 };
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	return sendmsg(sock, &msg, 0) == (ssize_t) len ? 0 : -1;
+}
+
+static int recv_with_fds(int sock, void *buf, size_t len, int *fds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if(recvmsg(sock, &msg, 0) != (ssize_t) len)
+		return -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if(!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	   cmsg->cmsg_type != SCM_RIGHTS ||
+	   cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+		return -1;
+	memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+	return 0;
+}
+
+static int read_all(int fd, char *buf, size_t len)
+{
+	while(len) {
+		ssize_t ret = read(fd, buf, len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return -1;
+		buf += ret;
+		len -= (size_t) ret;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while(len) {
+		ssize_t ret = write(fd, buf, len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return -1;
+		buf += ret;
+		len -= (size_t) ret;
+	}
+	return 0;
+}
+
+static int open_socket(const char *name, struct sockaddr_un *addr)
+{
+	int sock;
+
+	if(strlen(name) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "Socket name %s too long\n", name);
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, name);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock < 0)
+		perror("socket");
+	return sock;
+}
+
+/*
+ * Client side: hand our command over to the server listening at
+ * socketName, and exit with its status. Returns if there is no server,
+ * in which case the command should be run directly
+ */
+void mserver_forward(const char *socketName, int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	char cwd[MAXPATHLEN+1];
+	char *buf, *ptr;
+	size_t len;
+	uint32_t len32, status;
+	int sock;
+	int i;
+
+	sock = open_socket(socketName, &addr);
+	if(sock < 0)
+		return;
+	if(connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(sock);
+		return;
+	}
+
+	if(!getcwd(cwd, sizeof(cwd))) {
+		perror("getcwd");
+		exit(1);
+	}
+	len = strlen(cwd) + 1;
+	for(i=0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if(len > MAX_REQUEST) {
+		fprintf(stderr, "Command line too long for mserver\n");
+		exit(1);
+	}
+	buf = safe_malloc(len);
+	ptr = buf;
+	strcpy(ptr, cwd);
+	ptr += strlen(ptr) + 1;
+	for(i=0; i < argc; i++) {
+		strcpy(ptr, argv[i]);
+		ptr += strlen(ptr) + 1;
+	}
+
+	len32 = (uint32_t) len;
+	if(send_with_fds(sock, &len32, sizeof(len32)) < 0 ||
+	   write_all(sock, buf, len) < 0 ||
+	   read_all(sock, (char *) &status, sizeof(status)) < 0) {
+		fprintf(stderr, "Lost connection to mserver %s\n",
+			socketName);
+		exit(1);
+	}
+	free(buf);
+	close(sock);
+	exit((int) status);
+}
+
+/* Only talk to processes of our own user */
+static int check_peer(int conn)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+	   cred.uid != geteuid())
+		return -1;
+#endif
+	return 0;
+}
+
+static int image_stat(char drive, struct MT_STAT *statbuf)
+{
+	Stream_t *Dir, *Stream;
+	int fd;
+
+	Dir = open_root_dir(drive, O_RDONLY, NULL);
+	if(!Dir)
+		return -1;
+	for(Stream = GetFs(Dir); Stream->Next; Stream = Stream->Next);
+	fd = get_fd(Stream);
+	FREE(&Dir);
+	if(fd < 0 || MT_FSTAT(fd, statbuf) < 0)
+		return -1;
+	return 0;
+}
+
+/* Open drive, and load its whole FAT */
+static void warm_up(warmDrive_t *w)
+{
+	Stream_t *Dir;
+	int isRo;
+
+	/* Forwarded commands will reuse this, so it should be writable if
+	 * possible. O_RDONLY only sets the minimum: as isRo is passed, the
+	 * image is tried read-write first (see try_device), and only opened
+	 * read-only if that is refused, which isRo then tells */
+	Dir = open_root_dir(w->drive, O_RDONLY, &isRo);
+	if(!Dir)
+		return;
+	getfree(Dir);
+	FREE(&Dir);
+	if(image_stat(w->drive, &w->statbuf) < 0) {
+		fprintf(stderr,
+			"Drive %c: is not an image file or device, not "
+			"keeping it open\n", w->drive);
+		uncache_drive(w->drive);
+		return;
+	}
+	w->warm = 1;
+}
+
+/* Has the image been changed since we last loaded it? */
+static int is_stale(warmDrive_t *w)
+{
+	struct MT_STAT statbuf;
+
+	if(image_stat(w->drive, &statbuf) < 0)
+		return 1;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	if(statbuf.st_mtim.tv_nsec != w->statbuf.st_mtim.tv_nsec ||
+	   statbuf.st_ctim.tv_nsec != w->statbuf.st_ctim.tv_nsec)
+		return 1;
+#endif
+	return statbuf.st_dev != w->statbuf.st_dev ||
+		statbuf.st_ino != w->statbuf.st_ino ||
+		statbuf.st_size != w->statbuf.st_size ||
+		statbuf.st_mtime != w->statbuf.st_mtime ||
+		statbuf.st_ctime != w->statbuf.st_ctime;
+}
+
+static void refresh(warmDrive_t *drives, int nrDrives, int force)
+{
+	int i;
+	for(i=0; i < nrDrives; i++) {
+		warmDrive_t *w = &drives[i];
+		if(w->warm && (force || is_stale(w))) {
+			uncache_drive(w->drive);
+			w->warm = 0;
+		}
+		if(!w->warm)
+			warm_up(w);
+	}
+}
+
+/*
+ * A command we ran wrote to images. The writes are known, so bring the
+ * caches of the drives up to date, instead of loading them all over
+ * again. Only drives for which this fails are loaded again
+ */
+static void catch_up(warmDrive_t *drives, int nrDrives, writeLog_t *log)
+{
+	int i;
+	unsigned int j;
+
+	for(i=0; i < nrDrives; i++) {
+		warmDrive_t *w = &drives[i];
+		Stream_t *Dir;
+		int r = 0;
+
+		if(!w->warm)
+			continue;
+		Dir = open_root_dir(w->drive, O_RDONLY, NULL);
+		if(!Dir || log->nr > MAX_WRITE_RANGES)
+			r = -1;
+		for(j=0; !r && j < log->nr; j++)
+			r = fs_reload_range(Dir, log->ranges[j].dev,
+					    log->ranges[j].ino,
+					    log->ranges[j].start,
+					    log->ranges[j].end);
+		if(!r && getfree(Dir) < 0)
+			r = -1;
+		if(Dir)
+			FREE(&Dir);
+		/* the writes changed the times of the image, which
+		 * should not make it look stale */
+		if(!r && image_stat(w->drive, &w->statbuf) < 0)
+			r = -1;
+		if(r < 0) {
+			uncache_drive(w->drive);
+			w->warm = 0;
+		}
+	}
+	refresh(drives, nrDrives, 0);
+}
+
+static void run_child(int listenSock, int conn, int *fds,
+		      char *req, size_t len) NORETURN;
+static void run_child(int listenSock, int conn, int *fds,
+		      char *req, size_t len)
+{
+	char **argv;
+	char *ptr, *end;
+	int argc;
+	int i;
+
+	close(listenSock);
+	close(conn);
+	setsid(); /* prompts should go to the client, not to our tty */
+	for(i=0; i<3; i++) {
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+
+	end = req + len;
+	if(chdir(req) < 0) {
+		perror(req);
+		exit(1);
+	}
+	argc = 0;
+	for(ptr = req + strlen(req) + 1; ptr < end; ptr += strlen(ptr) + 1)
+		argc++;
+	if(argc < 1)
+		exit(1);
+	argv = NewArray((size_t) argc + 1, char *);
+	if(!argv) {
+		printOom();
+		exit(1);
+	}
+	argc = 0;
+	for(ptr = req + strlen(req) + 1; ptr < end; ptr += strlen(ptr) + 1)
+		argv[argc++] = ptr;
+	argv[argc] = 0;
+
+	progname = argv[0];
+	optind = 1;
+	signal(SIGPIPE, SIG_DFL);
+	setup_signal();
+	run_command(_basename(argv[0]), argc, argv);
+	fprintf(stderr,"Unknown mtools command '%s'\n", argv[0]);
+	exit(1);
+}
+
+static void serve_one(int listenSock, int conn,
+		      warmDrive_t *drives, int nrDrives,
+		      writeLog_t *log)
+{
+	uint32_t len32, status;
+	int fds[3];
+	char *req;
+	pid_t pid;
+	int wstatus;
+	int i;
+
+	if(check_peer(conn) < 0)
+		return;
+	if(recv_with_fds(conn, &len32, sizeof(len32), fds) < 0)
+		return;
+	if(len32 == 0 || len32 > MAX_REQUEST)
+		goto exit_0;
+	req = safe_malloc(len32 + 1);
+	if(read_all(conn, req, len32) < 0)
+		goto exit_1;
+	req[len32] = '\0';
+
+	refresh(drives, nrDrives, 0);
+	log->wrote = 0;
+	log->nr = 0;
+	fflush(NULL);
+	pid = fork();
+	if(pid < 0) {
+		perror("fork");
+		goto exit_1;
+	}
+	if(pid == 0)
+		run_child(listenSock, conn, fds, req, len32);
+
+	while(waitpid(pid, &wstatus, 0) < 0)
+		if(errno != EINTR) {
+			wstatus = 1 << 8;
+			break;
+		}
+	if(WIFEXITED(wstatus))
+		status = (uint32_t) WEXITSTATUS(wstatus);
+	else
+		status = 128 + (uint32_t) WTERMSIG(wstatus);
+	write_all(conn, (char *) &status, sizeof(status));
+
+	if(log->wrote)
+		/* the command wrote to an image. Our caches are stale */
+		catch_up(drives, nrDrives, log);
+ exit_1:
+	free(req);
+ exit_0:
+	for(i=0; i<3; i++)
+		close(fds[i]);
+}
+
+static void usage(int ret) NORETURN;
+static void usage(int ret)
+{
+	fprintf(stderr,
+		"Mtools version %s, dated %s\n", mversion, mdate);
+	fprintf(stderr,
+		"Usage: %s [-i image] socket [drive:...]\n", progname);
+	exit(ret);
+}
+
+void mserver(int argc, char **argv, int type UNUSEDP) NORETURN;
+void mserver(int argc, char **argv, int type UNUSEDP)
+{
+	struct sockaddr_un addr;
+	warmDrive_t *drives;
+	writeLog_t *log;
+	struct MT_STAT st;
+	mode_t oldMask;
+	int nrDrives;
+	int listenSock;
+	int c;
+	int i;
+
+	if(helpFlag(argc, argv))
+		usage(0);
+	while ((c = getopt(argc, argv, "i:h")) != EOF) {
+		switch (c) {
+			case 'i':
+				set_cmd_line_image(optarg);
+				break;
+			case 'h':
+				usage(0);
+			default:
+				usage(1);
+		}
+	}
+	if(optind >= argc)
+		usage(1);
+
+	/* write-behind threads would not survive the fork */
+	mtools_io_queue_depth = 0;
+
+	nrDrives = argc - optind - 1;
+	drives = NewArray((size_t) nrDrives + 1, warmDrive_t);
+	if(!drives) {
+		printOom();
+		exit(1);
+	}
+	for(i=0; i < nrDrives; i++) {
+		char *arg = argv[optind + 1 + i];
+		if(!arg[0] || (arg[1] && (arg[1] != ':' || arg[2]))) {
+			fprintf(stderr, "Bad drive %s\n", arg);
+			exit(1);
+		}
+		drives[i].drive = ch_toupper(arg[0]);
+	}
+	if(nrDrives == 0) {
+		/* just the default drive, e.g. -i image */
+		drives[0].drive = get_default_drive();
+		nrDrives = 1;
+	}
+
+	/* shared with the children, so that we learn where they wrote */
+	log = mmap(0, sizeof(writeLog_t), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(log == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	plain_io_log_writes(log);
+
+	listenSock = open_socket(argv[optind], &addr);
+	if(listenSock < 0)
+		exit(1);
+	/* a socket left over by a previous server may be replaced, but
+	 * nothing else */
+	if(MT_LSTAT(argv[optind], &st) == 0) {
+		if(!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s exists, and is not a socket\n",
+				argv[optind]);
+			exit(1);
+		}
+		if(unlink(argv[optind]) < 0) {
+			perror(argv[optind]);
+			exit(1);
+		}
+	}
+	/* only for the socket: the commands we run should create files
+	 * with the caller's umask */
+	oldMask = umask(077);
+	if(bind(listenSock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	umask(oldMask);
+	if(listen(listenSock, 16) < 0) {
+		perror(argv[optind]);
+		exit(1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+
+	refresh(drives, nrDrives, 0);
+	while(1) {
+		int conn = accept(listenSock, NULL, NULL);
+		if(conn < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("accept");
+			exit(1);
+		}
+		serve_one(listenSock, conn, drives, nrDrives, log);
+		close(conn);
+	}
+}
+
+#else
+
+void mserver_forward(const char *socketName UNUSEDP,
+		     int argc UNUSEDP, char **argv UNUSEDP)
+{
+}
+
+void mserver(int argc UNUSEDP, char **argv UNUSEDP, int type UNUSEDP)
+{
+	fprintf(stderr, "mserver not supported on this platform\n");
+	exit(1);
+}
+
+#endif
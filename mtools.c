@@ -17,6 +17,7 @@
 
 #include "sysincludes.h"
 #include "mtools.h"
+#include "trace_io.h"
 
 const char *progname;
 
@@ -29,7 +30,9 @@ static const struct dispatch {
 	{"mbadblocks",mbadblocks, 0},
 	{"mcat",mcat, 0},
 	{"mcd",mcd, 0},
+	{"mclone",mclone, 0},
 	{"mcopy",mcopy, 0},
+	{"mdefrag",mdefrag, 0},
 	{"mdel",mdel, 0},
 	{"mdeltree",mdel, 2},
 	{"mdir",mdir, 0},
@@ -45,6 +48,7 @@ static const struct dispatch {
 	{"mread",mcopy, 0},
 	{"mmove",mmove, 0},
 	{"mren",mmove, 1},
+	{"mserver", mserver, 0},
 	{"mshowfat", mshowfat, 0},
 	{"mshortname", mshortname, 0},
 	{"mtoolstest", mtoolstest, 0},
@@ -54,6 +58,16 @@ static const struct dispatch {
 };
 #define NDISPATCH (sizeof dispatch / sizeof dispatch[0])
 
+/* Runs command name. Only returns if there is no such command */
+void run_command(const char *name, int argc, char **argv)
+{
+	unsigned int i;
+	for (i = 0; i < NDISPATCH; i++) {
+		if (!strcmp(name,dispatch[i].cmd))
+			dispatch[i].fn(argc, argv, dispatch[i].type);
+	}
+}
+
 int main(int argc,char **argv)
 {
 	unsigned int i;
@@ -164,11 +178,13 @@ int main(int argc,char **argv)
 	}
 
 	read_config();
+	trace_io_init();
+	if(mtools_server && *mtools_server &&
+	   strcmp(name, "mserver") && strcmp(name, "mtools"))
+		/* only returns if no server is listening */
+		mserver_forward(mtools_server, argc, argv);
 	setup_signal();
-	for (i = 0; i < NDISPATCH; i++) {
-		if (!strcmp(name,dispatch[i].cmd))
-			dispatch[i].fn(argc, argv, dispatch[i].type);
-	}
+	run_command(name, argc, argv);
 	if (strcmp(name,"mtools"))
 		fprintf(stderr,"Unknown mtools command '%s'\n",name);
 	fprintf(stderr,"Supported commands:");
@@ -86,6 +86,7 @@ struct directory *mk_entry(const dos_name_t *filename, unsigned char attr,
 struct directory *mk_entry_from_base(const char *base, unsigned char attr,
 				     unsigned int fat, uint32_t size, time_t date,
 				     struct directory *ndir);
+void set_entry_time(struct directory *ndir, time_t date);
 
 mt_off_t copyfile(Stream_t *Source, Stream_t *Target);
 int getfreeMinClusters(Stream_t *Stream, uint32_t ref);
@@ -129,11 +130,6 @@ static inline char ch_tolower(char ch)
         return (char) tolower( (unsigned char) ch);
 }
 
-static inline void init_random(void)
-{
-	srandom((unsigned int)time (0));
-}
-
 static inline size_t ptrdiff (const char *end, const char *begin)
 {
 	return (size_t) (end-begin);
@@ -155,6 +151,13 @@ extern unsigned int mtools_no_vfat;
 extern unsigned int mtools_numeric_tail;
 extern unsigned int mtools_dotted_dir;
 extern unsigned int mtools_lock_timeout;
+extern unsigned int mtools_io_queue_depth;
+extern const char *mtools_server;
+extern unsigned int mtools_fat_snapshot;
+extern unsigned int mtools_fat_resident;
+extern unsigned int mtools_deterministic;
+extern const char *mtools_trace_io;
+extern const char *mtools_trace_file;
 extern unsigned int mtools_twenty_four_hour_clock;
 extern const char *mtools_date_string;
 extern uint8_t mtools_rate_0, mtools_rate_any;
@@ -191,7 +194,9 @@ void mattrib(int argc, char **argv, int type);
 void mbadblocks(int argc, char **argv, int type);
 void mcat(int argc, char **argv, int type);
 void mcd(int argc, char **argv, int type);
+void mclone(int argc, char **argv, int type);
 void mcopy(int argc, char **argv, int type);
+void mdefrag(int argc, char **argv, int type);
 void mdel(int argc, char **argv, int type);
 void mdir(int argc, char **argv, int type);
 void mdoctorfat(int argc, char **argv, int type);
@@ -203,6 +208,9 @@ void mmd(int argc, char **argv, int type);
 void mmount(int argc, char **argv, int type);
 void mmove(int argc, char **argv, int type);
 void mpartition(int argc, char **argv, int type);
+void mserver(int argc, char **argv, int type);
+void mserver_forward(const char *socketName, int argc, char **argv);
+void run_command(const char *name, int argc, char **argv);
 void mshortname(int argc, char **argv, int mtype);
 void mshowfat(int argc, char **argv, int mtype);
 void mtoolstest(int argc, char **argv, int type);
@@ -220,6 +228,7 @@ extern const char *progname;
 
 void print_sector(const char *message, unsigned char *data, int size);
 time_t getTimeNow(time_t *now);
+void init_random(void);
 
 #ifdef USING_NEW_VOLD
 char *getVoldName(struct device *dev, char *name);
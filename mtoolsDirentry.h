@@ -46,6 +46,14 @@ int vfat_lookup(direntry_t *entry, const char *filename, size_t length,
 		char *shortname, size_t shortname_len,
 		char *longname, size_t longname_len);
 
+struct pattern_t;
+void vfat_compile_pattern(struct pattern_t *pattern,
+			  const char *filename, size_t length);
+int vfat_lookup_pattern(direntry_t *entry, const struct pattern_t *pattern,
+			int flags,
+			char *shortname, size_t shortname_len,
+			char *longname, size_t longname_len);
+
 int vfat_lookup_zt(direntry_t *entry, const char *filename,
 		   int flags,
 		   char *shortname, size_t shortname_len,
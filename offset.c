@@ -20,6 +20,9 @@
 #include "sysincludes.h"
 #include "mtools.h"
 #include "offset.h"
+#include "remap.h"
+#include "trace_io.h"
+#include "async_io.h"
 
 typedef struct Offset_t {
 	struct Stream_t head;
@@ -55,10 +58,71 @@ static Class_t OffsetClass = {
 	0, /* discard */
 };
 
+/*
+ * Skip over any offset layers, accumulating their offsets into *offset.
+ * Lets layers stacked above talk directly to the first stream which does
+ * more than just adding a constant. Tracing layers are kept, as they
+ * need to see the I/O
+ */
+Stream_t *offset_resolve(Stream_t *Stream, mt_off_t *offset)
+{
+	while(Stream->Class == &OffsetClass) {
+		*offset += ((Offset_t *) Stream)->offset;
+		Stream = Stream->Next;
+	}
+	return Stream;
+}
+
+/*
+ * Like offset_resolve, but also skip tracing and asynchronous I/O
+ * layers, in order to find the stream which actually holds the data.
+ * Only meant for telling whether two stacks lead to the same file: I/O
+ * should still go through the layers skipped here
+ */
+Stream_t *offset_resolve_base(Stream_t *Stream, mt_off_t *offset)
+{
+	while(1) {
+		Stream = async_io_skip(trace_io_skip(Stream));
+		if(Stream->Class != &OffsetClass)
+			return Stream;
+		*offset += ((Offset_t *) Stream)->offset;
+		Stream = Stream->Next;
+	}
+}
+
+/*
+ * Push an offset layer. If Next is itself an offset or remap layer, the
+ * offset is folded into it instead, and Next is returned. This is only
+ * done when we hold the only reference to Next: a shared layer would
+ * shift the other users' view of the device as well
+ */
 Stream_t *OpenOffset(Stream_t *Next, struct device *dev, off_t offset,
 		     char *errmsg, mt_off_t *maxSize) {
 	Offset_t *This;
 
+	if(maxSize) {
+		if(offset > *maxSize) {
+			if(errmsg)
+				sprintf(errmsg,"init: Big disks not supported");
+			return NULL;
+		}
+
+		*maxSize -= offset;
+	}
+
+	if(adjust_tot_sectors(dev, offset, errmsg) < 0)
+		return NULL;
+
+	if(Next->refs == 1) {
+		if(Next->Class == &OffsetClass) {
+			((Offset_t *) Next)->offset += offset;
+			return Next;
+		}
+
+		if(remap_shift(Next, offset) == 0)
+			return Next;
+	}
+
 	This = New(Offset_t);
 	if (!This){
 		printOom();
@@ -68,22 +132,5 @@ Stream_t *OpenOffset(Stream_t *Next, struct device *dev, off_t offset,
 	init_head(&This->head, &OffsetClass, Next);
 
 	This->offset = offset;
-
-	if(maxSize) {
-		if(This->offset > *maxSize) {
-			if(errmsg)
-				sprintf(errmsg,"init: Big disks not supported");
-			goto exit_0;
-		}
-
-		*maxSize -= This->offset;
-	}
-
-	if(adjust_tot_sectors(dev, This->offset, errmsg) < 0)
-		goto exit_0;
-
 	return &This->head;
- exit_0:
-	Free(This);
-	return NULL;
 }
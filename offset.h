@@ -1,2 +1,4 @@
 Stream_t *OpenOffset(Stream_t *Next, struct device *dev, off_t offset,
 		     char *errmsg, mt_off_t *maxSize);
+Stream_t *offset_resolve(Stream_t *Stream, mt_off_t *offset);
+Stream_t *offset_resolve_base(Stream_t *Stream, mt_off_t *offset);
@@ -32,6 +32,8 @@ Buffer read/write module
 #include "partition.h"
 #include "offset.h"
 #include "swap.h"
+#include "async_io.h"
+#include "trace_io.h"
 
 /*
  * Open filesystem image
@@ -83,9 +85,14 @@ Stream_t *OpenImage(struct device *out_dev, struct device *dev,
 		}
 #endif
 		if (!Stream) {
+			int mode2 = flags;
+			if(dev->partition && !(flags & SKIP_PARTITION))
+				/* different partitions of the same image
+				 * may share one descriptor */
+				mode2 |= SHARE_FD;
 			Stream = SimpleFileOpenWithLm(out_dev, dev, name,
 						      mode,
-						      errmsg, flags, 0,
+						      errmsg, mode2, 0,
 						      lockMode,
 						      maxSize,
 						      &geomFailure);
@@ -101,6 +108,16 @@ Stream_t *OpenImage(struct device *out_dev, struct device *dev,
 	if( !Stream)
 		return NULL;
 
+	if(mtools_io_queue_depth > 1 && (mode & O_ACCMODE) != O_RDONLY) {
+		/* write-behind, only possible on plain files and devices.
+		 * Silently stay synchronous otherwise */
+		Stream_t *Async = OpenAsyncIo(Stream, mtools_io_queue_depth);
+		if(Async)
+			Stream = Async;
+	}
+
+	Stream = OpenTraceIo(Stream, "device", name);
+
 	if(dev->data_map) {
 		Stream_t *Remapped = Remap(Stream, out_dev, errmsg);
 		if(Remapped == NULL)
@@ -135,7 +152,7 @@ Stream_t *OpenImage(struct device *out_dev, struct device *dev,
 		Stream = Partition;
 	}
 
-	return Stream;
+	return OpenTraceIo(Stream, "image", name);
  exit_0:
 	FREE(&Stream);
 	return NULL;
@@ -4,6 +4,7 @@
 #define NO_PRIV 1
 #define SKIP_PARTITION 2
 #define ALWAYS_GET_GEOMETRY 4
+#define SHARE_FD 8 /* reuse an already open descriptor of the same image */
 
 Stream_t *OpenImage(struct device *out_dev, struct device *dev,
 		    const char *name, int mode, char *errmsg,
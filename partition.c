@@ -20,10 +20,14 @@
 #include "sysincludes.h"
 #include "mtools.h"
 #include "partition.h"
+#include "offset.h"
+#include "plain_io.h"
 
 typedef struct Partition_t {
 	struct Stream_t head;
 
+	Stream_t *target; /* where I/O goes, with any offset layers
+			   * between us and it folded into offset */
 	mt_off_t offset; /* Offset, in bytes */
 	mt_off_t size; /* size, in bytes */
 	uint32_t nbSect; /* size, in sectors */
@@ -33,8 +37,19 @@ typedef struct Partition_t {
 	uint8_t sectors;
 	uint8_t heads;
 	uint16_t cyclinders;
+
+	Stream_t *file; /* underlying file, for overlap checks */
+	mt_off_t fileOffset; /* offset of the partition in file */
+	int hasIdentity; /* file is a plain file or device, identified by: */
+	dev_t identDev; /* st_rdev for devices */
+	ino_t identIno; /* 0 for devices */
+	struct Partition_t *nextOpen;
 } Partition_t;
 
+/* Partitions currently open, in order to make sure that several of them
+ * sharing the same image are disjoint */
+static Partition_t *openPartitions;
+
 static inline void print_hsc(hsc *h)
 {
 	printf(" h=%d s=%d c=%d\n",
@@ -142,7 +157,7 @@ static ssize_t partition_pread(Stream_t *Stream, char *buf,
 	DeclareThis(Partition_t);
 	if(limit_size(This, start, &len) < 0)
 		return -1;
-	return PREADS(This->head.Next, buf, start+This->offset, len);
+	return PREADS(This->target, buf, start+This->offset, len);
 }
 
 static ssize_t partition_pwrite(Stream_t *Stream, char *buf,
@@ -151,7 +166,7 @@ static ssize_t partition_pwrite(Stream_t *Stream, char *buf,
 	DeclareThis(Partition_t);
 	if(limit_size(This, start, &len) < 0)
 		return -1;
-	return PWRITES(This->head.Next, buf, start+This->offset, len);
+	return PWRITES(This->target, buf, start+This->offset, len);
 }
 
 static int partition_data(Stream_t *Stream, time_t *date, mt_off_t *size,
@@ -181,13 +196,71 @@ static int partition_geom(Stream_t *Stream, struct device *dev,
 	return 0;
 }
 
+static int partition_free(Stream_t *Stream)
+{
+	DeclareThis(Partition_t);
+	Partition_t **p;
+
+	for(p = &openPartitions; *p; p = &(*p)->nextOpen)
+		if(*p == This) {
+			*p = This->nextOpen;
+			break;
+		}
+	return 0;
+}
+
+/* Identify the file underneath the partition, by its device and inode
+ * numbers. The same file may be open more than once, for instance once
+ * read-only and once read-write */
+static void getIdentity(Partition_t *This)
+{
+	struct MT_STAT st;
+	int fd = get_fd(This->file);
+
+	if(fd < 0 || MT_FSTAT(fd, &st) < 0)
+		return;
+	This->hasIdentity = 1;
+	if(S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) {
+		This->identDev = st.st_rdev;
+		This->identIno = 0;
+	} else {
+		This->identDev = st.st_dev;
+		This->identIno = st.st_ino;
+	}
+}
+
+static int sameFile(Partition_t *a, Partition_t *b)
+{
+	if(a->hasIdentity && b->hasIdentity)
+		return a->identDev == b->identDev &&
+			a->identIno == b->identIno;
+	return a->file == b->file;
+}
+
+/* Does This overlap with another open partition of the same file?
+ * Aliases of exactly the same partition are allowed. Each drive has its
+ * own tracing and asynchronous I/O layers, so this looks at the file
+ * underneath them */
+static Partition_t *findOpenOverlap(Partition_t *This)
+{
+	Partition_t *p;
+	for(p = openPartitions; p; p = p->nextOpen)
+		if(sameFile(p, This) &&
+		   This->fileOffset < p->fileOffset + p->size &&
+		   p->fileOffset < This->fileOffset + This->size &&
+		   (This->fileOffset != p->fileOffset ||
+		    This->size != p->size))
+			return p;
+	return NULL;
+}
+
 static Class_t PartitionClass = {
 	0,
 	0,
 	partition_pread,
 	partition_pwrite,
 	0, /* flush */
-	0, /* free */
+	partition_free, /* free */
 	partition_geom, /* set_geom */
 	partition_data, /* get_data */
 	0, /* pre-allocate */
@@ -195,6 +268,20 @@ static Class_t PartitionClass = {
 	0, /* discard */
 };
 
+/*
+ * If Stream is a partition, add its offset to *offset and return the
+ * stream its I/O goes to. Returns NULL otherwise
+ */
+Stream_t *partition_resolve(Stream_t *Stream, mt_off_t *offset)
+{
+	Partition_t *This = (Partition_t *) Stream;
+
+	if(Stream->Class != &PartitionClass)
+		return NULL;
+	*offset += This->offset;
+	return This->target;
+}
+
 Stream_t *OpenPartition(Stream_t *Next, struct device *dev,
 			char *errmsg, mt_off_t *maxSize) {
 	Partition_t *This;
@@ -251,6 +338,7 @@ Stream_t *OpenPartition(Stream_t *Next, struct device *dev,
 	}
 
 	This->offset = (mt_off_t) partOff << 9;
+	This->target = offset_resolve(This->head.Next, &This->offset);
 
 	if(!mtools_skip_check &&
 	   consistencyCheck((struct partition *)(buf+0x1ae), 0, 0,
@@ -272,6 +360,19 @@ Stream_t *OpenPartition(Stream_t *Next, struct device *dev,
 	}
 	dev->tot_sectors = This->nbSect = PART_SIZE(partition);
 	This->size = (mt_off_t) This->nbSect << 9;
+
+	This->fileOffset = This->offset;
+	This->file = offset_resolve_base(This->target, &This->fileOffset);
+	getIdentity(This);
+	if(findOpenOverlap(This)) {
+		if(errmsg)
+			sprintf(errmsg,
+				"Partition %d overlaps with a partition "
+				"already in use", dev->partition);
+		goto exit_0;
+	}
+	This->nextOpen = openPartitions;
+	openPartitions = This;
 	return &This->head;
  exit_0:
 	Free(This);
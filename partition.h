@@ -54,6 +54,7 @@ void setBeginEnd(struct partition *partTable,
 
 Stream_t *OpenPartition(Stream_t *Next, struct device *dev,
 			char *errmsg, mt_off_t *maxSize);
+Stream_t *partition_resolve(Stream_t *Stream, mt_off_t *offset);
 
 unsigned int findOverlap(struct partition *partTable, unsigned int until,
 			 uint32_t start, uint32_t end);
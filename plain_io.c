@@ -43,20 +43,109 @@ typedef struct SimpleFile_t {
     int size_limited;
 #endif
     const char *postcmd;
+    int accmode; /* O_RDONLY, O_WRONLY or O_RDWR */
+    struct SimpleFile_t *nextOpen;
 } SimpleFile_t;
 
+/* All open image files, so that partitions of one image may share a
+ * single descriptor */
+static SimpleFile_t *openFiles;
+
 
 #include "lockdev.h"
 
 typedef ssize_t (*iofn) (int, void *, size_t);
 
+#if defined HAVE_PREAD && defined HAVE_PWRITE
+#define HAVE_PIO
+typedef ssize_t (*piofn) (int, void *, size_t, off_t);
+#define PIO(f) ((piofn) (f))
+#else
+typedef void *piofn;
+#define PIO(f) NULL
+#endif
+
+/* if set, records whatever we write */
+static writeLog_t *writeLog;
+
+void plain_io_log_writes(writeLog_t *log)
+{
+	writeLog = log;
+}
+
+static void logWrite(SimpleFile_t *This, mt_off_t where, size_t len)
+{
+	struct writeRange_t *r;
+	dev_t dev;
+	ino_t ino;
+	unsigned int i;
+
+	if(S_ISBLK(This->statbuf.st_mode) || S_ISCHR(This->statbuf.st_mode)) {
+		dev = This->statbuf.st_rdev;
+		ino = 0;
+	} else {
+		dev = This->statbuf.st_dev;
+		ino = This->statbuf.st_ino;
+	}
+
+	writeLog->wrote = 1;
+	for(i=0; i < writeLog->nr && i < MAX_WRITE_RANGES; i++) {
+		r = &writeLog->ranges[i];
+		if(r->dev == dev && r->ino == ino &&
+		   where <= r->end && where + (mt_off_t) len >= r->start) {
+			/* touching or overlapping: merge */
+			if(where < r->start)
+				r->start = where;
+			if(where + (mt_off_t) len > r->end)
+				r->end = where + (mt_off_t) len;
+			return;
+		}
+	}
+	if(writeLog->nr < MAX_WRITE_RANGES) {
+		r = &writeLog->ranges[writeLog->nr];
+		r->dev = dev;
+		r->ino = ino;
+		r->start = where;
+		r->end = where + (mt_off_t) len;
+	}
+	if(writeLog->nr <= MAX_WRITE_RANGES)
+		writeLog->nr++;
+}
+
+static ssize_t do_io(SimpleFile_t *This, char *buf,
+		     mt_off_t where, size_t len,
+		     iofn io, piofn pio)
+{
+#ifdef HAVE_PIO
+	if(pio) {
+		ssize_t ret = pio(This->fd, buf, len, (off_t) where);
+		if(ret >= 0 || errno != ESPIPE)
+			return ret;
+		/* pipe or similar after all: fall back to sequential
+		 * I/O */
+		This->seekable = 0;
+	}
+#endif
+	return io(This->fd, buf, len);
+}
+
 static ssize_t file_io(SimpleFile_t *This, char *buf,
 		       mt_off_t where, size_t len,
-		       iofn io)
+		       iofn io, piofn pio)
 {
 	ssize_t ret;
 
-	if (This->seekable && where != This->lastwhere ){
+	if(writeLog && io != read)
+		logWrite(This, where, len);
+
+	/* positional I/O saves a seek, and does not depend on the file
+	 * offset, which might be shared with other processes. Either
+	 * always or never use it on a given file, as it does not move the
+	 * file offset */
+	if(!This->seekable || sizeof(off_t) < sizeof(mt_off_t))
+		pio = NULL;
+
+	if (!pio && This->seekable && where != This->lastwhere ){
 		if(mt_lseek( This->fd, where, SEEK_SET) < 0 ){
 			perror("seek");
 			return -1; /* If seek failed, lastwhere did
@@ -74,7 +163,7 @@ static ssize_t file_io(SimpleFile_t *This, char *buf,
 	if(This->size_limited && len > MAX_SCSI_LEN)
 		len = MAX_SCSI_LEN;
 #endif
-	ret = io(This->fd, buf, len);
+	ret = do_io(This, buf, where, len, io, pio);
 
 #ifdef OS_hpux
 	if (ret == -1 &&
@@ -82,7 +171,7 @@ static ssize_t file_io(SimpleFile_t *This, char *buf,
 		len > MAX_SCSI_LEN) {
 		This->size_limited = 1;
 		len = MAX_SCSI_LEN;
-		ret = io(This->fd, buf, len);
+		ret = do_io(This, buf, where, len, io, pio);
 	}
 #endif
 
@@ -97,27 +186,29 @@ static ssize_t file_io(SimpleFile_t *This, char *buf,
 static ssize_t file_read(Stream_t *Stream, char *buf, size_t len)
 {
 	DeclareThis(SimpleFile_t);
-	return file_io(This, buf, This->lastwhere, len, read);
+	return file_io(This, buf, This->lastwhere, len, read, PIO(pread));
 }
 
 static ssize_t file_write(Stream_t *Stream, char *buf, size_t len)
 {
 	DeclareThis(SimpleFile_t);
-	return file_io(This, buf, This->lastwhere, len, (iofn) write);
+	return file_io(This, buf, This->lastwhere, len, (iofn) write,
+		       PIO(pwrite));
 }
 
 static ssize_t file_pread(Stream_t *Stream, char *buf,
 			  mt_off_t where, size_t len)
 {
 	DeclareThis(SimpleFile_t);
-	return file_io(This, buf, where, len, read);
+	return file_io(This, buf, where, len, read, PIO(pread));
 }
 
 static ssize_t file_pwrite(Stream_t *Stream, char *buf,
 			   mt_off_t where, size_t len)
 {
 	DeclareThis(SimpleFile_t);
-	return file_io(This, buf, where, len, (iofn) write);
+	return file_io(This, buf, where, len, (iofn) write,
+		       PIO(pwrite));
 }
 
 static int file_flush(Stream_t *Stream UNUSEDP)
@@ -133,6 +224,13 @@ static int file_flush(Stream_t *Stream UNUSEDP)
 static int file_free(Stream_t *Stream)
 {
 	DeclareThis(SimpleFile_t);
+	SimpleFile_t **p;
+
+	for(p = &openFiles; *p; p = &(*p)->nextOpen)
+		if(*p == This) {
+			*p = This->nextOpen;
+			break;
+		}
 
 	if (This->fd > 2) {
 		int ret = close(This->fd);
@@ -283,6 +381,51 @@ Stream_t *SimpleFileOpen(struct device *dev, struct device *orig_dev,
 				    NULL);
 }
 
+/* set default parameters, if needed */
+static int file_init_params(SimpleFile_t *This, struct device *dev,
+			    struct device *orig_dev, int mode2,
+			    char *errmsg, int *geomFailure)
+{
+	if (dev){
+		errno=0;
+		if (((!IS_MFORMAT_ONLY(dev) && dev->tracks) ||
+		     mode2 & ALWAYS_GET_GEOMETRY) &&
+		    init_geom_with_reg(This->fd, dev, orig_dev,
+				       &This->statbuf)){
+			if(geomFailure && (errno==EBADF || errno==EPERM)) {
+				*geomFailure=1;
+				return 1;
+			} else if(errmsg)
+				sprintf(errmsg,"init: set default params");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Look for an already open image file which is the same as name, and
+ * which has been opened with sufficient access rights
+ */
+static SimpleFile_t *find_open_file(const char *name, int mode)
+{
+	struct MT_STAT statbuf;
+	SimpleFile_t *This;
+
+	if(!openFiles || MT_STAT(name, &statbuf) < 0)
+		return NULL;
+	for(This = openFiles; This; This = This->nextOpen) {
+		if(This->statbuf.st_dev != statbuf.st_dev ||
+		   This->statbuf.st_ino != statbuf.st_ino)
+			continue;
+		if((mode & O_ACCMODE) == O_RDONLY ||
+		   This->accmode == O_RDWR ||
+		   This->accmode == (mode & O_ACCMODE))
+			return This;
+	}
+	return NULL;
+}
+
 Stream_t *SimpleFileOpenWithLm(struct device *dev, struct device *orig_dev,
 			       const char *name, int mode, char *errmsg,
 			       int mode2, int locked, int lockMode,
@@ -296,6 +439,18 @@ APIRET rc;
 #endif
 	if (IS_SCSI(dev))
 		return NULL;
+
+	if((mode2 & SHARE_FD) && name && strcmp(name, "-") &&
+	   (This = find_open_file(name, mode | (dev ? dev->mode : 0)))) {
+		/* Another partition of the same image is already open:
+		 * share its descriptor */
+		if(file_init_params(This, dev, orig_dev, mode2,
+				    errmsg, geomFailure))
+			return NULL;
+		if(maxSize)
+			*maxSize = max_off_t_seek;
+		return COPY(&This->head);
+	}
 	This = New(SimpleFile_t);
 	if (!This){
 		printOom();
@@ -421,20 +576,12 @@ APIRET rc;
 	if(LockDevice(This->fd, dev, locked, lockMode, errmsg) < 0)
 		goto exit_0;
 
-	/* set default parameters, if needed */
-	if (dev){
-		errno=0;
-		if (((!IS_MFORMAT_ONLY(dev) && dev->tracks) ||
-		     mode2 & ALWAYS_GET_GEOMETRY) &&
-		    init_geom_with_reg(This->fd, dev, orig_dev,
-				       &This->statbuf)){
-			if(geomFailure && (errno==EBADF || errno==EPERM)) {
-				*geomFailure=1;
-				return NULL;
-			} else if(errmsg)
-				sprintf(errmsg,"init: set default params");
-			goto exit_0;
-		}
+	switch(file_init_params(This, dev, orig_dev, mode2,
+				errmsg, geomFailure)) {
+	case 1:
+		return NULL;
+	case -1:
+		goto exit_0;
 	}
 
 	if(maxSize)
@@ -442,6 +589,10 @@ APIRET rc;
 
 	This->lastwhere = 0;
 
+	This->accmode = mode & O_ACCMODE;
+	This->nextOpen = openFiles;
+	openFiles = This;
+
 	return &This->head;
  exit_0:
 	close(This->fd);
@@ -34,6 +34,23 @@ Stream_t *SimpleFileOpenWithLm(struct device *dev, struct device *orig_dev,
 int check_parameters(struct device *ref, struct device *testee);
 
 int get_fd(Stream_t *Stream);
+
+/* Where a process wrote, so that mserver can update its caches */
+#define MAX_WRITE_RANGES 128
+typedef struct writeLog_t {
+	int wrote;
+	/* number of ranges. More than MAX_WRITE_RANGES if some of them
+	 * could not be recorded */
+	unsigned int nr;
+	struct writeRange_t {
+		dev_t dev; /* st_rdev for devices */
+		ino_t ino; /* 0 for devices */
+		mt_off_t start;
+		mt_off_t end;
+	} ranges[MAX_WRITE_RANGES];
+} writeLog_t;
+
+void plain_io_log_writes(writeLog_t *log);
 void *get_extra_data(Stream_t *Stream);
 
 int LockDevice(int fd, struct device *dev,
@@ -41,17 +41,32 @@ typedef struct Remap_t {
 	int mapSize;
 
 	mt_off_t net_offset;
+
+	/* offset added to addresses before looking them up. Offset
+	 * layers stacked on top of us are folded into this */
+	mt_off_t shift;
 } Remap_t;
 
 static enum map_type_t remap(Remap_t *This, mt_off_t *start, size_t *len) {
-	int i;
-	for(i=0; i < This->mapSize - 1; i++)
-		if(*start < This->map[i+1].remapped) {
-			limitSizeToOffT(len, This->map[i+1].remapped - *start);
-			break;
-		}
-	*start = *start - This->map[i].remapped + This->map[i].orig;
-	return This->map[i].type;
+	int lo, hi;
+
+	*start += This->shift;
+
+	/* map is sorted by remapped address: look for the last item
+	 * starting at or before *start */
+	lo = 0;
+	hi = This->mapSize - 1;
+	while(lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if(This->map[mid].remapped <= *start)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	if(lo < This->mapSize - 1)
+		limitSizeToOffT(len, This->map[lo+1].remapped - *start);
+	*start = *start - This->map[lo].remapped + This->map[lo].orig;
+	return This->map[lo].type;
 }
 
 static ssize_t remap_pread(Stream_t *Stream, char *buf,
@@ -111,6 +126,17 @@ static Class_t RemapClass = {
 	0, /* discard */
 };
 
+/* Fold an offset layer into the remap stream, so that a request is
+ * translated only once. Returns -1 if Stream is not a remap stream */
+int remap_shift(Stream_t *Stream, mt_off_t offset)
+{
+	DeclareThis(Remap_t);
+	if(This->head.Class != &RemapClass)
+		return -1;
+	This->shift += offset;
+	return 0;
+}
+
 static int process_map(Remap_t *This, const char *ptr,
 		       int countOnly, char *errmsg) {
 	mt_off_t orig=0;
@@ -21,5 +21,6 @@
 #include "stream.h"
 
 Stream_t *Remap(Stream_t *Next, struct device *dev, char *errmsg);
+int remap_shift(Stream_t *Stream, mt_off_t offset);
 #endif
 
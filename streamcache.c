@@ -29,9 +29,17 @@ static Stream_t *fss[256]; /* open drives */
 
 static void finish_sc(void)
 {
-	int i;
+	int i, j, aliases;
 	for(i=0; i<256; i++){
-		if(fss[i] && fss[i]->refs != 1 )
+		if(!fss[i])
+			continue;
+		/* drives which are aliases of each other share their
+		 * filesystem (see fs_init) */
+		aliases = 1;
+		for(j=i+1; j<256; j++)
+			if(fss[j] == fss[i])
+				aliases++;
+		if(fss[i]->refs != aliases)
 			fprintf(stderr,"Streamcache allocation problem:%c %d\n",
 				i, fss[i]->refs);
 		FREE(&(fss[i]));
@@ -50,6 +58,14 @@ static void init_streamcache(void)
 	atexit(finish_sc);
 }
 
+/* Forget the cached stream for drive, if any */
+void uncache_drive(char drive)
+{
+	drive = (char)toupper(drive);
+	if(is_initialized && fss[(unsigned char)drive])
+		FREE(&(fss[(unsigned char)drive]));
+}
+
 Stream_t *open_root_dir(char drive, int flags, int *isRop)
 {
 	Stream_t *Fs;
@@ -70,6 +86,7 @@ Stream_t *open_root_dir(char drive, int flags, int *isRop)
 
 		fss[(unsigned char)drive] = Fs;
 	}
-
-	return OpenRoot(Fs);
+	/* the filesystem may be shared with aliases of this drive: its
+	 * files remember the letter they were opened through */
+	return OpenDriveRoot(Fs, drive);
 }
@@ -0,0 +1,392 @@
+/*  Copyright 2026 Alain Knaff.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * I/O tracing layer. Can be stacked between any two streams, and counts
+ * calls, bytes, time and seek distances of what goes through it. The
+ * statistics of all layers are printed as JSON at exit.
+ *
+ * Which layers are traced is chosen by MTOOLS_TRACE_IO, a comma
+ * separated list of layer names (device, image, fs) or all
+ */
+
+#include "sysincludes.h"
+#include "mtools.h"
+#include "trace_io.h"
+
+#define TRACE_BUCKETS 64
+
+enum {
+	OP_READ,
+	OP_WRITE,
+	OP_PREAD,
+	OP_PWRITE,
+	OP_DISCARD,
+	OP_MAX
+};
+
+static const char *opNames[OP_MAX] = {
+	"read", "write", "pread", "pwrite", "discard"
+};
+
+typedef unsigned long long counter_t;
+
+typedef struct OpStats_t {
+	counter_t calls;
+	counter_t errors;
+	counter_t bytes;
+	counter_t usecs;
+	counter_t maxUsecs;
+	counter_t sizes[TRACE_BUCKETS]; /* by log2 of requested size */
+	counter_t latencies[TRACE_BUCKETS]; /* by log2 of microseconds */
+} OpStats_t;
+
+/* Kept after the stream is freed, until they are printed at exit */
+typedef struct TraceStats_t {
+	struct TraceStats_t *next;
+	const char *layer;
+	char *name;
+
+	OpStats_t ops[OP_MAX];
+
+	/* distance between the end of a positioned access and the start
+	 * of the next one */
+	int haveLast;
+	mt_off_t lastEnd;
+	counter_t sequential;
+	counter_t seeks;
+	counter_t seekBytes;
+	counter_t seekDistances[TRACE_BUCKETS]; /* by log2 of bytes */
+} TraceStats_t;
+
+typedef struct TraceIo_t {
+	struct Stream_t head;
+
+	/* Class of Next, with those operations which it implements
+	 * replaced by traced versions */
+	Class_t class;
+	TraceStats_t *stats;
+} TraceIo_t;
+
+static TraceStats_t *allStats;
+
+static unsigned int bucket(counter_t v)
+{
+	unsigned int b = 0;
+
+	while(v > 1 && b < TRACE_BUCKETS - 1) {
+		v >>= 1;
+		b++;
+	}
+	return b;
+}
+
+static counter_t now(void)
+{
+#if defined HAVE_CLOCK_GETTIME && defined CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (counter_t) ts.tv_sec * 1000000 +
+		(counter_t) ts.tv_nsec / 1000;
+#else
+	return (counter_t) time(NULL) * 1000000;
+#endif
+}
+
+static void account(TraceStats_t *stats, int op, size_t len, ssize_t ret,
+		    counter_t start)
+{
+	OpStats_t *o = &stats->ops[op];
+	counter_t usecs = now() - start;
+
+	o->calls++;
+	if(ret < 0)
+		o->errors++;
+	else
+		o->bytes += (counter_t) ret;
+	o->usecs += usecs;
+	if(usecs > o->maxUsecs)
+		o->maxUsecs = usecs;
+	o->sizes[bucket(len)]++;
+	o->latencies[bucket(usecs)]++;
+}
+
+static void accountSeek(TraceStats_t *stats, mt_off_t start, size_t len)
+{
+	mt_off_t distance;
+
+	if(stats->haveLast) {
+		distance = start - stats->lastEnd;
+		if(distance < 0)
+			distance = -distance;
+		if(!distance)
+			stats->sequential++;
+		else {
+			stats->seeks++;
+			stats->seekBytes += (counter_t) distance;
+			stats->seekDistances[bucket((counter_t) distance)]++;
+		}
+	}
+	stats->haveLast = 1;
+	stats->lastEnd = start + (mt_off_t) len;
+}
+
+static ssize_t trace_read(Stream_t *Stream, char *buf, size_t len)
+{
+	DeclareThis(TraceIo_t);
+	counter_t start = now();
+	ssize_t ret = READS(This->head.Next, buf, len);
+
+	account(This->stats, OP_READ, len, ret, start);
+	return ret;
+}
+
+static ssize_t trace_write(Stream_t *Stream, char *buf, size_t len)
+{
+	DeclareThis(TraceIo_t);
+	counter_t start = now();
+	ssize_t ret = WRITES(This->head.Next, buf, len);
+
+	account(This->stats, OP_WRITE, len, ret, start);
+	return ret;
+}
+
+static ssize_t trace_pread(Stream_t *Stream, char *buf,
+			   mt_off_t where, size_t len)
+{
+	DeclareThis(TraceIo_t);
+	counter_t start = now();
+	ssize_t ret = PREADS(This->head.Next, buf, where, len);
+
+	account(This->stats, OP_PREAD, len, ret, start);
+	accountSeek(This->stats, where, len);
+	return ret;
+}
+
+static ssize_t trace_pwrite(Stream_t *Stream, char *buf,
+			    mt_off_t where, size_t len)
+{
+	DeclareThis(TraceIo_t);
+	counter_t start = now();
+	ssize_t ret = PWRITES(This->head.Next, buf, where, len);
+
+	account(This->stats, OP_PWRITE, len, ret, start);
+	accountSeek(This->stats, where, len);
+	return ret;
+}
+
+static int trace_discard(Stream_t *Stream)
+{
+	DeclareThis(TraceIo_t);
+	counter_t start = now();
+	int ret = DISCARD(This->head.Next);
+
+	account(This->stats, OP_DISCARD, 0, ret, start);
+	return ret;
+}
+
+static int trace_pre_allocate(Stream_t *Stream, mt_off_t size)
+{
+	return PRE_ALLOCATE(Stream->Next, size);
+}
+
+static int trace_free(Stream_t *Stream UNUSEDP)
+{
+	/* statistics stay around until exit */
+	return 0;
+}
+
+static void printHistogram(FILE *f, const char *label, counter_t *hist)
+{
+	unsigned int b;
+	const char *sep = "";
+
+	fprintf(f, "\"%s\":{", label);
+	for(b=0; b < TRACE_BUCKETS; b++) {
+		if(!hist[b])
+			continue;
+		fprintf(f, "%s\"%llu\":%llu", sep,
+			b ? 1ull << b : 0ull, hist[b]);
+		sep = ",";
+	}
+	fprintf(f, "}");
+}
+
+static void printString(FILE *f, const char *s)
+{
+	putc('"', f);
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if((unsigned char) *s < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char) *s);
+		else
+			putc(*s, f);
+	}
+	putc('"', f);
+}
+
+static void dumpStats(void)
+{
+	FILE *f = stderr;
+	TraceStats_t *stats;
+	const char *sep = "";
+	const char *opSep;
+	int op;
+
+	if(!allStats)
+		return;
+	if(mtools_trace_file) {
+		f = fopen(mtools_trace_file, "w");
+		if(!f) {
+			perror(mtools_trace_file);
+			return;
+		}
+	}
+
+	fprintf(f, "{\"layers\":[");
+	for(stats = allStats; stats; stats = stats->next) {
+		fprintf(f, "%s\n{\"layer\":\"%s\",\"name\":", sep,
+			stats->layer);
+		printString(f, stats->name);
+		fprintf(f, ",\"ops\":{");
+		opSep = "";
+		for(op=0; op < OP_MAX; op++) {
+			OpStats_t *o = &stats->ops[op];
+			if(!o->calls)
+				continue;
+			fprintf(f, "%s\n \"%s\":{\"calls\":%llu,\"errors\":%llu,"
+				"\"bytes\":%llu,\"usecs\":%llu,"
+				"\"max_usecs\":%llu,",
+				opSep, opNames[op], o->calls, o->errors,
+				o->bytes, o->usecs, o->maxUsecs);
+			printHistogram(f, "sizes", o->sizes);
+			putc(',', f);
+			printHistogram(f, "latencies_us", o->latencies);
+			putc('}', f);
+			opSep = ",";
+		}
+		fprintf(f, "},\n \"seeks\":{\"sequential\":%llu,"
+			"\"seeks\":%llu,\"bytes\":%llu,",
+			stats->sequential, stats->seeks, stats->seekBytes);
+		printHistogram(f, "distances", stats->seekDistances);
+		fprintf(f, "}}");
+		sep = ",";
+	}
+	fprintf(f, "\n]}\n");
+	if(f != stderr)
+		fclose(f);
+}
+
+/* Is layer one of the comma separated names in MTOOLS_TRACE_IO? */
+static int isTraced(const char *layer)
+{
+	const char *p = mtools_trace_io;
+	size_t len = strlen(layer);
+
+	if(!p)
+		return 0;
+	while(*p) {
+		size_t n = strcspn(p, ",");
+		if((n == len && !strncmp(p, layer, len)) ||
+		   (n == 3 && !strncmp(p, "all", 3)))
+			return 1;
+		p += n;
+		if(*p)
+			p++;
+	}
+	return 0;
+}
+
+/*
+ * Push a tracing layer on top of Next, if MTOOLS_TRACE_IO asks for this
+ * layer. Returns Next itself otherwise, or if out of memory
+ */
+Stream_t *OpenTraceIo(Stream_t *Next, const char *layer, const char *name)
+{
+	TraceIo_t *This;
+	TraceStats_t *stats;
+	Class_t *c;
+
+	if(!Next || !isTraced(layer))
+		return Next;
+
+	This = New(TraceIo_t);
+	if(!This)
+		return Next;
+	stats = New(TraceStats_t);
+	if(!stats) {
+		Free(This);
+		return Next;
+	}
+	memset(stats, 0, sizeof(*stats));
+	stats->layer = layer;
+	stats->name = strdup(name ? name : "");
+	if(!stats->name) {
+		Free(stats);
+		Free(This);
+		return Next;
+	}
+	stats->next = allStats;
+	allStats = stats;
+
+	/* Only offer what Next offers: callers check for null methods */
+	c = Next->Class;
+	memset(&This->class, 0, sizeof(This->class));
+	if(c->read)
+		This->class.read = trace_read;
+	if(c->write)
+		This->class.write = trace_write;
+	if(c->pread)
+		This->class.pread = trace_pread;
+	if(c->pwrite)
+		This->class.pwrite = trace_pwrite;
+	/* flush walks down the stack by itself */
+	This->class.freeFunc = trace_free;
+	if(c->set_geom)
+		This->class.set_geom = set_geom_pass_through;
+	if(c->get_data)
+		This->class.get_data = get_data_pass_through;
+	if(c->pre_allocate)
+		This->class.pre_allocate = trace_pre_allocate;
+	if(c->get_dosConvert)
+		This->class.get_dosConvert = get_dosConvert_pass_through;
+	if(c->discard)
+		This->class.discard = trace_discard;
+
+	init_head(&This->head, &This->class, Next);
+	This->stats = stats;
+	return &This->head;
+}
+
+/*
+ * Called once the configuration has been read. Registered this early, the
+ * dump runs after the exit handlers which close the drives, so that their
+ * final writes get counted too
+ */
+void trace_io_init(void)
+{
+	if(mtools_trace_io && *mtools_trace_io)
+		atexit(dumpStats);
+}
+
+/* Skip over tracing layers, for code looking for a particular class */
+Stream_t *trace_io_skip(Stream_t *Stream)
+{
+	while(Stream && Stream->Class->freeFunc == trace_free)
+		Stream = Stream->Next;
+	return Stream;
+}
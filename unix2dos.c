@@ -1,4 +1,4 @@
-/*  Copyright 1996,1997,1999,2001-2003,2008,2009,2021 Alain Knaff.
+/*  Copyright 1996,1997,1999,2001-2003,2008,2009,2021,2026 Alain Knaff.
  *  This file is part of mtools.
  *
  *  Mtools is free software: you can redistribute it and/or modify
@@ -18,7 +18,7 @@
 #include "sysincludes.h"
 #include "mtools.h"
 
-#define U2D_BUFSIZE 4096
+#define U2D_BUFSIZE 65536
 
 typedef struct Filter_t {
 	struct Stream_t head;
@@ -32,53 +32,64 @@ typedef struct Filter_t {
 	bool eof;
 } Filter_t;
 
-/* Add CR before NL, and 0x1a at end of file */
+/* Add CR before NL, and 0x1a at end of file. Text between newlines is
+ * located with memchr and copied in bulk */
 static ssize_t read_filter(Stream_t *Stream, char *output, size_t len)
 {
 	DeclareThis(Filter_t);
-	size_t i;
-	
-	if(This->eof)
-		return 0;
-	
-	for(i=0; i < len && !This->eof; i++) {
-		char c;
+	size_t i=0;
+
+	while(i < len && !This->eof) {
+		char *start, *nl;
+		size_t n;
+
 		if(This->pendingNl) {
-			c='\n';
+			output[i++] = '\n';
 			This->pendingNl=false;
-		} else {
-			if(This->bufPos == This->readBytes) {
-				ssize_t ret = READS(This->head.Next,
-						    This->buffer,
-						    U2D_BUFSIZE);
-				if(ret < 0) {
-					/* an error */
-					/* If we already have read some data,
-					 * first return count of that data
-					 * before returning error */
-					if(i == 0)
-						return -1;
-					else
-						break;
-				}
-				This->readBytes = (size_t) ret;
-				This->bufPos = 0;
-			}
+			continue;
+		}
 
-			if(This->bufPos == This->readBytes) {
+		if(This->bufPos == This->readBytes) {
+			ssize_t ret = READS(This->head.Next,
+					    This->buffer,
+					    U2D_BUFSIZE);
+			if(ret < 0) {
+				/* an error */
+				/* If we already have read some data,
+				 * first return count of that data
+				 * before returning error */
+				if(i == 0)
+					return -1;
+				else
+					break;
+			}
+			This->readBytes = (size_t) ret;
+			This->bufPos = 0;
+			if(ret == 0) {
 				/* Still at end of buffer, must be end
 				   of file */
-				c='\032';
+				output[i++] = '\032';
 				This->eof=true;
-			} else {
-				c = This->buffer[This->bufPos++];
-				if(c == '\n') {
-					This->pendingNl=true;
-					c = '\r';
-				}
+				break;
 			}
 		}
-		output[i]=c;
+
+		start = This->buffer + This->bufPos;
+		n = This->readBytes - This->bufPos;
+		if(n > len - i)
+			n = len - i;
+		nl = memchr(start, '\n', n);
+		if(nl)
+			n = ptrdiff(nl, start);
+		memcpy(output + i, start, n);
+		i += n;
+		This->bufPos += n;
+		if(nl) {
+			/* there is room for at least this one */
+			output[i++] = '\r';
+			This->bufPos++;
+			This->pendingNl=true;
+		}
 	}
 
 	return (ssize_t) i;
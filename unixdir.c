@@ -1,4 +1,4 @@
-/*  Copyright 1998-2002,2009 Alain Knaff.
+/*  Copyright 1998-2002,2009,2026 Alain Knaff.
  *  This file is part of mtools.
  *
  *  Mtools is free software: you can redistribute it and/or modify
@@ -117,30 +117,90 @@ static Class_t DirClass = {
 	0 /* discard */
 };
 
+static int unix_dir_entry(Stream_t *Stream, MainParam_t *mp,
+			  const char *name)
+{
+	DeclareThis(Dir_t);
+	char *newName;
+	int ret;
+
+	newName = malloc(strlen(This->pathname) + 1 + strlen(name) + 1);
+	if(!newName)
+		return ERROR_ONE;
+	strcpy(newName, This->pathname);
+	strcat(newName, "/");
+	strcat(newName, name);
+
+	ret = unix_loop(Stream, mp, newName, 0);
+	free(newName);
+	return ret;
+}
+
+static int compareNames(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * In deterministic mode, the names are sorted first, so that files are
+ * copied in the same order whatever order readdir returns them in
+ */
+static int unix_sorted_dir_loop(Stream_t *Stream, MainParam_t *mp)
+{
+	DeclareThis(Dir_t);
+	struct dirent *entry;
+	char **names = NULL, **newNames;
+	size_t nr = 0, max = 0, i;
+	int ret = 0;
+	int failed = 0;
+
+	while((entry=readdir(This->dir)) != NULL) {
+		if(isSpecial(entry->d_name))
+			continue;
+		if(nr == max) {
+			max = max ? 2 * max : 64;
+			newNames = realloc(names, max * sizeof(*names));
+			if(!newNames) {
+				failed = 1;
+				break;
+			}
+			names = newNames;
+		}
+		names[nr] = strdup(entry->d_name);
+		if(!names[nr]) {
+			failed = 1;
+			break;
+		}
+		nr++;
+	}
+
+	if(!failed && nr)
+		qsort(names, nr, sizeof(*names), compareNames);
+	for(i=0; i < nr; i++) {
+		/* if the names could not all be read, copy none */
+		if(!failed && !got_signal)
+			ret |= unix_dir_entry(Stream, mp, names[i]);
+		free(names[i]);
+	}
+	free(names);
+	return failed ? ERROR_ONE : ret;
+}
+
 int unix_dir_loop(Stream_t *Stream, MainParam_t *mp)
 {
 	DeclareThis(Dir_t);
 	struct dirent *entry;
-	char *newName;
 	int ret=0;
 
+	if(mtools_deterministic)
+		return unix_sorted_dir_loop(Stream, mp);
+
 	while((entry=readdir(This->dir)) != NULL) {
 		if(got_signal)
 			break;
 		if(isSpecial(entry->d_name))
 			continue;
-		newName = malloc(strlen(This->pathname) + 1 +
-				 strlen(entry->d_name) + 1);
-		if(!newName) {
-			ret = ERROR_ONE;
-			break;
-		}
-		strcpy(newName, This->pathname);
-		strcat(newName, "/");
-		strcat(newName, entry->d_name);
-
-		ret |= unix_loop(Stream, mp, newName, 0);
-		free(newName);
+		ret |= unix_dir_entry(Stream, mp, entry->d_name);
 	}
 	return ret;
 }
@@ -27,6 +27,7 @@
 #include "dirCache.h"
 #include "dirCacheP.h"
 #include "file_name.h"
+#include "match.h"
 #include "stream.h"
 
 /* #define DEBUG */
@@ -569,8 +570,7 @@ typedef enum result_t {
  */
 static result_t checkNameForMatch(struct direntry_t *direntry,
 				  dirCacheEntry_t *dce,
-				  const wchar_t *filename,
-				  int length,
+				  const pattern_t *pattern,
 				  int flags)
 {
 	switch(dce->type) {
@@ -598,8 +598,8 @@ static result_t checkNameForMatch(struct direntry_t *direntry,
 	/*---------- multiple files ----------*/
 	if(!((flags & MATCH_ANY) ||
 	     (dce->longName &&
-	      match(dce->longName, filename, direntry->name, 0, length)) ||
-	     match(dce->shortName, filename, direntry->name, 1, length))) {
+	      match_pattern(pattern, dce->longName, direntry->name)) ||
+	     match_pattern(pattern, dce->shortName, direntry->name))) {
 
 		return RES_NOMATCH;
 	}
@@ -651,18 +651,41 @@ int vfat_lookup(direntry_t *direntry, const char *filename,
 		int flags, char *shortname, size_t shortname_size,
 		char *longname, size_t longname_size)
 {
-	dirCacheEntry_t *dce;
-	result_t result;
-	dirCache_t *cache;
-	int io_error;
+	pattern_t pattern;
+
+	vfat_compile_pattern(&pattern, filename, length);
+	return vfat_lookup_pattern(direntry, &pattern, flags,
+				   shortname, shortname_size,
+				   longname, longname_size);
+}
+
+void vfat_compile_pattern(struct pattern_t *pattern,
+			  const char *filename, size_t length)
+{
 	wchar_t wfilename[MAX_VNAMELEN+1];
-	doscp_t *cp = GET_DOSCONVERT(direntry->Dir);
 
 	if(filename != NULL)
 		length = native_to_wchar(filename, wfilename, MAX_VNAMELEN,
 					 filename+length, 0);
 	else
 		length = 0;
+	compile_pattern(pattern, wfilename, length);
+}
+
+/*
+ * Same as vfat_lookup, but with a pattern compiled beforehand, so that
+ * repeated lookups in a loop only compile it once
+ */
+int vfat_lookup_pattern(direntry_t *direntry,
+			const struct pattern_t *pattern,
+			int flags, char *shortname, size_t shortname_size,
+			char *longname, size_t longname_size)
+{
+	dirCacheEntry_t *dce;
+	result_t result;
+	dirCache_t *cache;
+	int io_error;
+	doscp_t *cp = GET_DOSCONVERT(direntry->Dir);
 
 	if (isNotFound(direntry))
 		return -1;
@@ -673,6 +696,25 @@ int vfat_lookup(direntry_t *direntry, const char *filename,
 		exit(1);
 	}
 
+	/* A literal name is looked up in the directory cache's name
+	 * index: if it is there, the scan starts at its entry, and if it
+	 * isn't, it skips over the cached entries, or, if the whole
+	 * directory is cached, doesn't happen at all */
+	if(pattern->isLiteral && !(flags & MATCH_ANY) &&
+	   getNextEntryAsPos(direntry) == 0) {
+		dce = findInDirCache(cache, pattern->name);
+		if(dce)
+			setEntryForIteration(direntry, dce->beginSlot);
+		else if(!isHashed(cache, pattern->name)) {
+			if(cache->complete) {
+				direntry->entry = NOT_FOUND_ENTRY;
+				return -1;
+			}
+			if(cache->nrCached)
+				setEntryToPos(direntry, cache->nrCached - 1);
+		}
+	}
+
 	do {
 		dce = vfat_lookup_loop_for_read(cp, direntry, cache, &io_error);
 		if(!dce) {
@@ -681,9 +723,7 @@ int vfat_lookup(direntry_t *direntry, const char *filename,
 			fprintf(stderr, "Out of memory error in vfat_lookup\n");
 			exit(1);
 		}
-		result = checkNameForMatch(direntry, dce,
-					   wfilename,
-					   (int) length, flags);
+		result = checkNameForMatch(direntry, dce, pattern, flags);
 	} while(result == RES_NOMATCH);
 
 	if(result == RES_MATCH){
@@ -783,6 +823,7 @@ int lookupForInsert(Stream_t *Dir,
 	unsigned int pos; /* position _before_ the next answered entry */
 	wchar_t shortName[13];
 	wchar_t wlongname[MAX_VNAMELEN+1];
+	int longKnown, shortKnown, quick;
 	doscp_t *cp = GET_DOSCONVERT(Dir);
 
 	native_to_wchar(longname, wlongname, MAX_VNAMELEN+1, 0, 0);
@@ -806,19 +847,42 @@ int lookupForInsert(Stream_t *Dir,
 		unix_name(cp, dosname->base, dosname->ext, 0, shortName);
 
 	pos = cache->nrHashed;
-	if(source_entry >= 0 ||
-	   (pos && isHashed(cache, wlongname))) {
+	longKnown = isHashed(cache, wlongname);
+	shortKnown = !ignore_match && isHashed(cache, shortName);
+	if(longKnown) {
 		pos = 0;
-	} else if(pos && !ignore_match && isHashed(cache, shortName)) {
-		if(pessimisticShortRename) {
+	} else if(shortKnown) {
+		if(pessimisticShortRename && source_entry < 0) {
 			ssp->shortmatch = -2;
 			return 1;
 		}
+		/* only a short name clashes, and the index knows where */
+		dce = cache->complete ? findShortInDirCache(cache, shortName) : 0;
+		if(dce && !(dce->dir.attr & 0x8) &&
+		   (signed int)dce->endSlot-1 != ignore_entry) {
+			ssp->shortmatch = (int) (dce->endSlot - 1);
+			return 1;
+		}
+		pos = 0;
+	} else if(source_entry >= 0) {
 		pos = 0;
 	} else if(growDirCache(cache, pos) < 0) {
 		fprintf(stderr, "Out of memory error in vfat_looup [0]\n");
 		exit(1);
 	}
+
+	/* If the whole directory is cached, and neither name is in the
+	 * cache's index, nothing can clash: the scan only needs to find
+	 * free slots, and stops as soon as it has them. The entries before
+	 * nrHashed are all in use, except maybe for the source entry */
+	quick = cache->complete && !longKnown && !shortKnown;
+	if(quick && source_entry >= 0) {
+		dce = lookupInDircache(cache, (unsigned int) source_entry);
+		if(dce && dce->beginSlot < cache->nrHashed)
+			pos = dce->beginSlot;
+		else
+			pos = cache->nrHashed;
+	}
 	do {
 		dce = vfat_lookup_loop_for_insert(cp, &entry, pos, cache);
 		switch(dce->type) {
@@ -861,6 +925,8 @@ int lookupForInsert(Stream_t *Dir,
 				break;
 		}
 		pos = dce->endSlot;
+		if(quick && ssp->got_slots)
+			break;
 	} while(dce->type != DCET_END);
 	if (ssp->shortmatch > -1)
 		return 1;